@@ -0,0 +1,44 @@
+#include "admission.h"
+
+#include <chrono>
+
+AdmissionController::AdmissionController(size_t limit) : _limit(limit)
+{
+}
+
+uint64_t AdmissionController::acquire()
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    if (in_use < _limit)
+    {
+        ++in_use;
+        return 0;
+    }
+    auto start = std::chrono::steady_clock::now();
+    ++waiting;
+    freed.wait(lock, [this] { return in_use < _limit; });
+    --waiting;
+    ++in_use;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+bool AdmissionController::try_acquire()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    // Waiters come first
+    if ((in_use >= _limit) || waiting) return false;
+    ++in_use;
+    return true;
+}
+
+void AdmissionController::release()
+{
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        --in_use;
+        wake = (waiting != 0);
+    }
+    if (wake) freed.notify_one();
+}
@@ -0,0 +1,37 @@
+#ifndef __ADMISSION_H_
+#define __ADMISSION_H_
+
+// Admission control: at most limit holders at once, for any limit that
+// fits in memory. A would-be holder either waits for a slot, and learns
+// how long it waited, or is turned away at once. Shared by threads.
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+class AdmissionController
+{
+public:
+    explicit AdmissionController(size_t limit);
+    AdmissionController() = delete;
+    AdmissionController(const AdmissionController&) = delete;
+    AdmissionController& operator=(const AdmissionController&) = delete;
+
+    // Waits for a slot. Returns the nanoseconds waited, 0 if none.
+    uint64_t acquire();
+    // Takes a slot if one is free
+    bool try_acquire();
+    void release();
+
+    size_t limit() const { return _limit; }
+
+private:
+    std::mutex mtx;
+    std::condition_variable freed;
+    size_t _limit;
+    size_t in_use{0};
+    size_t waiting{0};
+};
+
+#endif // __ADMISSION_H_
@@ -0,0 +1,68 @@
+#include "affinity.h"
+#include "miscutils.h"
+
+#include <cerrno>
+#include <pthread.h>
+#include <sys/socket.h>
+
+bool parse_cpu_list(const std::string& list, cpu_set_t& cpus)
+{
+    CPU_ZERO(&cpus);
+    auto ranges = mstrtok(list, ',');
+    if (ranges.empty()) return false;
+    for (const std::string& range : ranges)
+    {
+        auto ends = mstrtok(range, '-');
+        if ((ends.size() < 1) || (ends.size() > 2)) return false;
+        for (const std::string& end : ends)
+        {
+            if (!represents_counting(end) || (end.size() > 6)) return false;
+        }
+        unsigned long first = std::stoul(ends[0]);
+        unsigned long last = (ends.size() == 2) ? std::stoul(ends[1]) : first;
+        if ((first > last) || (last >= CPU_SETSIZE)) return false;
+        for (unsigned long cpu = first ; cpu <= last ; ++cpu)
+        {
+            CPU_SET(cpu, &cpus);
+        }
+    }
+    return true;
+}
+
+cpu_set_t process_cpus()
+{
+    cpu_set_t cpus;
+    NEGCHECK("sched_getaffinity", sched_getaffinity(0, sizeof(cpus), &cpus));
+    return cpus;
+}
+
+void pin_thread(const cpu_set_t& cpus)
+{
+    int ern = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (ern)
+    {
+        errno = ern;
+        errorexit("pthread_setaffinity_np");
+    }
+}
+
+void pin_thread(int cpu)
+{
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    pin_thread(cpus);
+}
+
+int incoming_cpu(int socket)
+{
+    int cpu = -1;
+#ifdef SO_INCOMING_CPU
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(socket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0)
+    {
+        cpu = -1;
+    }
+#endif
+    return cpu;
+}
@@ -0,0 +1,26 @@
+#ifndef __AFFINITY_H_
+#define __AFFINITY_H_
+
+// Thread placement. A relay thread that runs on the core where the kernel
+// processed its socket's packets, usually the core that takes the NIC
+// queue's interrupts, finds the socket buffers in its own cache.
+
+#include <string>
+#include <sched.h>
+
+// A list such as "0-3,8,10-11". False if list is malformed or names a CPU
+// beyond CPU_SETSIZE.
+bool parse_cpu_list(const std::string& list, cpu_set_t& cpus);
+
+// The CPUs that the process may run on, as inherited
+cpu_set_t process_cpus();
+
+// Moves the calling thread onto cpus. Exits on failure.
+void pin_thread(const cpu_set_t& cpus);
+void pin_thread(int cpu);
+
+// SO_INCOMING_CPU: the CPU that last processed packets for socket, or -1
+// if unknown.
+int incoming_cpu(int socket);
+
+#endif // __AFFINITY_H_
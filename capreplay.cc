@@ -0,0 +1,286 @@
+// Replays a capture made by tcppipe -capture. The recorded sessions are
+// connected to the target concurrently, each on its own thread, at the
+// recorded times or scaled ones, and the bytes that each client sent are
+// sent again on the same schedule. Whatever the target answers is read
+// and counted. A summary goes to stderr at the end; -verbose 1 adds each
+// session.
+//
+// A tcppipe that was killed leaves its capture file at full size, with
+// zeros after the last record. The replay stops at the first record
+// header that is still zero, and says how much it ignored.
+
+#include "capture.h"
+#include "commonutils.h"
+#include "logger.h"
+#include "miscutils.h"
+#include "netutils.h"
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+// Tuning (compile time)
+constexpr int default_speed_percent{100};
+constexpr size_t replay_read_size{64*1024};
+
+using Clock = std::chrono::steady_clock;
+
+struct ReplayEvent
+{
+    int64_t nsec;
+    capture_event event;
+    const unsigned char* data;
+    size_t length;
+};
+
+struct Session
+{
+    std::vector<ReplayEvent> events;   // Open, data sent, close
+    size_t recorded_sent{0};
+    size_t recorded_received{0};
+    // Results of the replay
+    bool connected{false};
+    bool failed{false};                // A write failed
+    size_t sent{0};
+    size_t received{0};
+};
+
+void usage_error();  // Note: will be exported for use in commonutils.
+static void replay(unsigned session_num, Session& session,
+    const Uri& target, Clock::time_point start, int64_t first_nsec,
+    int speed);
+
+int main(int argc, char* argv[])
+{
+    // Process inputs
+    int argc_copy = argc - 1;
+    char** argv_copy = argv;
+    ++argv_copy;
+    int speed = default_speed_percent;
+    unsigned only_session = 0;
+    while (argc_copy >= 2)
+    {
+        if (strcmp(argv_copy[0], "-verbose") == 0)
+        {
+            set_log_level(mstoi(argv_copy[1]));
+        }
+        else if (strcmp(argv_copy[0], "-speed") == 0)
+        {
+            speed = mstoi(argv_copy[1], true);
+        }
+        else if (strcmp(argv_copy[0], "-session") == 0)
+        {
+            only_session = mstoi(argv_copy[1]);
+        }
+        else
+        {
+            break;
+        }
+        argv_copy += 2;
+        argc_copy -= 2;
+    }
+    if (argc_copy < 1) usage_error();
+    std::string path = argv_copy[0];
+    ++argv_copy;
+    --argc_copy;
+    Uri target = process_args(argc_copy, argv_copy);
+    if (target.listening || (target.ports[0] == -1) || (argc_copy != 0))
+    {
+        usage_error();
+    }
+
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+    {
+        perror("signal");
+        exit(1);
+    }
+
+    try
+    {
+        // Sessions, each in order. The reader outlives the threads.
+        CaptureReader reader(path);
+        std::map<unsigned, Session> sessions;
+        CaptureRecord record;
+        const unsigned char* payload;
+        int64_t first_nsec = std::numeric_limits<int64_t>::max();
+        while (reader.next(record, payload))
+        {
+            if (only_session && (record.session != only_session)) continue;
+            Session& session = sessions[record.session];
+            capture_event event = (capture_event)record.event;
+            if ((event == capture_event::data) && record.direction)
+            {
+                session.recorded_received += record.length;
+                continue;
+            }
+            if (event == capture_event::data)
+            {
+                session.recorded_sent += record.length;
+            }
+            session.events.push_back(
+                {record.nsec, event, payload, record.length});
+            first_nsec = std::min(first_nsec, record.nsec);
+        }
+        LOG(1, 0) << sessions.size() << " sessions in " << path;
+        if (reader.unread())
+        {
+            std::cerr << my_time() << " ignored the last " <<
+                reader.unread() << " bytes of " << path <<
+                ", past the last complete record" << std::endl;
+        }
+
+        Clock::time_point start = Clock::now();
+        std::vector<std::thread> threads;
+        for (auto& [session_num, session] : sessions)
+        {
+            if (session.events.empty()) continue;
+            threads.emplace_back(replay, session_num, std::ref(session),
+                std::cref(target), start, first_nsec, speed);
+        }
+        for (std::thread& t : threads) t.join();
+
+        double seconds =
+            std::chrono::duration<double>(Clock::now() - start).count();
+        size_t connected = 0;
+        size_t failed = 0;
+        size_t sent = 0;
+        size_t recorded_sent = 0;
+        size_t received = 0;
+        size_t recorded_received = 0;
+        for (const auto& [session_num, session] : sessions)
+        {
+            if (session.events.empty()) continue;
+            connected += session.connected;
+            failed += session.failed;
+            sent += session.sent;
+            recorded_sent += session.recorded_sent;
+            received += session.received;
+            recorded_received += session.recorded_received;
+        }
+        std::cerr << my_time() << " " << threads.size() <<
+            " sessions replayed in " << seconds << " s: " << connected <<
+            " connected, " << threads.size() - connected <<
+            " could not connect, " << failed << " failed writing" <<
+            std::endl;
+        std::cerr << my_time() << " sent " << sent << " bytes (" <<
+            recorded_sent << " recorded), received " << received <<
+            " bytes (" << recorded_received << " recorded)" << std::endl;
+    }
+    catch (const CaptureException& c)
+    {
+        std::cerr << my_time() << " " << c.strng << std::endl;
+        exit(1);
+    }
+    catch (const NetutilsException& r)
+    {
+        std::cerr << my_time() << " " << r.strng << std::endl;
+        exit(1);
+    }
+    return 0;
+}
+
+void usage_error()
+{
+    std::cerr << "Usage: capreplay [-verbose n(" << default_log_level <<
+        ")] [-speed percent(" << default_speed_percent << ")] "
+        "[-session n]" << std::endl;
+    std::cerr << "    <capture_file> <target_spec>" << std::endl;
+    std::cerr << "<target_spec> can be one of" << std::endl;
+    std::cerr << "    -connect <hostname>:<port_number>" << std::endl;
+    std::cerr << "    -connect_unix <path>" << std::endl;
+    std::cerr << "and can be followed by" << std::endl;
+    std::cerr << "    -sockopt <option,option,...>" << std::endl;
+    std::cerr << "Speed 0 sends everything without waiting." << std::endl;
+    exit (1);
+}
+
+// Sends a session's client bytes to target, on the recorded schedule
+// divided by speed percent, while a second thread reads the answers.
+void replay(unsigned session_num, Session& session,
+    const Uri& target, Clock::time_point start, int64_t first_nsec,
+    int speed)
+{
+    auto wait_for = [&] (int64_t nsec)
+    {
+        if (speed == 0) return;
+        std::this_thread::sleep_until(start + std::chrono::nanoseconds(
+            (nsec - first_nsec) * 100 / speed));
+    };
+
+    wait_for(session.events.front().nsec);
+    int sock;
+    try
+    {
+        sock = target.unix_path.empty()
+            ? socket_from_address(session_num, target.hostname,
+                target.ports[0], std::numeric_limits<unsigned>::max(),
+                target.sockopts)
+            : socket_from_unix_path(session_num, target.unix_path,
+                std::numeric_limits<unsigned>::max(), target.sockopts);
+    }
+    catch (const NetutilsException& r)
+    {
+        LOG(1, session_num) << r.strng;
+        return;
+    }
+    if (sock < 0)
+    {
+        LOG(1, session_num) << "connect failed: " << strerror(errno);
+        return;
+    }
+    session.connected = true;
+    // Blocking: one thread writes, and another reads.
+    ZEROCHECK("fcntl",
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) & ~O_NONBLOCK));
+
+    size_t& received = session.received;
+    std::thread reader([sock, &received] ()
+    {
+        std::vector<unsigned char> buffer(replay_read_size);
+        ssize_t count;
+        while ((count = read(sock, buffer.data(), buffer.size())) > 0)
+        {
+            received += count;
+        }
+    });
+
+    size_t& sent = session.sent;
+    bool& failed = session.failed;
+    for (const ReplayEvent& event : session.events)
+    {
+        if (event.event != capture_event::data) continue;
+        wait_for(event.nsec);
+        size_t done = 0;
+        while (done < event.length)
+        {
+            ssize_t count =
+                write(sock, event.data + done, event.length - done);
+            if (count <= 0)
+            {
+                LOG(1, session_num) << "write failed after " <<
+                    (sent + done) << " bytes: " << strerror(errno);
+                failed = true;
+                break;
+            }
+            done += count;
+        }
+        sent += done;
+        if (failed) break;
+    }
+    if (!failed) wait_for(session.events.back().nsec);
+    shutdown(sock, failed ? SHUT_RDWR : SHUT_WR);
+    reader.join();
+    close(sock);
+    LOG(1, session_num) << "sent " << sent << " bytes (" <<
+        session.recorded_sent << " recorded), received " << received <<
+        " bytes (" << session.recorded_received << " recorded)";
+}
@@ -0,0 +1,148 @@
+#include "capture.h"
+#include "counters.h"
+#include "miscutils.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static size_t padded(size_t length) { return (length + 7) & ~(size_t)7; }
+
+//////////////////////////////
+// CaptureFile class methods //
+//////////////////////////////
+
+CaptureFile::CaptureFile(const std::string& path, size_t max_size)
+    : size(max_size), next(sizeof(CaptureFileHeader))
+{
+    NEGCHECK("capture file",
+        (fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+            0644)));
+    // Blocks allocated now, so that a full disk shows up here and not as
+    // SIGBUS in a relay thread.
+    int ern = posix_fallocate(fd, 0, size);
+    if (ern)
+    {
+        errno = ern;
+        errorexit("capture file");
+    }
+    void* mapping =
+        mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) errorexit("capture file");
+    map = (unsigned char*)mapping;
+    CaptureFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, capture_magic, sizeof(header.magic));
+    memcpy(map, &header, sizeof(header));
+}
+
+CaptureFile::~CaptureFile()
+{
+    size_t used = std::min(next.load(), size);
+    munmap(map, size);
+    NEGCHECK("capture file", ftruncate(fd, used));
+    ::close(fd);
+}
+
+void CaptureFile::open(unsigned session)
+{
+    append(capture_event::open, session, 0, nullptr, 0);
+}
+
+void CaptureFile::close(unsigned session)
+{
+    append(capture_event::close, session, 0, nullptr, 0);
+}
+
+void CaptureFile::data(unsigned session, unsigned direction,
+    const struct iovec vec[2], size_t count)
+{
+    if (append(capture_event::data, session, direction, vec, count))
+    {
+        counter_add(counter_captured, count);
+    }
+}
+
+bool CaptureFile::append(capture_event event, unsigned session,
+    unsigned direction, const struct iovec vec[2], size_t count)
+{
+    size_t need = sizeof(CaptureRecord) + padded(count);
+    size_t at = next.fetch_add(need, std::memory_order_relaxed);
+    if ((at > size) || (need > size - at))
+    {
+        counter_add(counter_capture_drops);
+        return false;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    CaptureRecord* record = (CaptureRecord*)(map + at);
+    record->nsec = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    record->session = session;
+    record->length = count;
+    record->direction = direction;
+    record->unused = 0;
+    if (count)
+    {
+        unsigned char* payload = map + at + sizeof(CaptureRecord);
+        size_t first = std::min(count, vec[0].iov_len);
+        memcpy(payload, vec[0].iov_base, first);
+        memcpy(payload + first, vec[1].iov_base, count - first);
+    }
+    // Last, for a reader of the file while it is written
+    std::atomic_ref<uint16_t>(record->event).store(
+        (uint16_t)event, std::memory_order_release);
+    return true;
+}
+
+////////////////////////////////
+// CaptureReader class methods //
+////////////////////////////////
+
+CaptureReader::CaptureReader(const std::string& path)
+    : offset(sizeof(CaptureFileHeader))
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if ((fd < 0) || (fstat(fd, &st) < 0))
+    {
+        throw CaptureException(path + " : " + strerror(errno));
+    }
+    size = st.st_size;
+    void* mapping = (size >= sizeof(CaptureFileHeader))
+        ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if ((mapping == MAP_FAILED) ||
+        memcmp(mapping, capture_magic, sizeof(capture_magic)))
+    {
+        if (mapping != MAP_FAILED) munmap(mapping, size);
+        throw CaptureException(path + " : not a capture file");
+    }
+    map = (const unsigned char*)mapping;
+    madvise((void*)map, size, MADV_SEQUENTIAL);
+}
+
+CaptureReader::~CaptureReader()
+{
+    munmap((void*)map, size);
+}
+
+bool CaptureReader::next(CaptureRecord& record, const unsigned char*& payload)
+{
+    if (size - offset < sizeof(CaptureRecord)) return false;
+    memcpy(&record, map + offset, sizeof(record));
+    if ((record.event == (uint16_t)capture_event::none) ||
+        (record.length > size - offset - sizeof(CaptureRecord)))
+    {
+        return false;
+    }
+    payload = map + offset + sizeof(CaptureRecord);
+    offset += sizeof(CaptureRecord) + padded(record.length);
+    offset = std::min(offset, size);
+    return true;
+}
@@ -0,0 +1,104 @@
+#ifndef __CAPTURE_H_
+#define __CAPTURE_H_
+
+// Traffic capture. Relay threads append records, with nanosecond time
+// stamps, to one memory mapped file of fixed size. Space is claimed with
+// one atomic add, so that no thread waits for another, or for the disk.
+// Records that do not fit are dropped, and counted.
+//
+// The file is a CaptureFileHeader, then records. Each record is a
+// CaptureRecord and its payload, padded to a multiple of 8 bytes. The
+// event of a record is stored last: a record whose event is still
+// capture_event::none ends the capture. The file is cut to its used
+// length only on a clean exit; a killed process leaves it at full size,
+// zero after the last record.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <sys/uio.h>
+
+constexpr char capture_magic[8] = {'T', 'C', 'P', 'C', 'A', 'P', '0', '1'};
+
+struct CaptureFileHeader
+{
+    char magic[8];
+    uint64_t unused;
+};
+
+enum class capture_event : uint16_t
+{
+    none,
+    open,     // A session began
+    data,     // Bytes read from one side of a session
+    close     // A session ended
+};
+
+struct CaptureRecord
+{
+    int64_t nsec;        // CLOCK_REALTIME
+    uint32_t session;    // Client number
+    uint32_t length;     // Of the payload
+    uint16_t event;      // A capture_event
+    uint16_t direction;  // 0: read from the first spec, 1: from the second
+    uint32_t unused;
+};
+
+// For a file that cannot be read as a capture
+struct CaptureException
+{
+    CaptureException(const std::string& str) : strng(str) { }
+    std::string strng;
+};
+
+// Shared by all relay threads
+class CaptureFile
+{
+public:
+    // Creates path, max_size bytes long. Exits on failure.
+    CaptureFile(const std::string& path, size_t max_size);
+    ~CaptureFile();  // Cuts the file to what was used
+    CaptureFile(const CaptureFile&) = delete;
+    CaptureFile& operator=(const CaptureFile&) = delete;
+
+    void open(unsigned session);
+    void close(unsigned session);
+    // count bytes read, in up to two buffers
+    void data(unsigned session, unsigned direction,
+        const struct iovec vec[2], size_t count);
+
+private:
+    bool append(capture_event event, unsigned session, unsigned direction,
+        const struct iovec vec[2], size_t count);
+
+    int fd;
+    unsigned char* map;
+    size_t size;
+    std::atomic<size_t> next;   // Offset of the next record
+};
+
+// Whole captures, one record at a time
+class CaptureReader
+{
+public:
+    CaptureReader(const std::string& path);
+    ~CaptureReader();
+    CaptureReader(const CaptureReader&) = delete;
+    CaptureReader& operator=(const CaptureReader&) = delete;
+
+    // False at the end: the end of the file, or the first record whose
+    // event is still capture_event::none, such as the zeros that a killed
+    // tcppipe leaves. payload points into the mapping.
+    bool next(CaptureRecord& record, const unsigned char*& payload);
+    // Bytes left when next() returned false. Not 0 if the file did not
+    // end cleanly.
+    size_t unread() const { return size - offset; }
+
+private:
+    const unsigned char* map;
+    size_t size;
+    size_t offset;
+};
+
+#endif // __CAPTURE_H_
@@ -3,6 +3,67 @@
 // TODO: fix this hack
 extern void usage_error();
 #include <cstring>
+#include <fcntl.h>
+
+// Tuning (compile time)
+constexpr int default_fastopen_qlen{256};
+
+static SockOpts process_sockopts(const std::string& spec)
+// spec is a comma separated list of
+//     nodelay[=0|1]
+//     quickack[=0|1]
+//     rcvbuf=<bytes>
+//     sndbuf=<bytes>
+//     rcvlowat=<bytes>
+//     notsent_lowat=<bytes>
+//     user_timeout=<milliseconds>
+//     fastopen[=<queue length>]
+//     busy_poll=<microseconds>
+//     prefer_busy_poll[=0|1]
+{
+    SockOpts opts;
+    for (auto& entry : mstrtok(spec, ','))
+    {
+        auto vec = mstrtok(entry, '=');
+        if ((vec.size() < 1) || (vec.size() > 2)) usage_error();
+        const std::string& name = vec[0];
+        bool has_value = (vec.size() == 2);
+        if ((name == "nodelay") || (name == "quickack") ||
+            (name == "prefer_busy_poll"))
+        {
+            int value = has_value ? mstoi(vec[1], true) : 1;
+            if (value > 1) usage_error();
+            ((name == "nodelay") ? opts.nodelay :
+                (name == "quickack") ? opts.quickack :
+                opts.prefer_busy_poll) = value;
+            continue;
+        }
+        if ((name == "fastopen") && !has_value)
+        {
+            opts.fastopen = default_fastopen_qlen;
+            continue;
+        }
+        if (!has_value) usage_error();
+        int value = mstoi(vec[1], true);
+        if (name == "rcvbuf")
+            opts.rcvbuf = value;
+        else if (name == "sndbuf")
+            opts.sndbuf = value;
+        else if (name == "rcvlowat")
+            opts.rcvlowat = value;
+        else if (name == "notsent_lowat")
+            opts.notsent_lowat = value;
+        else if (name == "user_timeout")
+            opts.user_timeout = value;
+        else if (name == "fastopen")
+            opts.fastopen = value;
+        else if (name == "busy_poll")
+            opts.busy_poll = value;
+        else
+            usage_error();
+    }
+    return opts;
+}
 
 Uri process_args(int& argc, char**& argv)
 // Group can be one of
@@ -10,6 +71,14 @@ Uri process_args(int& argc, char**& argv)
 //     -listen <port,port,...>
 //     -listen <address>:<port,port,...>
 //     -connect <hostname> <port>
+//     -listen_unix <path>
+//     -connect_unix <path>
+//     -zero
+//     -random
+//     -null
+// Any but -stdio and the last three can be followed by
+//     -sockopt <option,option,...>
+// A Unix domain socket path starting with '@' is in the abstract namespace.
 {
     Uri uri;
 
@@ -78,9 +147,47 @@ Uri process_args(int& argc, char**& argv)
             break;
         }
     }
+    else if ((strcmp(option, "-listen_unix") == 0) ||
+             (strcmp(option, "-connect_unix") == 0))
+    {
+        uri.listening = (strcmp(option, "-listen_unix") == 0);
+        if (argc < 1) usage_error();
+        uri.unix_path = argv[0];
+        ++argv;
+        --argc;
+        // A placeholder. -1 would mean stdio.
+        uri.ports.push_back(0);
+    }
+    else if ((strcmp(option, "-zero") == 0) ||
+             (strcmp(option, "-random") == 0) ||
+             (strcmp(option, "-null") == 0))
+    {
+        // The kernel sources and sinks data at memory speed, and the fd
+        // works like any other in the copy engines.
+        uri.listening = false;
+        uri.device = (option[1] == 'z') ? "/dev/zero" :
+            (option[1] == 'r') ? "/dev/urandom" : "/dev/null";
+        uri.ports.push_back(0);
+    }
     else
     {
         usage_error();
     }
+
+    if (!uri.ports.empty() && (uri.ports[0] != -1) && uri.device.empty() &&
+        (argc >= 1) && (strcmp(argv[0], "-sockopt") == 0))
+    {
+        if (argc < 2) usage_error();
+        uri.sockopts = process_sockopts(argv[1]);
+        argv += 2;
+        argc -= 2;
+    }
     return uri;
 }
+
+int open_device(const std::string& device)
+{
+    int fd;
+    NEGCHECK(device.c_str(), (fd = open(device.c_str(), O_RDWR | O_CLOEXEC)));
+    return fd;
+}
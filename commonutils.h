@@ -14,6 +14,9 @@ struct ServerInfo
     inline bool listening() const { return (listener != nullptr); }
     std::string hostname;    // Not always defined
     int port_num;            // Not defined if listening. -1 indicates stdio.
+    std::string unix_path;   // Only for a Unix domain socket
+    std::string device;      // Only for -zero, -random and -null
+    SockOpts sockopts;       // Not used for stdio or a device
     Listener* listener;
 };
 
@@ -22,7 +25,14 @@ struct Uri
     bool listening;
     std::vector<int> ports;  // -1 means stdin or stdout
     std::string hostname;    // Not always defined
+    std::string unix_path;   // Only for a Unix domain socket
+    std::string device;      // Only for -zero, -random and -null
+    SockOpts sockopts;
 };
 Uri process_args(int& argc, char**& argv);
 
+// A synthetic endpoint: reads give zeros or random bytes, or end at once,
+// and writes are discarded. Exits on failure.
+int open_device(const std::string& device);
+
 #endif // __COMMONUTILS_H_
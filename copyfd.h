@@ -1,14 +1,20 @@
 #ifndef __FD_COPY_H_
 #define __FD_COPY_H_
 
-#include "iopackage.h"  // just for definition of iopackage_stats
+#include "iopackage.h"  // just for iopackage_stats and iopackage_options
+#include "timerwheel.h"
 #include <cstddef>      // just for definition of size_t
 
 template<size_t STORE_SIZE>
-iopackage_stats copyfd(int readfd, int writefd);
+iopackage_stats copyfd(int readfd, int writefd,
+    const iopackage_options& opts = iopackage_options());
 
+// Returns early if timer, when given, expires. The caller arms its
+// deadlines; copyfd2() only reports activity to it. opts, if given, is for
+// the forward and backward directions.
 template<size_t STORE_SIZE>
 void copyfd2(
-    int leftfd, int rightfd, int max_msec, iopackage_stats stats[2]=nullptr);
+    int leftfd, int rightfd, SessionTimer* timer,
+    iopackage_stats stats[2]=nullptr, const iopackage_options opts[2]=nullptr);
 
 #endif // __FD_COPY_H_
@@ -1,45 +1,138 @@
 #ifndef __FD_COPY_TCC_
 #define __FD_COPY_TCC_
 
+#include "counters.h"
 #include "iopackage.h"
+#include "trace.h"
 
 #include <algorithm>
 #include <chrono>
-using namespace std::chrono;
 #include <cstring>
 #include <poll.h>
 #include <unistd.h>
 #include <sys/uio.h>
 
+// Combines poll() timeouts, where -1 means forever
+static inline int min_timeout(int first, int second)
+{
+    if (first  == -1) return second;
+    if (second == -1) return first;
+    return std::min(first, second);
+}
+
+// Spin-then-block. Where a copy loop would block in poll(), it calls
+// cycle() again instead, until spin_us have passed without progress, and
+// only then polls. Data that arrives meanwhile is seen without the wake-up
+// latency of poll(), at the cost of a core. The clock is read only when
+// spin_us is set.
+class SpinThenBlock
+{
+public:
+    using Clock = std::chrono::steady_clock;
+    SpinThenBlock(unsigned spin_us) : budget(std::chrono::microseconds(spin_us))
+    { }
+
+    // Where poll() would be called. True: call cycle() again instead.
+    bool spin()
+    {
+        if (budget == Clock::duration::zero()) return false;
+        Clock::time_point now = Clock::now();
+        if (!spinning)
+        {
+            spinning = true;
+            spin_start = now;
+            return true;
+        }
+        if (now - spin_start < budget) return true;
+        stop(now);
+        return false;
+    }
+    // cycle() moved data without waiting
+    void progress() { if (spinning) stop(Clock::now()); }
+    // Around poll()
+    void block_start()
+    {
+        if (budget != Clock::duration::zero()) poll_start = Clock::now();
+    }
+    void block_end()
+    {
+        if (budget == Clock::duration::zero()) return;
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            Clock::now() - poll_start).count();
+        blocked_ns += ns;
+        counter_add(counter_blocked_ns, ns);
+    }
+    void report(iopackage_stats& stats) const
+    {
+        stats.spin_ns = spin_ns;
+        stats.blocked_ns = blocked_ns;
+    }
+
+private:
+    void stop(Clock::time_point now)
+    {
+        spinning = false;
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            now - spin_start).count();
+        spin_ns += ns;
+        counter_add(counter_spin_ns, ns);
+    }
+
+    Clock::duration budget;
+    bool spinning{false};
+    Clock::time_point spin_start;
+    Clock::time_point poll_start;
+    uint64_t spin_ns{0};
+    uint64_t blocked_ns{0};
+};
+
 template<size_t STORE_SIZE>
-iopackage_stats copyfd(int readfd, int writefd)
+iopackage_stats copyfd(int readfd, int writefd, const iopackage_options& opts)
 {
     pollfd pfd[2];  // Read and write
     memset(pfd, 0, 2 * sizeof(pollfd));
     pfd[0].fd = readfd;
     pfd[1].fd = writefd;
 
-    IOPackage<STORE_SIZE> pack(readfd, writefd);
+    IOPackage<STORE_SIZE> pack(readfd, writefd, opts);
+    SpinThenBlock spinner(opts.spin_us);
     bool cycle_return = pack.cycle(pfd);
     while (cycle_return)
     {
-        if (pfd[0].events || pfd[1].events)
+        if (pfd[0].events || pfd[1].events || (pack.wait_ms() != -1))
         {
-            int poll_return;
-            NEGCHECK("poll", (poll_return = poll(pfd, 2, -1)));
-            // TODO: examine pfd[*].revents ?
+            // Rate limits are waited out in poll(), never spun.
+            if ((pack.wait_ms() != -1) || !spinner.spin())
+            {
+                int poll_return;
+                TRACE(poll_enter, opts.trace_id, 2, pack.wait_ms());
+                spinner.block_start();
+                NEGCHECK("poll", (poll_return = poll(pfd, 2, pack.wait_ms())));
+                spinner.block_end();
+                TRACE(poll_exit, opts.trace_id, poll_return, 0);
+                counter_add(counter_polls);
+                // TODO: examine pfd[*].revents ?
+            }
+        }
+        else
+        {
+            spinner.progress();
         }
         cycle_return = pack.cycle(pfd);
     }
-    return pack.report();
+    iopackage_stats stats = pack.report();
+    spinner.report(stats);
+    return stats;
 }
 
 template<size_t STORE_SIZE>
 void copyfd2(
-    int leftfd, int rightfd, int max_msec, iopackage_stats stats[2])
+    int leftfd, int rightfd, SessionTimer* timer, iopackage_stats stats[2],
+    const iopackage_options opts[2])
 {
-    pollfd pfd[4];  // Forward read and write, then backward read and write.
-    memset(pfd, 0, 4 * sizeof(pollfd));
+    // Forward read and write, then backward read and write, then timer.
+    pollfd pfd[5];
+    memset(pfd, 0, 5 * sizeof(pollfd));
 
     // ugh
     int leftfd_forward, leftfd_backward, rightfd_forward, rightfd_backward;
@@ -72,35 +165,46 @@ void copyfd2(
     pfd[1].fd = rightfd_forward;
     pfd[2].fd = rightfd_backward;
     pfd[3].fd = leftfd_backward;
-    IOPackage<STORE_SIZE> forward(leftfd_forward, rightfd_forward);
-    IOPackage<STORE_SIZE> backward(rightfd_backward, leftfd_backward);
-
-    int dur;
-    time_point<system_clock> deadline;
-    if (max_msec == -1)
-    {
-        dur = -1;
-    }
-    else
-    {
-        deadline = system_clock::now() + max_msec * 1ms;
-    }
+    pfd[4].fd = timer ? timer->fd() : -1;
+    pfd[4].events = POLLIN;
+    const iopackage_options no_opts[2];
+    if (opts == nullptr) opts = no_opts;
+    IOPackage<STORE_SIZE> forward(leftfd_forward, rightfd_forward, opts[0]);
+    IOPackage<STORE_SIZE> backward(rightfd_backward, leftfd_backward, opts[1]);
+    SpinThenBlock spinner(opts[0].spin_us);
 
     bool cycle_return = forward.cycle(pfd) && backward.cycle(pfd+2);
     while (cycle_return)
     {
-        if ((pfd[0].events || pfd[1].events) &&
-            (pfd[2].events || pfd[3].events))
+        if (timer)
         {
-            if (max_msec != -1)
+            // A relaxed load. No clock is read here.
+            if (timer->expired()) break;
+        }
+        if ((pfd[0].events || pfd[1].events || (forward.wait_ms() != -1)) &&
+            (pfd[2].events || pfd[3].events || (backward.wait_ms() != -1)))
+        {
+            int timeout = min_timeout(forward.wait_ms(), backward.wait_ms());
+            // Rate limits are waited out in poll(), never spun.
+            if ((timeout != -1) || !spinner.spin())
             {
-                time_point<system_clock> now = system_clock::now();
-                if (now >= deadline) break;
-                dur = duration_cast<milliseconds>(deadline - now).count();
+                int poll_return;
+                TRACE(poll_enter, opts[0].trace_id, 5, timeout);
+                spinner.block_start();
+                NEGCHECK("poll", (poll_return = poll(pfd, 5, timeout)));
+                spinner.block_end();
+                TRACE(poll_exit, opts[0].trace_id, poll_return, 0);
+                counter_add(counter_polls);
+                if (pfd[4].revents & POLLIN) break;
+                // TODO: examine pfd[*].revents ?
+                if (timer && (poll_return > 0)) timer->touch();
             }
-            int poll_return;
-            NEGCHECK("poll", (poll_return = poll(pfd, 4, dur)));
-            // TODO: examine pfd[*].revents ?
+        }
+        else
+        {
+            // Data moved without waiting
+            spinner.progress();
+            if (timer) timer->touch();
         }
         cycle_return = forward.cycle(pfd) && backward.cycle(pfd+2);
     }
@@ -108,6 +212,8 @@ void copyfd2(
     {
         stats[0] = forward.report();
         stats[1] = backward.report();
+        spinner.report(stats[0]);
+        spinner.report(stats[1]);
     }
 }
 
@@ -0,0 +1,409 @@
+#include "coroutine.h"
+#include "counters.h"
+#include "miscutils.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// Tuning (compile time)
+constexpr int max_epoll_events{256};
+
+void CoTask::promise_type::FinalAwaiter::await_suspend(
+    std::coroutine_handle<promise_type> h) noexcept
+{
+    h.promise().sched->finished(h);
+}
+
+//////////////////////////////
+// CoScheduler class methods //
+//////////////////////////////
+
+CoScheduler::CoScheduler()
+{
+    NEGCHECK("epoll_create1", (epollFD = epoll_create1(EPOLL_CLOEXEC)));
+}
+
+CoScheduler::~CoScheduler()
+{
+    close(epollFD);
+}
+
+void CoScheduler::spawn(CoTask&& task)
+{
+    CoTask::handle_type h = task.handle;
+    task.handle = nullptr;
+    h.promise().sched = this;
+    ++live_tasks;
+    post(h);
+}
+
+void CoScheduler::finished(CoTask::handle_type h)
+{
+    if (h.promise().exception && !exception)
+    {
+        exception = h.promise().exception;
+    }
+    h.destroy();
+    --live_tasks;
+}
+
+CoScheduler::FdAwaiter CoScheduler::readable(int fd)
+{
+    return FdAwaiter{*this, fd, EPOLLIN};
+}
+
+CoScheduler::FdAwaiter CoScheduler::writable(int fd)
+{
+    return FdAwaiter{*this, fd, EPOLLOUT};
+}
+
+void CoScheduler::wait_fd(
+    int fd, uint32_t events, std::coroutine_handle<> h, bool* cancelled)
+{
+    FdWait& wait = fds[fd];
+    if (events == EPOLLIN)
+    {
+        wait.reader = h;
+        wait.reader_cancelled = cancelled;
+    }
+    else
+    {
+        wait.writer = h;
+        wait.writer_cancelled = cancelled;
+    }
+    arm(fd, wait);
+}
+
+void CoScheduler::arm(int fd, FdWait& wait)
+{
+    // One-shot: a wake-up costs no extra epoll_ctl() to disarm.
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLONESHOT;
+    if (wait.reader) ev.events |= EPOLLIN | EPOLLRDHUP;
+    if (wait.writer) ev.events |= EPOLLOUT;
+    ev.data.fd = fd;
+    // The kernel may know the file descriptor even though fds does not,
+    // and vice versa after a close().
+    int op = wait.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(epollFD, op, fd, &ev) < 0)
+    {
+        if ((op == EPOLL_CTL_MOD) && (errno == ENOENT))
+        {
+            NEGCHECK("epoll_ctl", epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &ev));
+        }
+        else if ((op == EPOLL_CTL_ADD) && (errno == EEXIST))
+        {
+            NEGCHECK("epoll_ctl", epoll_ctl(epollFD, EPOLL_CTL_MOD, fd, &ev));
+        }
+        else
+        {
+            errorexit("epoll_ctl");
+        }
+    }
+    wait.registered = true;
+}
+
+void CoScheduler::cancel(int fd)
+{
+    auto it = fds.find(fd);
+    if (it == fds.end()) return;
+    FdWait& wait = it->second;
+    if (wait.reader)
+    {
+        *wait.reader_cancelled = true;
+        post(wait.reader);
+    }
+    if (wait.writer)
+    {
+        *wait.writer_cancelled = true;
+        post(wait.writer);
+    }
+    // Failure only means that the kernel has forgotten fd already.
+    epoll_ctl(epollFD, EPOLL_CTL_DEL, fd, nullptr);
+    fds.erase(it);
+}
+
+void CoScheduler::sleep(Clock::time_point when, std::coroutine_handle<> h,
+    std::coroutine_handle<>* sleeper, bool* woken)
+{
+    if (!sleeper)
+    {
+        sleepers.insert({when, Sleeper{h, nullptr}});
+        return;
+    }
+    *sleeper = h;
+    wakeable[h.address()] = sleepers.insert({when, Sleeper{h, woken}});
+}
+
+void CoScheduler::wake(std::coroutine_handle<>* sleeper)
+{
+    if (!*sleeper) return;
+    auto it = wakeable.find(sleeper->address());
+    if (it == wakeable.end()) return;
+    *it->second->second.woken = true;
+    post(*sleeper);
+    sleepers.erase(it->second);
+    wakeable.erase(it);
+    *sleeper = nullptr;
+}
+
+void CoScheduler::run()
+{
+    struct epoll_event events[max_epoll_events];
+    while (true)
+    {
+        while (!ready.empty())
+        {
+            std::coroutine_handle<> h = ready.front();
+            ready.pop_front();
+            h.resume();
+        }
+        if (exception)
+        {
+            std::exception_ptr ep = exception;
+            exception = nullptr;
+            std::rethrow_exception(ep);
+        }
+        if (live_tasks == 0) break;
+
+        int count;
+        do
+        {
+            count = epoll_wait(epollFD, events, max_epoll_events,
+                sleep_timeout_ms());
+        } while ((count < 0) && (errno == EINTR));
+        NEGCHECK("epoll_wait", count);
+        counter_add(counter_polls);
+        Clock::time_point now = Clock::now();
+        while (!sleepers.empty() && (sleepers.begin()->first <= now))
+        {
+            const Sleeper& sleeper = sleepers.begin()->second;
+            post(sleeper.h);
+            if (sleeper.woken) wakeable.erase(sleeper.h.address());
+            sleepers.erase(sleepers.begin());
+        }
+        for (int index = 0 ; index < count ; ++index)
+        {
+            auto it = fds.find(events[index].data.fd);
+            if (it == fds.end()) continue;
+            FdWait& wait = it->second;
+            uint32_t revents = events[index].events;
+            if (wait.reader &&
+                (revents & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+            {
+                post(wait.reader);
+                wait.reader = nullptr;
+            }
+            if (wait.writer && (revents & (EPOLLOUT | EPOLLHUP | EPOLLERR)))
+            {
+                post(wait.writer);
+                wait.writer = nullptr;
+            }
+            if (wait.reader || wait.writer)
+            {
+                arm(it->first, wait);
+            }
+            else
+            {
+                fds.erase(it);
+            }
+        }
+    }
+}
+
+// Until the soonest sleeper wakes, rounded up. -1 if none.
+int CoScheduler::sleep_timeout_ms() const
+{
+    if (sleepers.empty()) return -1;
+    auto wait = sleepers.begin()->first - Clock::now();
+    if (wait <= Clock::duration::zero()) return 0;
+    // Beyond what epoll_wait() takes, as for a sleep until
+    // time_point::max(), wait as long as it does.
+    auto ms = std::chrono::ceil<std::chrono::milliseconds>(wait).count();
+    return (int)std::min<decltype(ms)>(ms, std::numeric_limits<int>::max());
+}
+
+/////////////////////////////
+// CoDeadline class methods //
+/////////////////////////////
+
+CoDeadline::CoDeadline(
+    CoScheduler& sched, int fd, CoScheduler::Clock::time_point when)
+    : state(std::make_shared<State>(State{sched, fd, true, false, nullptr}))
+{
+    sched.spawn(watch(state, when));
+}
+
+void CoDeadline::disarm()
+{
+    if (!state->armed) return;
+    state->armed = false;
+    // Not yet asleep, the watchdog sees armed cleared when it first runs.
+    state->sched.wake(&state->watchdog);
+}
+
+CoTask CoDeadline::watch(
+    std::shared_ptr<State> state, CoScheduler::Clock::time_point when)
+{
+    if (!state->armed) co_return;
+    bool slept = co_await state->sched.sleep_until(when, &state->watchdog);
+    if (slept && state->armed)
+    {
+        state->expired = true;
+        state->sched.cancel(state->fd);
+    }
+}
+
+/////////////////////////
+// Full duplex relaying //
+/////////////////////////
+
+namespace
+{
+
+// State shared by the four coroutines of one co_relay()
+struct CoRelay
+{
+    CoRelay(CoScheduler& sch, int leftfd, int rightfd, size_t ring_size,
+            std::function<void(const iopackage_stats[2])> dn, unsigned id)
+        : sched(sch), fd{leftfd, rightfd},
+          forward(sch, ring_size), backward(sch, ring_size), done(dn),
+          trace_id(id)
+    {
+        memset(stats, 0, sizeof(stats));
+    }
+    ~CoRelay()
+    {
+        for (int sock : fd)
+        {
+            sched.cancel(sock);
+            shutdown(sock, SHUT_RDWR);
+            close(sock);
+        }
+        if (done) done(stats);
+    }
+    CoRing<unsigned char>& ring(int dir) { return dir ? backward : forward; }
+    // Ends both directions
+    void finish()
+    {
+        forward.close();
+        backward.close();
+        sched.cancel(fd[0]);
+        sched.cancel(fd[1]);
+    }
+
+    CoScheduler& sched;
+    int fd[2];
+    CoRing<unsigned char> forward;
+    CoRing<unsigned char> backward;
+    iopackage_stats stats[2];
+    std::function<void(const iopackage_stats[2])> done;
+    unsigned trace_id;
+};
+
+// dir 0 is forward, fd[0] to fd[1]. dir 1 is backward.
+CoTask co_reader(std::shared_ptr<CoRelay> relay, int dir)
+{
+    CoScheduler& sched = relay->sched;
+    CoRing<unsigned char>& ring = relay->ring(dir);
+    int fd = relay->fd[dir];
+    while (true)
+    {
+        auto seg = co_await ring.space(1);
+        if (seg.nseg == 0) break;
+        struct iovec vec[2] = {
+            {seg.start1, seg.available1}, {seg.start2, seg.available2}};
+        ssize_t bytes = readv(fd, vec, seg.nseg);
+        TRACE(read, relay->trace_id,
+            (bytes < 0) ? -errno : bytes, ring.size());
+        if (bytes < 0)
+        {
+            if ((errno == EWOULDBLOCK) || (errno == EAGAIN))
+            {
+                counter_add(counter_eagains);
+                if (!co_await sched.readable(fd)) break;
+                continue;
+            }
+            // Some other error on input
+            counter_error(errno);
+            break;
+        }
+        // End of input
+        if (bytes == 0) break;
+        ring.push(bytes);
+        ++relay->stats[dir].reads;
+        counter_add(counter_reads);
+    }
+    // The writer drains the ring, then ends the relay.
+    ring.close();
+}
+
+CoTask co_writer(std::shared_ptr<CoRelay> relay, int dir)
+{
+    CoScheduler& sched = relay->sched;
+    CoRing<unsigned char>& ring = relay->ring(dir);
+    int fd = relay->fd[1 - dir];
+    while (true)
+    {
+        auto seg = co_await ring.data(1);
+        // Closed and empty
+        if (seg.nseg == 0) break;
+        struct iovec vec[2] = {
+            {seg.start1, seg.available1}, {seg.start2, seg.available2}};
+        ssize_t bytes = writev(fd, vec, seg.nseg);
+        TRACE(write, relay->trace_id,
+            (bytes < 0) ? -errno : bytes, ring.size());
+        if (bytes < 0)
+        {
+            if ((errno == EWOULDBLOCK) || (errno == EAGAIN) ||
+                (errno == EINPROGRESS))
+            {
+                counter_add(counter_eagains);
+                if (!co_await sched.writable(fd)) break;
+                continue;
+            }
+            // Some other error on output
+            counter_error(errno);
+            break;
+        }
+        if (bytes == 0) break;
+        ring.pop(bytes);
+        ++relay->stats[dir].writes;
+        relay->stats[dir].bytes_copied += bytes;
+        counter_add(counter_writes);
+        counter_add(counter_bytes, bytes);
+    }
+    relay->finish();
+}
+
+} // anonymous namespace
+
+void co_relay(
+    CoScheduler& sched, int leftfd, int rightfd, size_t ring_size,
+    std::function<void(const iopackage_stats[2])> done, unsigned trace_id)
+{
+    set_flags(leftfd , O_NONBLOCK);
+    set_flags(rightfd, O_NONBLOCK);
+    auto relay =
+        std::make_shared<CoRelay>(
+        sched, leftfd, rightfd, ring_size, done, trace_id);
+    for (int dir = 0 ; dir < 2 ; ++dir)
+    {
+        sched.spawn(co_reader(relay, dir));
+        sched.spawn(co_writer(relay, dir));
+    }
+}
+
+#include "coroutine.tcc"
+#include "ringbufr.tcc"
+
+// The members are defined only here, for other files that use byte rings
+template class CoRing<unsigned char>;
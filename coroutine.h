@@ -0,0 +1,270 @@
+#ifndef __COROUTINE_H_
+#define __COROUTINE_H_
+
+// C++20 coroutines for the copy engine. A CoScheduler runs any number of
+// CoTask coroutines on one thread over epoll. Coroutines wait for file
+// descriptors with co_await sched.readable(fd) or sched.writable(fd), and
+// for ring buffer space or content with co_await ring.space(n) or
+// ring.data(n), so that relay and protocol logic reads as straight-line
+// code instead of the state machine in IOPackageBase::cycle(). They sleep
+// with co_await sched.sleep_until(time), and another coroutine may end a
+// sleep early with sched.wake(). A CoDeadline bounds a wait for a file
+// descriptor, as a connect timeout.
+
+#include "iopackage.h"  // just for iopackage_stats
+#include "ringbufr.h"
+
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+class CoScheduler;
+
+// A coroutine owned by a CoScheduler. It starts when spawned, and is
+// destroyed when it finishes.
+class CoTask
+{
+public:
+    struct promise_type
+    {
+        CoTask get_return_object() {
+            return CoTask(handle_type::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        struct FinalAwaiter
+        {
+            bool await_ready() noexcept { return false; }
+            void await_suspend(
+                std::coroutine_handle<promise_type> h) noexcept;
+            void await_resume() noexcept { }
+        };
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void return_void() { }
+        void unhandled_exception() { exception = std::current_exception(); }
+
+        CoScheduler* sched{nullptr};
+        std::exception_ptr exception;
+    };
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    CoTask(CoTask&& other) : handle(other.handle) { other.handle = nullptr; }
+    ~CoTask() { if (handle) handle.destroy(); }
+    CoTask(const CoTask&) = delete;
+    CoTask& operator=(const CoTask&) = delete;
+    CoTask& operator=(CoTask&&) = delete;
+
+private:
+    friend class CoScheduler;
+    explicit CoTask(handle_type h) : handle(h) { }
+    handle_type handle;
+};
+
+class CoScheduler
+{
+public:
+    CoScheduler();
+    ~CoScheduler();
+    CoScheduler(const CoScheduler&) = delete;
+    CoScheduler& operator=(const CoScheduler&) = delete;
+
+    // Takes ownership of task. It first runs from within run().
+    void spawn(CoTask&& task);
+    // Returns when no task remains. An exception that escapes a task is
+    // rethrown from here.
+    void run();
+
+    // co_await readable(fd) and co_await writable(fd) yield true, or false
+    // if the wait was ended by cancel(fd). One coroutine at a time may
+    // wait for each direction of a file descriptor.
+    struct FdAwaiter
+    {
+        bool await_ready() { return false; }
+        void await_suspend(std::coroutine_handle<> h) {
+            sched.wait_fd(fd, events, h, &cancelled); }
+        bool await_resume() { return !cancelled; }
+
+        CoScheduler& sched;
+        int fd;
+        uint32_t events;
+        bool cancelled{false};
+    };
+    FdAwaiter readable(int fd);
+    FdAwaiter writable(int fd);
+
+    // Wakes every coroutine waiting for fd. Call before closing fd.
+    void cancel(int fd);
+
+    // co_await sleep_until(when) yields true once when comes, or false if
+    // wake() ended the sleep first. A coroutine that may be woken passes
+    // sleeper, which holds its handle while it sleeps, and null otherwise.
+    using Clock = std::chrono::steady_clock;
+    struct SleepAwaiter
+    {
+        bool await_ready() { return Clock::now() >= when; }
+        void await_suspend(std::coroutine_handle<> h) {
+            sched.sleep(when, h, sleeper, &woken); }
+        bool await_resume() {
+            if (sleeper) *sleeper = nullptr;
+            return !woken; }
+
+        CoScheduler& sched;
+        Clock::time_point when;
+        std::coroutine_handle<>* sleeper;
+        bool woken{false};
+    };
+    SleepAwaiter sleep_until(Clock::time_point when,
+        std::coroutine_handle<>* sleeper = nullptr) {
+        return SleepAwaiter{*this, when, sleeper}; }
+    // Ends the sleep of the coroutine in *sleeper, if it sleeps
+    void wake(std::coroutine_handle<>* sleeper);
+
+    // Queues a suspended coroutine to be resumed from run()
+    void post(std::coroutine_handle<> h) { ready.push_back(h); }
+
+    size_t tasks() const { return live_tasks; }
+
+private:
+    friend struct CoTask::promise_type::FinalAwaiter;
+    struct FdWait
+    {
+        std::coroutine_handle<> reader;
+        std::coroutine_handle<> writer;
+        bool* reader_cancelled{nullptr};
+        bool* writer_cancelled{nullptr};
+        bool registered{false};
+    };
+    struct Sleeper
+    {
+        std::coroutine_handle<> h;
+        bool* woken;  // Null if it cannot be woken
+    };
+    // Soonest first
+    using SleeperMap = std::multimap<Clock::time_point, Sleeper>;
+    void wait_fd(
+        int fd, uint32_t events, std::coroutine_handle<> h, bool* cancelled);
+    void sleep(Clock::time_point when, std::coroutine_handle<> h,
+        std::coroutine_handle<>* sleeper, bool* woken);
+    int sleep_timeout_ms() const;
+    void arm(int fd, FdWait& wait);
+    void finished(CoTask::handle_type h);
+
+    int epollFD;
+    size_t live_tasks{0};
+    std::deque<std::coroutine_handle<>> ready;
+    std::unordered_map<int, FdWait> fds;
+    SleeperMap sleepers;
+    // The sleepers that may be woken, by handle address
+    std::unordered_map<void*, SleeperMap::iterator> wakeable;
+    std::exception_ptr exception;
+};
+
+// Cancels the waits for fd once when comes. Construct it before the wait,
+// and disarm it when the wait ends, before fd is closed; destruction
+// disarms too. expired() tells the deadline from a cancel() by anyone else.
+class CoDeadline
+{
+public:
+    CoDeadline(CoScheduler& sched, int fd, CoScheduler::Clock::time_point when);
+    ~CoDeadline() { disarm(); }
+    CoDeadline(const CoDeadline&) = delete;
+    CoDeadline& operator=(const CoDeadline&) = delete;
+
+    void disarm();
+    bool expired() const { return state->expired; }
+
+private:
+    // Shared with the watchdog coroutine, which may outlive this
+    struct State
+    {
+        CoScheduler& sched;
+        int fd;
+        bool armed;
+        bool expired;
+        std::coroutine_handle<> watchdog;
+    };
+    static CoTask watch(
+        std::shared_ptr<State> state, CoScheduler::Clock::time_point when);
+
+    std::shared_ptr<State> state;
+};
+
+// A ring buffer whose producer and consumer are coroutines on the same
+// CoScheduler
+template<typename _T>
+class CoRing
+{
+public:
+    CoRing(CoScheduler& sched, size_t capacity);
+    CoRing(const CoRing&) = delete;
+    CoRing& operator=(const CoRing&) = delete;
+
+    // The result of pushInquire() or popInquire()
+    struct Segments
+    {
+        size_t nseg;
+        size_t available1;
+        _T* start1;
+        size_t available2;
+        _T* start2;
+        size_t total() const { return available1 + available2; }
+    };
+    struct Awaiter
+    {
+        bool await_ready() { return ring.ready(producer, count); }
+        void await_suspend(std::coroutine_handle<> h) {
+            ring.suspend(producer, count, h); }
+        Segments await_resume() { return ring.inquire(producer); }
+
+        CoRing& ring;
+        bool producer;
+        size_t count;
+    };
+
+    // Space for at least count elements. After close(), no space.
+    Awaiter space(size_t count) { return Awaiter{*this, true, count}; }
+    // At least count elements. After close(), whatever remains.
+    Awaiter data(size_t count) { return Awaiter{*this, false, count}; }
+
+    // Commit, as for RingbufRbase, and wake the other side if it waits
+    void push(size_t count);
+    void pop(size_t count);
+
+    // Ends the stream, from either side. Wakes both sides.
+    void close();
+    bool closed() const { return _closed; }
+    size_t size() const { return bufr.size(); }
+    size_t capacity() const { return bufr.capacity(); }
+
+private:
+    bool ready(bool producer, size_t count) const;
+    void suspend(bool producer, size_t count, std::coroutine_handle<> h);
+    Segments inquire(bool producer);
+    void wake(std::coroutine_handle<>& h);
+
+    CoScheduler& _sched;
+    RingbufR<_T> bufr;
+    bool _closed{false};
+    std::coroutine_handle<> producer_waiting;
+    std::coroutine_handle<> consumer_waiting;
+    size_t producer_count{0};
+    size_t consumer_count{0};
+};
+
+// Full duplex copying between two file descriptors, with four coroutines
+// around two rings. As with copyfd2(), everything ends when either
+// direction ends. Takes ownership of both file descriptors. done, if
+// given, receives the forward and backward statistics. trace_id is the
+// connection number in trace events.
+void co_relay(
+    CoScheduler& sched, int leftfd, int rightfd, size_t ring_size,
+    std::function<void(const iopackage_stats[2])> done = nullptr,
+    unsigned trace_id = 0);
+
+#endif // __COROUTINE_H_
@@ -0,0 +1,103 @@
+// Implementation of CoRing
+#ifndef __COROUTINE_TCC_
+#define __COROUTINE_TCC_
+
+#include <cassert>
+
+template<typename _T>
+CoRing<_T>::CoRing(CoScheduler& sched, size_t capacity)
+    : _sched(sched), bufr(capacity)
+{
+}
+
+template<typename _T>
+bool CoRing<_T>::ready(bool producer, size_t count) const
+{
+    if (_closed) return true;
+    if (producer) return (capacity() - bufr.size() >= count);
+    return (bufr.size() >= count);
+}
+
+template<typename _T>
+void CoRing<_T>::suspend(bool producer, size_t count, std::coroutine_handle<> h)
+{
+    // Otherwise the wait could never end
+    assert(count <= capacity());
+    if (producer)
+    {
+        assert(!producer_waiting);
+        producer_waiting = h;
+        producer_count = count;
+    }
+    else
+    {
+        assert(!consumer_waiting);
+        consumer_waiting = h;
+        consumer_count = count;
+    }
+}
+
+template<typename _T>
+typename CoRing<_T>::Segments CoRing<_T>::inquire(bool producer)
+{
+    Segments seg;
+    if (producer)
+    {
+        if (_closed)
+        {
+            seg.nseg = 0;
+            seg.available1 = 0;
+            seg.start1 = nullptr;
+            seg.available2 = 0;
+            seg.start2 = nullptr;
+        }
+        else
+        {
+            seg.nseg = bufr.pushInquire(
+                seg.available1, seg.start1, seg.available2, seg.start2);
+        }
+    }
+    else
+    {
+        seg.nseg = bufr.popInquire(
+            seg.available1, seg.start1, seg.available2, seg.start2);
+    }
+    return seg;
+}
+
+template<typename _T>
+void CoRing<_T>::push(size_t count)
+{
+    bufr.push(count);
+    if (consumer_waiting && ready(false, consumer_count))
+    {
+        wake(consumer_waiting);
+    }
+}
+
+template<typename _T>
+void CoRing<_T>::pop(size_t count)
+{
+    bufr.pop(count);
+    if (producer_waiting && ready(true, producer_count))
+    {
+        wake(producer_waiting);
+    }
+}
+
+template<typename _T>
+void CoRing<_T>::close()
+{
+    _closed = true;
+    if (producer_waiting) wake(producer_waiting);
+    if (consumer_waiting) wake(consumer_waiting);
+}
+
+template<typename _T>
+void CoRing<_T>::wake(std::coroutine_handle<>& h)
+{
+    _sched.post(h);
+    h = nullptr;
+}
+
+#endif // __COROUTINE_TCC_
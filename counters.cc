@@ -0,0 +1,163 @@
+#include "counters.h"
+#include "miscutils.h"
+
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <signal.h>
+
+thread_local CounterShard* counter_local_shard{nullptr};
+
+namespace
+{
+
+const char* const counter_names[num_counters] = {
+    "bytes", "reads", "writes", "eagains", "polls", "exceptions",
+    "connect_failures", "spilled", "captured", "capture_drops", "spin_ns",
+    "blocked_ns", "admission_waits", "admission_wait_ns",
+    "admission_rejects", "pair_timeouts"};
+
+// Never destroyed, so that detached threads may retire their shards while
+// the process exits.
+struct CounterRegistry
+{
+    std::mutex mtx;
+    std::vector<CounterShard*> live;
+    CounterShard retired{};
+};
+CounterRegistry& registry()
+{
+    static CounterRegistry* reg = new CounterRegistry;
+    return *reg;
+}
+
+void fold(CounterSnapshot& snap, const CounterShard& shard)
+{
+    for (int index = 0 ; index < num_counters ; ++index)
+    {
+        snap.count[index] +=
+            shard.count[index].load(std::memory_order_relaxed);
+    }
+    for (int index = 0 ; index <= counter_max_errno ; ++index)
+    {
+        snap.errors[index] +=
+            shard.errors[index].load(std::memory_order_relaxed);
+    }
+}
+
+void add_to(std::atomic<uint64_t>& c, uint64_t n)
+{
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// Moves the calling thread's counts into the retired shard on thread exit
+struct ShardRetirer
+{
+    ~ShardRetirer()
+    {
+        CounterShard* shard = counter_local_shard;
+        if (shard == nullptr) return;
+        CounterRegistry& reg = registry();
+        {
+            std::lock_guard<std::mutex> lock(reg.mtx);
+            for (int index = 0 ; index < num_counters ; ++index)
+            {
+                add_to(reg.retired.count[index],
+                    shard->count[index].load(std::memory_order_relaxed));
+            }
+            for (int index = 0 ; index <= counter_max_errno ; ++index)
+            {
+                add_to(reg.retired.errors[index],
+                    shard->errors[index].load(std::memory_order_relaxed));
+            }
+            std::erase(reg.live, shard);
+        }
+        counter_local_shard = nullptr;
+        delete shard;
+    }
+};
+thread_local ShardRetirer retirer;
+
+} // anonymous namespace
+
+CounterShard& counter_new_shard()
+{
+    CounterShard* shard = new CounterShard{};
+    CounterRegistry& reg = registry();
+    {
+        std::lock_guard<std::mutex> lock(reg.mtx);
+        reg.live.push_back(shard);
+    }
+    counter_local_shard = shard;
+    // Touch the retirer so that its destructor runs at thread exit.
+    (void)&retirer;
+    return *shard;
+}
+
+void counter_error(int errn)
+{
+    CounterShard& shard = counter_shard();
+    if ((errn < 0) || (errn > counter_max_errno)) errn = counter_max_errno;
+    add_to(shard.errors[errn], 1);
+    add_to(shard.count[counter_exceptions], 1);
+}
+
+CounterSnapshot counters_snapshot()
+{
+    CounterSnapshot snap;
+    memset(&snap, 0, sizeof(snap));
+    CounterRegistry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mtx);
+    fold(snap, reg.retired);
+    for (const CounterShard* shard : reg.live) fold(snap, *shard);
+    return snap;
+}
+
+void counters_dump(std::ostream& ost)
+{
+    CounterSnapshot snap = counters_snapshot();
+    ost << my_time() << " counters:";
+    for (int index = 0 ; index < num_counters ; ++index)
+    {
+        ost << " " << counter_names[index] << " " << snap.count[index];
+    }
+    ost << std::endl;
+    bool any = false;
+    for (int index = 0 ; index <= counter_max_errno ; ++index)
+    {
+        if (snap.errors[index] == 0) continue;
+        if (!any) ost << my_time() << " errors:";
+        any = true;
+        ost << " ";
+        if (index == counter_max_errno) ost << ">=";
+        ost << index << "(" << strerror(index) << ") " << snap.errors[index];
+    }
+    if (any) ost << std::endl;
+}
+
+void counters_dump_on_signal()
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    ZEROCHECK("pthread_sigmask", pthread_sigmask(SIG_BLOCK, &set, nullptr));
+    // The new thread blocks every signal, so that none is delivered to it
+    // but by sigwait().
+    sigset_t all, old;
+    sigfillset(&all);
+    ZEROCHECK("pthread_sigmask", pthread_sigmask(SIG_SETMASK, &all, &old));
+    std::thread([set] ()
+        {
+            while (true)
+            {
+                int sig;
+                if (sigwait(&set, &sig) != 0) continue;
+                counters_dump(std::cerr);
+            }
+        }).detach();
+    ZEROCHECK("pthread_sigmask", pthread_sigmask(SIG_SETMASK, &old, nullptr));
+}
@@ -0,0 +1,77 @@
+#ifndef __COUNTERS_H_
+#define __COUNTERS_H_
+
+// Always-on statistics. Each thread counts into its own shard, with a
+// relaxed load and a relaxed store: no read-modify-write, no lock and no
+// shared cache line on the data path. counters_snapshot() sums the shards
+// on demand. When a thread exits, its shard is folded into a totals shard.
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+
+enum counter_id
+{
+    counter_bytes,             // Bytes written to the destination
+    counter_reads,             // Successful reads
+    counter_writes,            // Successful writes
+    counter_eagains,           // Reads or writes that would block
+    counter_polls,             // poll() calls in the copy loops
+    counter_exceptions,        // Read or write failures, all errno values
+    counter_connect_failures,  // Outgoing connections that failed
+    counter_spilled,           // Bytes read into a spill log
+    counter_captured,          // Bytes recorded in a capture file
+    counter_capture_drops,     // Capture records that did not fit
+    counter_spin_ns,           // Copy loops spinning, in latency mode
+    counter_blocked_ns,        // Copy loops in poll(), in latency mode
+    counter_admission_waits,   // Clients that waited for a client slot
+    counter_admission_wait_ns, // Time they waited, together
+    counter_admission_rejects, // Clients closed at once, for overload
+    counter_pair_timeouts,     // Listen clients closed with no partner
+    num_counters
+};
+
+// errno values from this one up are counted together
+constexpr int counter_max_errno{160};
+
+struct CounterShard
+{
+    alignas(64) std::atomic<uint64_t> count[num_counters];
+    std::atomic<uint64_t> errors[counter_max_errno + 1];
+};
+
+// The calling thread's shard, created on first use
+extern thread_local CounterShard* counter_local_shard;
+CounterShard& counter_new_shard();
+inline CounterShard& counter_shard()
+{
+    CounterShard* shard = counter_local_shard;
+    return shard ? *shard : counter_new_shard();
+}
+
+inline void counter_add(counter_id id, uint64_t n = 1)
+{
+    // Only the owning thread stores, so load + store does not lose counts.
+    std::atomic<uint64_t>& c = counter_shard().count[id];
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// A read or write failure, by errno. Also counts counter_exceptions.
+void counter_error(int errn);
+
+struct CounterSnapshot
+{
+    uint64_t count[num_counters];
+    uint64_t errors[counter_max_errno + 1];
+};
+CounterSnapshot counters_snapshot();
+
+// Prints the non-zero counters on one line, and errors on another
+void counters_dump(std::ostream& ost);
+
+// Dumps the counters to std::cerr on every SIGUSR1. Call from main()
+// before any other thread is created, since SIGUSR1 is blocked here and
+// handled by sigwait() in a thread of its own.
+void counters_dump_on_signal();
+
+#endif // __COUNTERS_H_
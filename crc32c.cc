@@ -0,0 +1,164 @@
+#include "crc32c.h"
+
+#include <cstdio>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+namespace
+{
+
+constexpr uint32_t polynomial{0x82F63B78};  // Reflected
+
+// Slicing by 8: table[k][b] is the CRC of byte b followed by k zero bytes.
+struct Tables
+{
+    Tables()
+    {
+        for (uint32_t byte = 0 ; byte < 256 ; ++byte)
+        {
+            uint32_t crc = byte;
+            for (int bit = 0 ; bit < 8 ; ++bit)
+            {
+                crc = (crc >> 1) ^ ((crc & 1) ? polynomial : 0);
+            }
+            table[0][byte] = crc;
+        }
+        for (uint32_t byte = 0 ; byte < 256 ; ++byte)
+        {
+            for (int k = 1 ; k < 8 ; ++k)
+            {
+                uint32_t prev = table[k - 1][byte];
+                table[k][byte] = (prev >> 8) ^ table[0][prev & 0xFF];
+            }
+        }
+    }
+    uint32_t table[8][256];
+};
+
+uint32_t crc32c_table(uint32_t crc, const unsigned char* p, size_t length)
+{
+    static const Tables tables;
+    const auto& t = tables.table;
+    while (length && ((uintptr_t)p & 7))
+    {
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+        --length;
+    }
+    while (length >= 8)
+    {
+        // Little endian only. Byte order does not matter for the tail.
+        uint32_t low, high;
+        memcpy(&low, p, 4);
+        memcpy(&high, p + 4, 4);
+        low ^= crc;
+        crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^
+            t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24] ^
+            t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^
+            t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+        p += 8;
+        length -= 8;
+    }
+    while (length--)
+    {
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hardware(uint32_t crc, const unsigned char* p, size_t length)
+{
+    while (length && ((uintptr_t)p & 7))
+    {
+        crc = _mm_crc32_u8(crc, *p++);
+        --length;
+    }
+    uint64_t crc64 = crc;
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (length--) crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+
+bool have_hardware() { return __builtin_cpu_supports("sse4.2"); }
+constexpr const char* hardware_name{"sse4.2"};
+
+#elif defined(__aarch64__)
+
+__attribute__((target("+crc")))
+uint32_t crc32c_hardware(uint32_t crc, const unsigned char* p, size_t length)
+{
+    while (length && ((uintptr_t)p & 7))
+    {
+        crc = __crc32cb(crc, *p++);
+        --length;
+    }
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc = __crc32cd(crc, word);
+        p += 8;
+        length -= 8;
+    }
+    while (length--) crc = __crc32cb(crc, *p++);
+    return crc;
+}
+
+bool have_hardware() { return getauxval(AT_HWCAP) & HWCAP_CRC32; }
+constexpr const char* hardware_name{"armv8"};
+
+#else
+
+uint32_t crc32c_hardware(uint32_t crc, const unsigned char* p, size_t length)
+{
+    return crc32c_table(crc, p, length);
+}
+
+bool have_hardware() { return false; }
+constexpr const char* hardware_name{"table"};
+
+#endif
+
+using Method = uint32_t (*)(uint32_t, const unsigned char*, size_t);
+
+Method choose()
+{
+    return have_hardware() ? crc32c_hardware : crc32c_table;
+}
+
+} // anonymous namespace
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t length)
+{
+    static const Method method = choose();
+    return ~method(~crc, (const unsigned char*)data, length);
+}
+
+const char* crc32c_method()
+{
+    return have_hardware() ? hardware_name : "table";
+}
+
+std::string crc32c_string(uint32_t crc)
+{
+    char str[9];
+    snprintf(str, sizeof(str), "%08x", crc);
+    return str;
+}
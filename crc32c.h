@@ -0,0 +1,22 @@
+#ifndef __CRC32C_H_
+#define __CRC32C_H_
+
+// CRC-32C (Castagnoli), as used by iSCSI, ext4 and SCTP. Uses the CRC
+// instructions of SSE4.2 or ARMv8 when the processor has them, and tables
+// otherwise.
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Continues crc, which is 0 to start, over length bytes at data. Calls can
+// be chained: crc32c(crc32c(0, a, m), b, n) is the CRC of a then b.
+uint32_t crc32c(uint32_t crc, const void* data, size_t length);
+
+// "sse4.2", "armv8" or "table"
+const char* crc32c_method();
+
+// Eight hex digits, for the log
+std::string crc32c_string(uint32_t crc);
+
+#endif // __CRC32C_H_
@@ -0,0 +1,313 @@
+#include "fanin.h"
+#include "counters.h"
+#include "iopackage.h"
+#include "logger.h"
+#include "miscutils.h"
+#include "ringbufr.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// Tuning (compile time)
+constexpr size_t fanin_max_iov{64};  // Buffers in one writev()
+
+namespace
+{
+
+struct FanInput
+{
+    FanInput(int sock, unsigned num, size_t ring_size)
+        : fd(sock), client_num(num), bufr(ring_size) { }
+    ~FanInput()
+    {
+        shutdown(fd, SHUT_RDWR);
+        close(fd);
+    }
+    FanInput(const FanInput&) = delete;
+    FanInput& operator=(const FanInput&) = delete;
+
+    // The byte at offset from the front of the content
+    unsigned char at(size_t offset) const
+    {
+        size_t avail1, avail2;
+        unsigned char* start1;
+        unsigned char* start2;
+        bufr.popInquire(avail1, start1, avail2, start2);
+        return (offset < avail1) ? start1[offset] : start2[offset - avail1];
+    }
+
+    int fd;
+    unsigned client_num;
+    RingbufR<unsigned char> bufr;
+    size_t ready{0};            // Bytes to the end of the last whole record
+    bool eof{false};
+    bool unterminated{false};   // Ended inside a record: a delimiter is owed
+};
+
+// Of one input, in a batch
+struct Part
+{
+    FanInput* input;
+    size_t length;
+};
+
+// Updates ready for count new bytes, just read into vec
+void scan(FanInput& in, const struct iovec vec[2], size_t count,
+    int delimiter, size_t before)
+{
+    size_t first = std::min(count, vec[0].iov_len);
+    if (count > first)
+    {
+        const void* found =
+            memrchr(vec[1].iov_base, delimiter, count - first);
+        if (found)
+        {
+            in.ready = before + first +
+                ((const unsigned char*)found -
+                    (const unsigned char*)vec[1].iov_base) + 1;
+            return;
+        }
+    }
+    const void* found = memrchr(vec[0].iov_base, delimiter, first);
+    if (found)
+    {
+        in.ready = before +
+            ((const unsigned char*)found -
+                (const unsigned char*)vec[0].iov_base) + 1;
+    }
+}
+
+// Adds length bytes from the front of in to iov
+void gather(FanInput& in, size_t length, std::vector<struct iovec>& iov)
+{
+    size_t avail1, avail2;
+    unsigned char* start1;
+    unsigned char* start2;
+    in.bufr.popInquire(avail1, start1, avail2, start2);
+    size_t first = std::min(length, avail1);
+    iov.push_back({start1, first});
+    if (length > first) iov.push_back({start2, length - first});
+}
+
+} // anonymous namespace
+
+void copyfd_fanin(Listener& listener, int writefd, int delimiter,
+    size_t ring_size, fanin_stats& stats)
+{
+    stats = fanin_stats{0, 0, 0, 0};
+    std::vector<std::unique_ptr<FanInput>> inputs;
+    FanInput* pinned = nullptr;   // Its record is partly written
+    size_t next_input = 0;        // Round robin start of a batch
+    bool output_blocked = false;
+    bool more = false;            // Written, and maybe more to write
+    std::vector<pollfd> pfd;
+    std::vector<struct iovec> iov;
+    std::vector<Part> parts;
+
+    while (true)
+    {
+        // Listening ports, inputs with room, then the output
+        size_t nports = listener.size();
+        pfd.resize(nports + inputs.size() + 1);
+        for (size_t index = 0 ; index < nports ; ++index)
+        {
+            pfd[index].fd = listener.fd(index);
+            pfd[index].events = POLLIN;
+        }
+        for (size_t index = 0 ; index < inputs.size() ; ++index)
+        {
+            FanInput& in = *inputs[index];
+            bool room = in.bufr.size() < in.bufr.capacity();
+            pfd[nports + index].fd = (!in.eof && room) ? in.fd : -1;
+            pfd[nports + index].events = POLLIN;
+        }
+        pfd.back().fd = output_blocked ? writefd : -1;
+        pfd.back().events = POLLOUT;
+        NEGCHECK("poll", poll(pfd.data(), pfd.size(), more ? 0 : -1));
+        counter_add(counter_polls);
+
+        // Read from each input that is ready
+        for (size_t index = 0 ; index < inputs.size() ; ++index)
+        {
+            if (pfd[nports + index].fd < 0) continue;
+            if (pfd[nports + index].revents == 0) continue;
+            FanInput& in = *inputs[index];
+            size_t avail1, avail2;
+            unsigned char* start1;
+            unsigned char* start2;
+            size_t nseg = in.bufr.pushInquire(avail1, start1, avail2, start2);
+            struct iovec vec[2] = {{start1, avail1}, {start2, avail2}};
+            ssize_t bytes_read = readv(in.fd, vec, nseg);
+            if (bytes_read > 0)
+            {
+                size_t before = in.bufr.size();
+                in.bufr.push(bytes_read);
+                counter_add(counter_reads);
+                if (delimiter == fanin_no_delimiter)
+                {
+                    in.ready = in.bufr.size();
+                }
+                else
+                {
+                    scan(in, vec, bytes_read, delimiter, before);
+                }
+            }
+            else if ((bytes_read < 0) &&
+                ((errno == EWOULDBLOCK) || (errno == EAGAIN)))
+            {
+                counter_add(counter_eagains);
+            }
+            else
+            {
+                if (bytes_read < 0)
+                {
+                    counter_error(errno);
+                    LOG(3, in.client_num) << "Read failure: " <<
+                        strerror(errno);
+                }
+                in.eof = true;
+                in.unterminated = (delimiter != fanin_no_delimiter) &&
+                    ((in.ready < in.bufr.size()) ||
+                     ((pinned == &in) && (in.bufr.size() == 0)));
+            }
+        }
+
+        // New inputs, after the reads so that inputs keeps its order
+        for (size_t index = 0 ; index < nports ; ++index)
+        {
+            if (pfd[index].revents == 0) continue;
+            Listener::SocketInfo info;
+            while (listener.accept_client(index, stats.inputs + 1, info))
+            {
+                ++stats.inputs;
+                set_flags(info.socketFD, O_NONBLOCK);
+                inputs.push_back(std::make_unique<FanInput>(
+                    info.socketFD, stats.inputs, ring_size));
+            }
+        }
+
+        // Finish the last record of each input that ended inside one
+        for (std::unique_ptr<FanInput>& in : inputs)
+        {
+            if (!in->unterminated) continue;
+            size_t avail1, avail2;
+            unsigned char* start1;
+            unsigned char* start2;
+            if (in->bufr.pushInquire(avail1, start1, avail2, start2) == 0)
+            {
+                continue;
+            }
+            *(avail1 ? start1 : start2) = (unsigned char)delimiter;
+            in->bufr.push(1);
+            in->ready = in->bufr.size();
+            in->unterminated = false;
+        }
+
+        if (pfd.back().revents) output_blocked = false;
+        more = false;
+        if (!output_blocked && !inputs.empty())
+        {
+            // Gather whole records, from one input if pinned, or else from
+            // each in turn. A record too long for its ring goes last, and
+            // pins the output.
+            iov.clear();
+            parts.clear();
+            if (pinned)
+            {
+                size_t length =
+                    pinned->ready ? pinned->ready : pinned->bufr.size();
+                if (length)
+                {
+                    gather(*pinned, length, iov);
+                    parts.push_back({pinned, length});
+                }
+            }
+            else
+            {
+                size_t count = inputs.size();
+                for (size_t step = 0 ; step < count ; ++step)
+                {
+                    if (iov.size() + 2 > fanin_max_iov) break;
+                    FanInput& in = *inputs[(next_input + step) % count];
+                    size_t length = in.ready;
+                    bool whole = true;
+                    if ((length == 0) &&
+                        (in.bufr.size() == in.bufr.capacity()))
+                    {
+                        length = in.bufr.size();
+                        whole = false;
+                    }
+                    if (length == 0) continue;
+                    gather(in, length, iov);
+                    parts.push_back({&in, length});
+                    if (!whole) break;
+                }
+                next_input = (next_input + 1) % count;
+            }
+
+            if (!iov.empty())
+            {
+                ssize_t bytes_write = writev(writefd, iov.data(), iov.size());
+                if (bytes_write > 0)
+                {
+                    ++stats.batches;
+                    stats.segments += iov.size();
+                    stats.bytes += bytes_write;
+                    counter_add(counter_writes);
+                    counter_add(counter_bytes, bytes_write);
+                    more = true;
+                    // Pop what was written. Only the last input touched
+                    // can end inside a record.
+                    size_t left = bytes_write;
+                    for (const Part& part : parts)
+                    {
+                        FanInput& in = *part.input;
+                        size_t take = std::min(left, part.length);
+                        if (delimiter != fanin_no_delimiter)
+                        {
+                            pinned = (in.at(take - 1) == delimiter)
+                                ? nullptr : &in;
+                        }
+                        in.bufr.pop(take);
+                        in.ready -= std::min(in.ready, take);
+                        left -= take;
+                        if (left == 0) break;
+                    }
+                }
+                else if ((bytes_write < 0) &&
+                    ((errno == EWOULDBLOCK) || (errno == EAGAIN)))
+                {
+                    output_blocked = true;
+                    counter_add(counter_eagains);
+                }
+                else
+                {
+                    int ern = (bytes_write < 0) ? errno : 0;
+                    if (ern) counter_error(ern);
+                    IOPackageWriteException w(ern, stats.bytes);
+                    throw(w);
+                }
+            }
+        }
+
+        // Inputs that have ended, and been written out
+        std::erase_if(inputs, [&pinned] (const std::unique_ptr<FanInput>& in)
+        {
+            if (!in->eof || in->unterminated || in->bufr.size()) return false;
+            if (pinned == in.get()) pinned = nullptr;
+            LOG(3, in->client_num) << "Input ended";
+            return true;
+        });
+    }
+}
+
+#include "ringbufr.tcc"
@@ -0,0 +1,32 @@
+#ifndef __FANIN_H_
+#define __FANIN_H_
+
+// Fan-in: every client of a listener is an input, and all are merged into
+// one output. Each input reads into a ring of its own. The writer gathers
+// whatever is ready in the rings into one writev(). With a delimiter, only
+// whole records (each ending in the delimiter byte) are taken from a ring,
+// so that inputs never interleave inside a record. A record too long for
+// its ring, or cut short by a partial write, pins the output to its input
+// until the record is finished.
+
+#include "netutils.h"
+#include <cstddef>
+
+// No delimiter: bytes are merged as they come
+constexpr int fanin_no_delimiter{-1};
+
+struct fanin_stats
+{
+    size_t inputs;      // Clients accepted
+    size_t bytes;       // Written to the output
+    size_t batches;     // Successful writev() calls
+    size_t segments;    // Buffers that they gathered
+};
+
+// Runs until the output fails, which throws IOPackageWriteException;
+// stats is kept up to date for the caller to report. An input that ends
+// without a delimiter has one added. writefd is non-blocking.
+void copyfd_fanin(Listener& listener, int writefd, int delimiter,
+    size_t ring_size, fanin_stats& stats);
+
+#endif // __FANIN_H_
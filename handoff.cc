@@ -0,0 +1,142 @@
+#include "handoff.h"
+#include "miscutils.h"
+#include "netutils.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+namespace
+{
+
+// Tuning (compile time)
+constexpr size_t max_handoff_fds{64};
+
+constexpr char handoff_magic[8] = {'T', 'C', 'P', 'H', 'O', 'F', 'F', '1'};
+
+// Sent with the file descriptors
+struct HandoffHeader
+{
+    char magic[8];
+    uint32_t count;
+    uint32_t unused;
+};
+
+// Room for max_handoff_fds in one control message
+union HandoffControl
+{
+    char buffer[CMSG_SPACE(max_handoff_fds * sizeof(int))];
+    struct cmsghdr align;
+};
+
+std::string failure(const std::string& what)
+{
+    return "handoff: " + what + " : " + strerror(errno);
+}
+
+} // anonymous namespace
+
+void handoff_give(int sock, const std::vector<int>& fds)
+{
+    if (fds.empty() || (fds.size() > max_handoff_fds))
+    {
+        throw HandoffException("handoff: too many or no listening sockets");
+    }
+    HandoffHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, handoff_magic, sizeof(header.magic));
+    header.count = fds.size();
+    struct iovec vec{&header, sizeof(header)};
+
+    HandoffControl control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &vec;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = CMSG_SPACE(fds.size() * sizeof(int));
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds.data(), fds.size() * sizeof(int));
+
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(header))
+    {
+        throw HandoffException(failure("sendmsg"));
+    }
+    char ack;
+    ssize_t count = read(sock, &ack, 1);
+    if (count < 0) throw HandoffException(failure("acknowledgement"));
+    if (count == 0)
+    {
+        throw HandoffException("handoff: the new process gave up");
+    }
+}
+
+std::vector<int> handoff_take(const std::string& path, int& sock)
+{
+    sock = socket_from_unix_path(0, path);
+    if (sock < 0) throw HandoffException(failure("connect to " + path));
+    // Blocking from here on
+    ZEROCHECK("fcntl",
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) & ~O_NONBLOCK));
+
+    HandoffHeader header;
+    struct iovec vec{&header, sizeof(header)};
+    HandoffControl control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &vec;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    ssize_t count = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    if (count < 0) throw HandoffException(failure("recvmsg"));
+
+    std::vector<int> fds;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg) ; cmsg ;
+        cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if ((cmsg->cmsg_level != SOL_SOCKET) ||
+            (cmsg->cmsg_type != SCM_RIGHTS))
+        {
+            continue;
+        }
+        size_t nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        const unsigned char* data = CMSG_DATA(cmsg);
+        for (size_t index = 0 ; index < nfds ; ++index)
+        {
+            int fd;
+            memcpy(&fd, data + index * sizeof(int), sizeof(int));
+            fds.push_back(fd);
+        }
+    }
+    if ((count != (ssize_t)sizeof(header)) ||
+        memcmp(header.magic, handoff_magic, sizeof(header.magic)) ||
+        (msg.msg_flags & MSG_CTRUNC) || (header.count != fds.size()))
+    {
+        for (int fd : fds) close(fd);
+        close(sock);
+        throw HandoffException("handoff: bad message from " + path);
+    }
+    return fds;
+}
+
+void handoff_done(int sock)
+{
+    char ack = 1;
+    if (write(sock, &ack, 1) != 1)
+    {
+        int ern = errno;
+        close(sock);
+        errno = ern;
+        throw HandoffException(failure("acknowledge"));
+    }
+    close(sock);
+}
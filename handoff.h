@@ -0,0 +1,32 @@
+#ifndef __HANDOFF_H_
+#define __HANDOFF_H_
+
+// Listening socket handoff, for a restart without accept downtime. The old
+// process passes its listening sockets over a Unix domain socket with
+// SCM_RIGHTS. The new process accepts on the same sockets, so clients that
+// arrive during the restart wait in the kernel's accept queue instead of
+// being refused. The old process stops accepting only when the new one
+// acknowledges, and keeps its established relays until they end.
+
+#include <string>
+#include <vector>
+
+// For a handoff that could not be completed
+struct HandoffException
+{
+    HandoffException(const std::string& str) : strng(str) { }
+    std::string strng;
+};
+
+// Old side. Sends fds over the connected socket sock, then waits for the
+// acknowledgement. Does not close anything.
+void handoff_give(int sock, const std::vector<int>& fds);
+
+// New side. Connects to path and receives the listening sockets, in the
+// order given. sock is left open for handoff_done().
+std::vector<int> handoff_take(const std::string& path, int& sock);
+
+// New side. Tells the old process to stop accepting, and closes sock.
+void handoff_done(int sock);
+
+#endif // __HANDOFF_H_
@@ -1,16 +1,47 @@
 #include "iopackage.h"
+#include "counters.h"
+#include "crc32c.h"
+#include "trace.h"
 
-#include <chrono>
-using namespace std::chrono;
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <limits>
 
-#ifdef VERBOSE
-#include <iomanip>
-#include <iostream>
-#endif
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
 
 IOPackageBase::IOPackageBase(
-        int rdfd, int wrfd, size_t store_size, unsigned char* store)
-    : readfd(rdfd), writefd(wrfd), bufr(store_size, store) { }
+        int rdfd, int wrfd, size_t store_size, unsigned char* store,
+        const iopackage_options& opts)
+    : readfd(rdfd), writefd(wrfd), options(opts), bufr(store_size, store)
+{
+    assert(!options.transform || (options.trailer == crc_trailer::none));
+    if (options.trailer != crc_trailer::none) options.checksum = true;
+    if (options.transform && !options.transform->in_place())
+    {
+        tbufr = std::make_unique<RingbufR<unsigned char>>(store_size);
+    }
+}
+
+size_t IOPackageBase::read_allowance()
+{
+    size_t allowance = std::numeric_limits<size_t>::max();
+    for (TokenBucket* bucket : {options.connection_limit, options.global_limit})
+    {
+        if (bucket == nullptr) continue;
+        int wait;
+        size_t avail = bucket->available(wait);
+        if (avail == 0)
+        {
+            throttle_ms = std::max(throttle_ms, wait);
+        }
+        allowance = std::min(allowance, avail);
+    }
+    return allowance;
+}
 
 bool IOPackageBase::cycle(pollfd pfd[2])
 {
@@ -19,36 +50,83 @@ bool IOPackageBase::cycle(pollfd pfd[2])
     pfd[0].revents = 0;
     pfd[1].revents = 0;
 
-    if (inquire_needed)
+    // The ring changes behind our back while anything is spilled, or
+    // while a transform takes from it.
+    if (inquire_needed || options.spill || tbufr)
     {
         read_nseg = bufr.pushInquire(
             readvec[0].iov_len, read_start0,
             readvec[1].iov_len, read_start1);
     }
     bytes_read = 0;
-    if (read_nseg)
+    throttle_ms = -1;
+    // The peer has nothing more for now: read() said EAGAIN. Not so when
+    // reading was held back by a full ring or spill budget, or rate limits.
+    bool input_idle = false;
+    // Once anything is spilled, all input goes to the spill log until the
+    // ring has taken it back, so that the order is kept.
+    bool spilling = options.spill &&
+        ((read_nseg == 0) || !options.spill->empty());
+    if (read_nseg || spilling)
     {
-        readvec[0].iov_base = read_start0;
-        readvec[1].iov_base = read_start1;
-#if (VERBOSE >= 4)
-        auto before = system_clock::now();
-#endif
-        bytes_read = readv(readfd, readvec, read_nseg);
-#if (VERBOSE >= 4)
-        auto after = system_clock::now();
-        auto dur = duration_cast<milliseconds>(after - before).count();
-        std::cerr << "read time " << dur << std::endl;
-#endif
-        if (bytes_read < 0)
+        // Rate limits shorten the read, without disturbing readvec.
+        struct iovec vec[2] = {{nullptr, 0}, {nullptr, 0}};
+        size_t nseg;
+        if (spilling)
+        {
+            unsigned char* start = nullptr;
+            vec[0].iov_len = options.spill->reserve(start);
+            vec[0].iov_base = start;
+            nseg = vec[0].iov_len ? 1 : 0;
+        }
+        else
+        {
+            readvec[0].iov_base = read_start0;
+            readvec[1].iov_base = read_start1;
+            vec[0] = readvec[0];
+            vec[1] = readvec[1];
+            nseg = read_nseg;
+        }
+        if (nseg && (options.connection_limit || options.global_limit))
+        {
+            size_t allowance = read_allowance();
+            if (allowance < vec[0].iov_len)
+            {
+                vec[0].iov_len = allowance;
+                nseg = 1;
+            }
+            else if (allowance < vec[0].iov_len + vec[1].iov_len)
+            {
+                vec[1].iov_len = allowance - vec[0].iov_len;
+            }
+            if (allowance == 0) nseg = 0;
+        }
+        bytes_read = nseg ? readv(readfd, vec, nseg) : -1;
+        if (nseg)
+        {
+            // Ring size before this read is committed
+            TRACE(read, options.trace_id,
+                (bytes_read < 0) ? -errno : bytes_read, bufr.size());
+        }
+        if (nseg == 0)
+        {
+            // Out of tokens. Like EAGAIN, but the caller waits for wait_ms()
+            // instead of POLLIN. Or out of spill budget, when it waits for
+            // the writer.
+        }
+        else if (bytes_read < 0)
         {
             if ((errno == EWOULDBLOCK) || (errno == EAGAIN))
             {
                 // poll() may be needed
                 pfd[0].events = POLLIN;
+                counter_add(counter_eagains);
+                input_idle = true;
             }
             else
             {
                 // Some other error on input
+                counter_error(errno);
                 IOPackageReadException r(errno, bytes_copied);
                 throw(r);
             }
@@ -56,45 +134,116 @@ bool IOPackageBase::cycle(pollfd pfd[2])
         else if (bytes_read == 0)
         {
             // End of input
-            ;
+            input_ended = true;
         }
         else
         {
             // Some data was input, no need to poll.
-            bufr.push(bytes_read);
+            if (options.capture)
+            {
+                options.capture->data(options.trace_id,
+                    options.capture_direction, vec, bytes_read);
+            }
+            if (options.transform && options.transform->in_place())
+            {
+                size_t first = std::min((size_t)bytes_read, vec[0].iov_len);
+                options.transform->filter(
+                    (unsigned char*)vec[0].iov_base, first);
+                if ((size_t)bytes_read > first)
+                {
+                    options.transform->filter(
+                        (unsigned char*)vec[1].iov_base, bytes_read - first);
+                }
+            }
+            if (spilling)
+            {
+                options.spill->commit(bytes_read);
+                bytes_spilled += bytes_read;
+                counter_add(counter_spilled, bytes_read);
+            }
+            else
+            {
+                bufr.push(bytes_read);
+            }
+            counter_add(counter_reads);
+            if (options.connection_limit)
+                options.connection_limit->consume(bytes_read);
+            if (options.global_limit)
+                options.global_limit->consume(bytes_read);
+            if (options.quickack)
+            {
+                // Quick ACK mode does not last. Failure costs only speed.
+                int one = 1;
+                setsockopt(readfd, IPPROTO_TCP, TCP_QUICKACK, &one,
+                    sizeof(one));
+            }
         }
     }
 
+    if (options.spill && !options.spill->empty()) unspill();
+
+    // A transform may take input and give nothing yet. That is progress.
+    bool converted = false;
+    if (tbufr)
+    {
+        // Idle input must not strand data inside the transform.
+        bool drained = input_ended &&
+            (!options.spill || options.spill->empty());
+        converted = convert(drained ? transform_flush::end :
+            input_idle ? transform_flush::sync : transform_flush::none);
+    }
+    RingbufRbase<unsigned char>& wbufr = tbufr ? *tbufr : bufr;
+
     bytes_write = 0;
-    if (inquire_needed)
+    if (inquire_needed || options.spill || tbufr)
     {
-        write_nseg = bufr.popInquire(
+        write_nseg = wbufr.popInquire(
             writevec[0].iov_len, write_start0,
             writevec[1].iov_len, write_start1);
     }
+    // A trailer to verify is held back, without disturbing writevec.
+    struct iovec vec[2] = {{nullptr, 0}, {nullptr, 0}};
+    size_t nseg = write_nseg;
     if (write_nseg)
     {
         writevec[0].iov_base = write_start0;
         writevec[1].iov_base = write_start1;
-#if (VERBOSE >= 4)
-        auto before = system_clock::now();
-#endif
-        bytes_write = writev(writefd, writevec, write_nseg);
-#if (VERBOSE >= 4)
-        auto after = system_clock::now();
-        auto dur = duration_cast<milliseconds>(after - before).count();
-        std::cerr << "write time " << dur << std::endl;
-#endif
+        vec[0] = writevec[0];
+        vec[1] = writevec[1];
+        if ((options.trailer == crc_trailer::verify) && !trailer_done)
+        {
+            size_t allowance =
+                wbufr.size() - std::min(wbufr.size(), sizeof(crc));
+            if (allowance <= vec[0].iov_len)
+            {
+                vec[0].iov_len = allowance;
+                nseg = allowance ? 1 : 0;
+            }
+            else
+            {
+                vec[1].iov_len = allowance - vec[0].iov_len;
+            }
+        }
+    }
+    if (nseg)
+    {
+        bytes_write = writev(writefd, vec, nseg);
+        TRACE(write, options.trace_id,
+            (bytes_write < 0) ? -errno : bytes_write, wbufr.size());
         if (bytes_write < 0)
         {
-            if ((errno == EWOULDBLOCK) || (errno == EAGAIN))
+            // EINPROGRESS: a Fast Open socket whose handshake is not done.
+            if ((errno == EWOULDBLOCK) || (errno == EAGAIN) ||
+                (errno == EINPROGRESS))
             {
                 // poll() may be needed
                 pfd[1].events = POLLOUT;
+                counter_add(counter_eagains);
             }
             else
             {
                 // Some other error on write
+                counter_error(errno);
                 IOPackageWriteException w(errno, bytes_copied);
                 throw(w);
             }
@@ -108,49 +257,159 @@ bool IOPackageBase::cycle(pollfd pfd[2])
         else
         {
             // Some data was output, no need to poll.
-            bufr.pop(bytes_write);
+            if (options.checksum && !trailer_done)
+            {
+                size_t first = std::min((size_t)bytes_write, vec[0].iov_len);
+                crc = crc32c(crc, vec[0].iov_base, first);
+                crc = crc32c(crc, vec[1].iov_base, bytes_write - first);
+            }
+            wbufr.pop(bytes_write);
             bytes_copied += bytes_write;
+            counter_add(counter_writes);
+            counter_add(counter_bytes, bytes_write);
         }
     }
 
+    bool appended = false;
+    if ((options.trailer != crc_trailer::none) && !trailer_done &&
+        input_ended && (!options.spill || options.spill->empty()))
+    {
+        appended = finish_trailer(wbufr);
+    }
+
     // Only block if really necessary
     if (bytes_read  > 0) pfd[1].events = 0;
     if (bytes_write > 0) pfd[0].events = 0;
 
+    // No need to sleep while output is making progress
+    if (bytes_write > 0) throttle_ms = -1;
+
     // Only inquire if really necessary
-    inquire_needed = ((bytes_read > 0) || (bytes_write > 0));
+    inquire_needed = ((bytes_read > 0) || (bytes_write > 0) || appended);
+
+    return (bytes_read || bytes_write || converted || appended);
+}
 
-#if (VERBOSE >= 4)
-        if (read_nseg)
+// Moves spilled data into the free space of the ring, oldest first
+void IOPackageBase::unspill()
+{
+    const unsigned char* from;
+    size_t count;
+    while ((count = options.spill->peek(from)) > 0)
+    {
+        size_t avail1, avail2;
+        unsigned char* start1;
+        unsigned char* start2;
+        if (bufr.pushInquire(avail1, start1, avail2, start2) == 0) break;
+        // The first segment is empty when the ring ends at the store's end.
+        if (avail1 == 0)
         {
-            std::cerr << std::setw(7) << std::left << "read" <<
-                std::setw(6) << std::right << bytes_read;
+            avail1 = avail2;
+            start1 = start2;
         }
-        else
-            std::cerr << std::setw(13) << " ";
-        std::cerr << "    ";
-        if (write_nseg)
+        count = std::min(count, avail1);
+        memcpy(start1, from, count);
+        bufr.push(count);
+        options.spill->consume(count);
+    }
+}
+
+// Runs the transform from the read ring into the write ring, until it
+// takes and gives nothing. flush goes with the last of the read ring.
+// Returns true if anything moved.
+bool IOPackageBase::convert(transform_flush flush)
+{
+    bool moved = false;
+    while (true)
+    {
+        size_t in1, in2, out1, out2;
+        unsigned char* in_start1;
+        unsigned char* in_start2;
+        unsigned char* out_start1;
+        unsigned char* out_start2;
+        bufr.popInquire(in1, in_start1, in2, in_start2);
+        if (tbufr->pushInquire(out1, out_start1, out2, out_start2) == 0) break;
+        if (in1 == 0)
         {
-            std::cerr << std::setw(7) << std::left << "write" <<
-                std::setw(6) << std::right << bytes_write;
+            in1 = in2;
+            in_start1 = in_start2;
+            in2 = 0;
         }
-        else
-            std::cerr << std::setw(13) << "  ";
-        std::cerr << "    ";
-        std::cerr << (pfd[0].events ? "x" : "|");
-        std::cerr << (pfd[1].events ? "x" : "|");
-        std::cerr << std::endl;
-#endif
-        return (bytes_read || bytes_write);
+        if (out1 == 0)
+        {
+            out1 = out2;
+            out_start1 = out_start2;
+        }
+        size_t consumed;
+        size_t produced = options.transform->convert(
+            in_start1, in1, consumed, out_start1, out1,
+            in2 ? transform_flush::none : flush);
+        bufr.pop(consumed);
+        tbufr->push(produced);
+        if ((consumed == 0) && (produced == 0)) break;
+        moved = true;
+    }
+    return moved;
+}
+
+// At the end of input, once all data is written: appends the trailer, or
+// checks and drops the one held back. Returns true if one was appended.
+bool IOPackageBase::finish_trailer(RingbufRbase<unsigned char>& wbufr)
+{
+    unsigned char trailer[sizeof(crc)];
+    size_t avail1, avail2;
+    unsigned char* start1;
+    unsigned char* start2;
+    if (options.trailer == crc_trailer::append)
+    {
+        if (wbufr.size()) return false;
+        for (size_t index = 0 ; index < sizeof(crc) ; ++index)
+        {
+            trailer[index] = (crc >> (8 * index)) & 0xFF;
+        }
+        wbufr.pushInquire(avail1, start1, avail2, start2);
+        size_t first = std::min(sizeof(trailer), avail1);
+        memcpy(start1, trailer, first);
+        memcpy(start2, trailer + first, sizeof(trailer) - first);
+        wbufr.push(sizeof(trailer));
+        trailer_done = true;
+        return true;
+    }
+    if (wbufr.size() > sizeof(crc)) return false;
+    uint32_t expected = 0;
+    if (wbufr.size() == sizeof(crc))
+    {
+        wbufr.popInquire(avail1, start1, avail2, start2);
+        size_t first = std::min(sizeof(trailer), avail1);
+        memcpy(trailer, start1, first);
+        memcpy(trailer + first, start2, sizeof(trailer) - first);
+        for (size_t index = 0 ; index < sizeof(crc) ; ++index)
+        {
+            expected |= (uint32_t)trailer[index] << (8 * index);
+        }
+    }
+    if ((wbufr.size() < sizeof(crc)) || (expected != crc))
+    {
+        counter_error(EBADMSG);
+        IOPackageReadException r(EBADMSG, bytes_copied);
+        throw(r);
+    }
+    wbufr.pop(sizeof(crc));
+    trailer_done = true;
+    return false;
 }
 
 iopackage_stats IOPackageBase::report() const
 {
     iopackage_stats stats;
     stats.bytes_copied = bytes_copied;
-    auto result = bufr.getState();
-    stats.reads = result.pushes;
-    stats.writes = result.pops;
+    stats.bytes_spilled = bytes_spilled;
+    stats.crc32c = crc;
+    stats.spin_ns = 0;     // Filled in by the copy loops
+    stats.blocked_ns = 0;
+    stats.reads = bufr.getState().pushes;
+    // With a transform, what was written left from its output ring.
+    stats.writes = (tbufr ? tbufr->getState() : bufr.getState()).pops;
     return stats;
 }
 
@@ -1,7 +1,13 @@
 #ifndef __IOPACKAGE_H_
 #define __IOPACKAGE_H_
 
+#include "capture.h"
 #include "ringbufr.h"
+#include "ratelimit.h"
+#include "spilllog.h"
+#include "transform.h"
+#include <memory>
+#include <cstdint>
 #include <poll.h>
 #include <sys/uio.h>
 
@@ -10,6 +16,46 @@ struct iopackage_stats
     size_t reads;
     size_t writes;
     size_t bytes_copied;
+    size_t bytes_spilled;  // Read into the spill log
+    uint32_t crc32c;       // Of the bytes written, with options.checksum
+    // With options.spin_us, time the copy loop spent spinning and blocked
+    // in poll(). copyfd2() reports its loop in both directions.
+    uint64_t spin_ns;
+    uint64_t blocked_ns;
+};
+
+// A trailer is the CRC32C of the data before it, 4 bytes little endian.
+enum class crc_trailer
+{
+    none,
+    append,   // Write one after the data
+    verify    // Expect one at the end of input, and do not write it
+};
+
+// Optional behavior. Pointers are not owned, and may be shared between
+// several packages, except for spill and transform.
+struct iopackage_options
+{
+    TokenBucket* connection_limit{nullptr};
+    TokenBucket* global_limit{nullptr};
+    // When the ring is full, reading goes on into this log, which is fed
+    // back into the ring, in order, as the writer drains it.
+    SpillLog* spill{nullptr};
+    // Between reading and writing. bytes_copied counts its output.
+    Transform* transform{nullptr};
+    bool checksum{false};
+    // Implies checksum. Not with a transform.
+    crc_trailer trailer{crc_trailer::none};
+    // Bytes read are recorded here, as they arrive
+    CaptureFile* capture{nullptr};
+    unsigned capture_direction{0};
+    unsigned trace_id{0};  // Connection number in trace events and captures
+    // Sets TCP_QUICKACK on the input again after every read
+    bool quickack{false};
+    // Latency mode, for the copy loops: where they would block in poll(),
+    // they first go on retrying for up to this many microseconds. copyfd2()
+    // takes it from the forward options.
+    unsigned spin_us{0};
 };
 
 // For read and write errors
@@ -31,16 +77,31 @@ struct IOPackageWriteException : public IOPackageException
 class IOPackageBase
 {
 public:
-    IOPackageBase(int rdfd, int wrfd, size_t store_size, unsigned char* store);
+    IOPackageBase(int rdfd, int wrfd, size_t store_size, unsigned char* store,
+        const iopackage_options& opts = iopackage_options());
     bool cycle(pollfd pfd[2]); // Read and write
     iopackage_stats report() const;
+    // After cycle(): -1, or the number of milliseconds before reading is
+    // allowed again by the rate limits. In the latter case the caller
+    // should poll() with this timeout even if pfd requests no events.
+    int wait_ms() const { return throttle_ms; }
 
 private:
+    size_t read_allowance();
+    void unspill();
+    bool convert(transform_flush flush);
+    bool finish_trailer(RingbufRbase<unsigned char>& wbufr);
+
     int readfd;
     int writefd;
+    iopackage_options options;
+    int throttle_ms{-1};
 
     RingbufRbase<unsigned char> bufr;
+    // Written from, for a transform that is not in place
+    std::unique_ptr<RingbufR<unsigned char>> tbufr;
     size_t bytes_copied {0};
+    size_t bytes_spilled {0};
     struct iovec readvec[2];
     struct iovec writevec[2];
     size_t read_nseg, write_nseg;
@@ -51,14 +112,18 @@ private:
     ssize_t bytes_read{0};
     ssize_t bytes_write{0};
     bool inquire_needed{true};
+    bool input_ended{false};
+    uint32_t crc{0};
+    bool trailer_done{false};
 };
 
 template<size_t STORE_SIZE>
 class IOPackage : public IOPackageBase
 {
 public:
-    IOPackage(int rdfd, int wrfd)
-        : IOPackageBase(rdfd, wrfd, STORE_SIZE, store) { }
+    IOPackage(int rdfd, int wrfd,
+            const iopackage_options& opts = iopackage_options())
+        : IOPackageBase(rdfd, wrfd, STORE_SIZE, store, opts) { }
 
 private:
     unsigned char store[STORE_SIZE];
@@ -0,0 +1,276 @@
+#include "logger.h"
+#include "recordring.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Tuning (compile time)
+constexpr size_t log_ring_size{64*1024};
+constexpr size_t log_max_message{1024};  // Longer messages are truncated
+constexpr int log_flush_ms{50};
+
+std::atomic<int> log_level_value{default_log_level};
+
+void set_log_level(int level)
+{
+    log_level_value.store(level, std::memory_order_relaxed);
+}
+
+namespace
+{
+
+// Precedes the text of each message in its record
+struct LogHeader
+{
+    int64_t nsec;         // CLOCK_REALTIME
+    uint32_t client_num;
+    uint8_t level;
+    uint8_t unused[3];
+};
+
+// A fixed buffer that drops whatever does not fit
+class LogStreambuf : public std::streambuf
+{
+public:
+    LogStreambuf() { reset(); }
+    void reset() { setp(text, text + sizeof(text)); }
+    size_t length() const { return pptr() - pbase(); }
+    const char* data() const { return text; }
+
+protected:
+    int_type overflow(int_type ch) override {
+        return traits_type::not_eof(ch); }
+
+private:
+    char text[log_max_message];
+};
+
+// The ring of one thread. Once the thread exits, the background thread
+// drains the ring and deletes it.
+struct LogRing
+{
+    LogRing() : records(log_ring_size) { }
+    std::mutex mtx;
+    RecordRing records;
+    uint64_t dropped{0};   // Guarded by mtx
+    bool retired{false};   // Guarded by mtx
+};
+
+class Logger
+{
+public:
+    Logger();
+    void add(LogRing* ring);
+    void flush();
+
+private:
+    struct Entry
+    {
+        LogHeader header;
+        size_t offset;     // Of the text, in the drained bytes
+        size_t length;
+    };
+    void run();
+    const char* time_text(time_t sec);
+
+    std::mutex registry_mtx;
+    std::vector<LogRing*> rings;
+    std::mutex flush_mtx;  // One flush at a time
+    time_t cached_sec{-1};
+    char cached_time[128];
+};
+
+// Never destroyed, so that detached threads may log while the process exits
+Logger& logger()
+{
+    static Logger* lg = new Logger;
+    return *lg;
+}
+
+// Per thread state for LogLine
+struct LogThread
+{
+    LogThread() : stream(&buf), ring(new LogRing) { logger().add(ring); }
+    ~LogThread()
+    {
+        std::lock_guard<std::mutex> lock(ring->mtx);
+        ring->retired = true;
+    }
+    LogStreambuf buf;
+    std::ostream stream;
+    LogRing* ring;
+};
+thread_local LogThread log_thread;
+
+} // anonymous namespace
+
+///////////////////////////
+// Logger class methods //
+///////////////////////////
+
+Logger::Logger()
+{
+    std::thread([this] () { run(); }).detach();
+    atexit(log_flush);
+}
+
+void Logger::add(LogRing* ring)
+{
+    std::lock_guard<std::mutex> lock(registry_mtx);
+    rings.push_back(ring);
+}
+
+void Logger::run()
+{
+    while (true)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(log_flush_ms));
+        flush();
+    }
+}
+
+const char* Logger::time_text(time_t sec)
+{
+    // localtime_r() and snprintf() once per second, at most
+    if (sec != cached_sec)
+    {
+        struct tm tm;
+        localtime_r(&sec, &tm);
+        snprintf(cached_time, sizeof(cached_time),
+            "%04d/%02d/%02d %02d:%02d:%02d",
+            tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday,
+            tm.tm_hour, tm.tm_min, tm.tm_sec);
+        cached_sec = sec;
+    }
+    return cached_time;
+}
+
+void Logger::flush()
+{
+    std::lock_guard<std::mutex> flush_lock(flush_mtx);
+    std::vector<LogRing*> current;
+    {
+        std::lock_guard<std::mutex> lock(registry_mtx);
+        current = rings;
+    }
+
+    // Copy out, holding each ring only briefly
+    std::string bytes;
+    std::vector<Entry> entries;
+    uint64_t dropped = 0;
+    std::vector<LogRing*> gone;
+    for (LogRing* ring : current)
+    {
+        std::lock_guard<std::mutex> lock(ring->mtx);
+        auto end = ring->records.end();
+        for (auto it = ring->records.begin() ; it != end ; ++it)
+        {
+            RecordRing::Record record = *it;
+            Entry entry;
+            memcpy(&entry.header, record.data, sizeof(LogHeader));
+            entry.offset = bytes.size();
+            entry.length = record.length - sizeof(LogHeader);
+            bytes.append((const char*)record.data + sizeof(LogHeader),
+                entry.length);
+            entries.push_back(entry);
+        }
+        ring->records.pop(end);
+        dropped += ring->dropped;
+        ring->dropped = 0;
+        if (ring->retired) gone.push_back(ring);
+    }
+    if (!gone.empty())
+    {
+        std::lock_guard<std::mutex> lock(registry_mtx);
+        for (LogRing* ring : gone)
+        {
+            std::erase(rings, ring);
+            delete ring;
+        }
+    }
+    if (entries.empty() && (dropped == 0)) return;
+
+    // Messages of different threads, in time order
+    std::stable_sort(entries.begin(), entries.end(),
+        [] (const Entry& a, const Entry& b) {
+            return a.header.nsec < b.header.nsec; });
+
+    std::string out;
+    for (const Entry& entry : entries)
+    {
+        out += time_text(entry.header.nsec / 1000000000);
+        if (entry.header.client_num)
+        {
+            out += " #";
+            out += std::to_string(entry.header.client_num);
+            out += ": ";
+        }
+        else
+        {
+            out += " ";
+        }
+        out.append(bytes, entry.offset, entry.length);
+        out += '\n';
+    }
+    if (dropped)
+    {
+        out += time_text(time(nullptr));
+        out += " ";
+        out += std::to_string(dropped);
+        out += " log messages dropped\n";
+    }
+    std::cerr.write(out.data(), out.size());
+    std::cerr.flush();
+}
+
+void log_flush()
+{
+    logger().flush();
+}
+
+////////////////////////////
+// LogLine class methods //
+////////////////////////////
+
+LogLine::LogLine(int level, unsigned client_num)
+    : stream(log_thread.stream), client(client_num), lvl(level)
+{
+    log_thread.buf.reset();
+}
+
+LogLine::~LogLine()
+{
+    LogHeader header;
+    memset(&header, 0, sizeof(header));
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header.nsec = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    header.client_num = client;
+    header.level = (uint8_t)lvl;
+    size_t length = sizeof(header) + log_thread.buf.length();
+
+    LogRing* ring = log_thread.ring;
+    std::lock_guard<std::mutex> lock(ring->mtx);
+    unsigned char* record = ring->records.reserve(length);
+    if (record == nullptr)
+    {
+        // Never wait for the background thread
+        ++ring->dropped;
+        return;
+    }
+    memcpy(record, &header, sizeof(header));
+    memcpy(record + sizeof(header), log_thread.buf.data(),
+        log_thread.buf.length());
+    ring->records.commit(length);
+}
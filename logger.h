@@ -0,0 +1,57 @@
+#ifndef __LOGGER_H_
+#define __LOGGER_H_
+
+// Asynchronous logging. A thread formats its message into a buffer of its
+// own and pushes it, behind a small binary header, into a ring of its own.
+// A background thread drains the rings, adds the time stamp and client
+// prefix, and writes to std::cerr. The logging thread never waits for
+// stderr: when its ring is full, the message is dropped and counted.
+//
+//     LOG(2, client_num) << "connected " << path;
+//
+// A message is logged if its level is no more than log_level(), which is
+// set at run time and defaults to VERBOSE.
+
+#include <atomic>
+#include <cstddef>
+#include <ostream>
+
+#ifdef VERBOSE
+constexpr int default_log_level{VERBOSE};
+#else
+constexpr int default_log_level{0};
+#endif
+
+extern std::atomic<int> log_level_value;
+inline int log_level()
+{
+    return log_level_value.load(std::memory_order_relaxed);
+}
+void set_log_level(int level);
+
+// One message. Pushed to the ring when destroyed.
+class LogLine
+{
+public:
+    LogLine(int level, unsigned client_num);
+    ~LogLine();
+    LogLine(const LogLine&) = delete;
+    LogLine& operator=(const LogLine&) = delete;
+
+    template<typename _T>
+    LogLine& operator<<(const _T& value) { stream << value; return *this; }
+
+private:
+    std::ostream& stream;
+    unsigned client;
+    int lvl;
+};
+
+#define LOG(level, client_num) \
+    if ((level) > log_level()) ; else LogLine((level), (client_num))
+
+// Writes out everything logged so far, from the calling thread. Also
+// called by exit().
+void log_flush();
+
+#endif // __LOGGER_H_
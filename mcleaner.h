@@ -67,6 +67,17 @@ struct SemaphoreReleaser : public CleanerBase< std::counting_semaphore<_d> >
     ~SemaphoreReleaser() { if (this->_obj) this->_obj->release(); }
 };
 
+// For anything else with release(), such as an AdmissionController
+template<typename _T>
+struct Releaser : public CleanerBase<_T>
+{
+    Releaser() { }
+    Releaser(_T& obj) : CleanerBase<_T>(obj) { }
+    Releaser(Releaser&&) = default;
+    Releaser& operator=(Releaser&&) = default;
+    ~Releaser() { if (this->_obj) this->_obj->release(); }
+};
+
 }; // namespace MCleaner
 
 #endif //  __MCLEANER_H_
@@ -1,6 +1,10 @@
 #include "netutils.h"
+#include "counters.h"
+#include "logger.h"
 #include "miscutils.h"
+#include "trace.h"
 
+#include <algorithm>
 #include <chrono>
 using namespace std::chrono_literals;
 #include <cstring>
@@ -11,20 +15,58 @@ using namespace std::chrono_literals;
 #include <strings.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
 
-int socket_from_address(
-    unsigned client_num, const std::string& hostname, int port_number,
-    int max_connecttime_ms)
+// Tuning (compile time)
+// A Unix domain listener with a full backlog makes a non-blocking
+// connect() fail with EAGAIN, and poll() does not say when to retry.
+constexpr int unix_connect_retry_ms{10};
+
+// Fills in sa. Returns the length to pass to bind() or connect().
+static socklen_t unix_address(const std::string& path, sockaddr_un& sa)
 {
-    // Create socket
-    int socketFD;
-    NEGCHECK("socket", (socketFD = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)));
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if (path.empty() || (path.size() >= sizeof(sa.sun_path)))
+    {
+        std::string str = "Unix domain socket path \"";
+        str += path;
+        str += "\" is empty or too long";
+        NetutilsException r(str);
+        throw(r);
+    }
+    // For the abstract namespace, '@' becomes the leading null byte.
+    memcpy(sa.sun_path, path.data(), path.size());
+    socklen_t len = offsetof(sockaddr_un, sun_path) + path.size();
+    if (path[0] == '@')
+    {
+        sa.sun_path[0] = '\0';
+    }
+    else
+    {
+        ++len;
+    }
+    return len;
+}
 
-    // Process host name
-    struct sockaddr_in serveraddr;
-    bzero((char *) &serveraddr, sizeof(serveraddr));
-    serveraddr.sin_family = AF_INET;
-    serveraddr.sin_port = htons(port_number);
+// For messages
+static std::string peer_name(const sockaddr_storage& addr)
+{
+    if (addr.ss_family == AF_INET)
+    {
+        return inet_ntoa(((const sockaddr_in&)addr).sin_addr);
+    }
+    return "local";
+}
+
+// Fills in sa for a host name and port
+static void resolve_address(
+    const std::string& hostname, int port_number, sockaddr_in& sa)
+{
+    bzero((char *) &sa, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port_number);
 
     struct hostent* server = gethostbyname(hostname.c_str());
     if (server == nullptr)
@@ -37,25 +79,122 @@ int socket_from_address(
         throw(r);
     }
     bcopy((char *)server->h_addr,
-    (char *)&serveraddr.sin_addr.s_addr, server->h_length);
+    (char *)&sa.sin_addr.s_addr, server->h_length);
+}
+
+// A TCP socket, ready for connect()
+static int tcp_socket(unsigned client_num, const SockOpts& opts)
+{
+    int socketFD;
+    NEGCHECK("socket", (socketFD = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)));
+    // Before connect(), so that buffer sizes affect the window scale.
+    set_client_sockopts(client_num, socketFD, opts);
+    if (opts.fastopen > 0)
+    {
+        // connect() returns at once if the kernel holds a Fast Open cookie
+        // for the server. The SYN then leaves with the first write, so the
+        // caller must be prepared for EINPROGRESS from write(2).
+        int optval = 1;
+        NEGCHECK("setsockopt",
+            setsockopt(socketFD, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &optval,
+            sizeof(optval)));
+    }
+    return socketFD;
+}
+
+int socket_from_address(
+    unsigned client_num, const std::string& hostname, int port_number,
+    int max_connecttime_ms, const SockOpts& opts, int abortfd)
+{
+    // Process host name
+    struct sockaddr_in serveraddr;
+    resolve_address(hostname, port_number, serveraddr);
+
+    // Create socket
+    int socketFD = tcp_socket(client_num, opts);
 
     // Connect to server
+    TRACE(connect_start, client_num, socketFD, port_number);
     if (connect(
         socketFD, (struct sockaddr*)(&serveraddr), sizeof(serveraddr),
-        max_connecttime_ms) < 0)
+        max_connecttime_ms, abortfd) < 0)
     {
+        TRACE(connect_finish, client_num, socketFD, errno);
+        counter_add(counter_connect_failures);
         close(socketFD);
         return -1;
     }
-#if (VERBOSE >= 2)
-    std::cerr << my_prefix(client_num) << "connected " <<
+    TRACE(connect_finish, client_num, socketFD, 0);
+    LOG(2, client_num) << "connected " <<
         inet_ntoa(serveraddr.sin_addr) << ":" <<
-        port_number << " using FD " << socketFD << std::endl;
-#endif
+        port_number << " using FD " << socketFD;
+
+    return socketFD;
+}
+
+int socket_from_unix_path(
+    unsigned client_num, const std::string& path, int max_connecttime_ms,
+    const SockOpts& opts, int abortfd)
+{
+    struct sockaddr_un serveraddr;
+    socklen_t addrlen = unix_address(path, serveraddr);
+
+    int socketFD;
+    NEGCHECK("socket", (socketFD = socket(PF_UNIX, SOCK_STREAM, 0)));
+    set_client_sockopts(client_num, socketFD, opts);
+    TRACE(connect_start, client_num, socketFD, -1);
+    if (connect(
+        socketFD, (struct sockaddr*)(&serveraddr), addrlen,
+        max_connecttime_ms, abortfd) < 0)
+    {
+        TRACE(connect_finish, client_num, socketFD, errno);
+        counter_add(counter_connect_failures);
+        close(socketFD);
+        return -1;
+    }
+    TRACE(connect_finish, client_num, socketFD, 0);
+    LOG(2, client_num) << "connected " << path <<
+        " using FD " << socketFD;
 
     return socketFD;
 }
 
+int socket_connect_start(
+    unsigned client_num, const std::string& hostname, int port_number,
+    const std::string& unix_path, const SockOpts& opts, bool& in_progress)
+{
+    int socketFD;
+    int retval;
+    if (unix_path.empty())
+    {
+        struct sockaddr_in serveraddr;
+        resolve_address(hostname, port_number, serveraddr);
+        socketFD = tcp_socket(client_num, opts);
+        set_flags(socketFD, O_NONBLOCK);
+        retval = connect(
+            socketFD, (struct sockaddr*)(&serveraddr), sizeof(serveraddr));
+    }
+    else
+    {
+        struct sockaddr_un serveraddr;
+        socklen_t addrlen = unix_address(unix_path, serveraddr);
+        NEGCHECK("socket", (socketFD = socket(PF_UNIX, SOCK_STREAM, 0)));
+        set_client_sockopts(client_num, socketFD, opts);
+        set_flags(socketFD, O_NONBLOCK);
+        retval = connect(socketFD, (struct sockaddr*)(&serveraddr), addrlen);
+    }
+    in_progress = ((retval < 0) && (errno == EINPROGRESS));
+    if ((retval < 0) && !in_progress)
+    {
+        counter_add(counter_connect_failures);
+        int ern = errno;
+        close(socketFD);
+        errno = ern;
+        return -1;
+    }
+    return socketFD;
+}
+
 void set_reuse(int socket)
 {
     int reuse = 1;
@@ -67,34 +206,136 @@ void set_reuse(int socket)
 #endif
 }
 
+// fatal: exit on failure. Otherwise log it for client_num, and go on.
+static void apply_sockopts(
+    int socket, const SockOpts& opts, bool fatal, unsigned client_num)
+{
+    // TCP options do not apply to Unix domain sockets
+    int domain;
+    socklen_t len = sizeof(domain);
+    NEGCHECK("getsockopt",
+        getsockopt(socket, SOL_SOCKET, SO_DOMAIN, &domain, &len));
+    auto setopt = [socket, domain, fatal, client_num] (
+        int level, int name, int value, const char* what) {
+        if (value == -1) return;
+        if ((level == IPPROTO_TCP) && (domain == AF_UNIX)) return;
+        if (setsockopt(socket, level, name, &value, sizeof(value)) == 0)
+        {
+            return;
+        }
+        std::string str = "setsockopt ";
+        str += what;
+        if (fatal) errorexit(str.c_str());
+        LOG(1, client_num) << str << " on FD " << socket << ": " <<
+            strerror(errno);
+    };
+    // With the option's name, for messages
+#define SETOPT(level, name, value) setopt(level, name, value, #name)
+    SETOPT(IPPROTO_TCP, TCP_NODELAY      , opts.nodelay);
+    SETOPT(IPPROTO_TCP, TCP_QUICKACK     , opts.quickack);
+    SETOPT(SOL_SOCKET , SO_RCVBUF        , opts.rcvbuf);
+    SETOPT(SOL_SOCKET , SO_SNDBUF        , opts.sndbuf);
+    SETOPT(SOL_SOCKET , SO_RCVLOWAT      , opts.rcvlowat);
+    SETOPT(IPPROTO_TCP, TCP_NOTSENT_LOWAT, opts.notsent_lowat);
+    SETOPT(IPPROTO_TCP, TCP_USER_TIMEOUT , opts.user_timeout);
+    SETOPT(SOL_SOCKET , SO_BUSY_POLL     , opts.busy_poll);
+#ifdef SO_PREFER_BUSY_POLL
+    SETOPT(SOL_SOCKET , SO_PREFER_BUSY_POLL, opts.prefer_busy_poll);
+#else
+    if (opts.prefer_busy_poll != -1)
+    {
+        errno = ENOPROTOOPT;
+        if (fatal) errorexit("setsockopt SO_PREFER_BUSY_POLL");
+        LOG(1, client_num) << "setsockopt SO_PREFER_BUSY_POLL: " <<
+            strerror(errno);
+    }
+#endif
+#undef SETOPT
+}
+
+void set_sockopts(int socket, const SockOpts& opts)
+{
+    apply_sockopts(socket, opts, true, 0);
+}
+
+void set_client_sockopts(
+    unsigned client_num, int socket, const SockOpts& opts)
+{
+    apply_sockopts(socket, opts, false, client_num);
+}
+
+// Retries connect() to a Unix domain socket while its backlog is full,
+// until maxwait_ms or abortfd, and then fails with ETIMEDOUT
+static int unix_connect_retry(
+    int sockfd, const struct sockaddr *addr, socklen_t addrlen, int maxwait_ms,
+    int abortfd)
+{
+    auto deadline = std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(maxwait_ms);
+    while (true)
+    {
+        int wait_ms = unix_connect_retry_ms;
+        if (maxwait_ms >= 0)
+        {
+            auto left = std::chrono::ceil<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+            if (left <= 0) break;
+            wait_ms = std::min(wait_ms, (int)left);
+        }
+        pollfd pfd{abortfd, POLLIN, 0};
+        NEGCHECK("poll", poll(&pfd, 1, wait_ms));
+        if (pfd.revents & POLLIN) break;
+        int retval = connect(sockfd, addr, addrlen);
+        if ((retval == 0) || (errno != EAGAIN)) return retval;
+    }
+    errno = ETIMEDOUT;
+    return -1;
+}
+
 int connect(
-    int sockfd, const struct sockaddr *addr, socklen_t addrlen, int maxwait_ms)
+    int sockfd, const struct sockaddr *addr, socklen_t addrlen, int maxwait_ms,
+    int abortfd)
 {
     set_flags(sockfd, O_NONBLOCK);
     int retval = connect(sockfd, addr, addrlen);
+    if ((retval < 0) && (errno == EAGAIN))
+    {
+        retval = unix_connect_retry(sockfd, addr, addrlen, maxwait_ms,
+            abortfd);
+    }
     if (retval < 0)
     {
         if (errno == EINPROGRESS)
         {
-            pollfd pfd;
-            pfd.fd = sockfd;
-            pfd.events = POLLOUT;
-            NEGCHECK("poll", (retval = poll(&pfd, 1, maxwait_ms)));
+            pollfd pfd[2];
+            pfd[0].fd = sockfd;
+            pfd[0].events = POLLOUT;
+            pfd[0].revents = 0;
+            pfd[1].fd = abortfd;
+            pfd[1].events = POLLIN;
+            pfd[1].revents = 0;
+            NEGCHECK("poll", (retval = poll(pfd, 2, maxwait_ms)));
+            if (pfd[1].revents & POLLIN)
+            {
+                // Treat as timeout
+                retval = 0;
+            }
             switch (retval)
             {
             case 0:
                 // Timeout
+                errno = ETIMEDOUT;
                 retval = -1;
                 break;
             case 1:
                 // Success, maybe.
-                if (pfd.revents & POLLOUT)
+                if (pfd[0].revents & POLLOUT)
                 {
                     retval = 0;
                 }
                 else
                 {
-                    std::cerr << "Unexpected revents = " << pfd.revents <<
+                    std::cerr << "Unexpected revents = " << pfd[0].revents <<
                         "from connect()/poll()" << std::endl;
                     exit(1);
                 }
@@ -115,7 +356,8 @@ int connect(
 ////////////////////////////
 
 Listener::Listener(const std::string& hostname, const std::vector<int>& ports,
-    int backlog)
+    int backlog, const SockOpts& opts)
+    : sockopts(opts)
 {
     num_ports = ports.size();
     listening_ports = new int[num_ports];
@@ -141,7 +383,6 @@ Listener::Listener(const std::string& hostname, const std::vector<int>& ports,
             throw(r);
         }
     }
-    int optval = 1;
     size_t index = 0;
     for (auto port_num : ports)
     {
@@ -153,31 +394,121 @@ Listener::Listener(const std::string& hostname, const std::vector<int>& ports,
         listening_ports[index] = port_num;
 
         set_reuse(socketFD);
-        set_flags(socketFD, O_NONBLOCK);
-        NEGCHECK("setsockopt",
-            setsockopt(socketFD, SOL_SOCKET, SO_KEEPALIVE, &optval,
-            sizeof(optval)));
+        if (sockopts.fastopen > 0)
+        {
+            NEGCHECK("setsockopt",
+                setsockopt(socketFD, IPPROTO_TCP, TCP_FASTOPEN,
+                &sockopts.fastopen, sizeof(sockopts.fastopen)));
+        }
         sa.sin_port = htons ((uint16_t)port_num);
         NEGCHECK("bind",
             bind(socketFD, (struct sockaddr *)(&sa), (socklen_t)sizeof (sa)));
-        NEGCHECK("listen",  listen(socketFD, backlog));
+        prepare(socketFD, backlog);
         ++index;
     }
 }
+Listener::Listener(const std::string& path, int backlog, const SockOpts& opts)
+    : sockopts(opts)
+{
+    struct sockaddr_un sa;
+    socklen_t addrlen = unix_address(path, sa);
+    num_ports = 1;
+    listening_ports = new int[1];
+    listening_ports[0] = 0;
+    pfds = new pollfd[1];
+    memset(pfds, 0, sizeof(pollfd));
+    int socketFD;
+    NEGCHECK("socket", socketFD = socket(PF_UNIX, SOCK_STREAM, 0));
+    pfds[0].fd = socketFD;
+    pfds[0].events = POLLIN;
+
+    // The counterpart of SO_REUSEADDR: remove a stale socket file.
+    if (path[0] != '@')
+    {
+        unix_path = path;
+        unlink(path.c_str());
+    }
+    NEGCHECK("bind", bind(socketFD, (struct sockaddr *)(&sa), addrlen));
+    prepare(socketFD, backlog);
+}
+Listener::Listener(const std::vector<int>& fds, const std::vector<int>& ports,
+    const SockOpts& opts) : sockopts(opts)
+{
+    if (fds.size() != ports.size())
+    {
+        NetutilsException r("handed-off sockets do not match the -listen spec");
+        throw(r);
+    }
+    num_ports = fds.size();
+    listening_ports = new int[num_ports];
+    pfds = new pollfd[num_ports];
+    memset(pfds, 0, num_ports * sizeof(pollfd));
+    for (size_t index = 0 ; index < num_ports ; ++index)
+    {
+        pfds[index].fd = fds[index];
+        pfds[index].events = POLLIN;
+        listening_ports[index] = ports[index];
+        struct sockaddr_storage addr;
+        socklen_t addrlen = sizeof(addr);
+        int listening = 0;
+        socklen_t len = sizeof(listening);
+        bool ok = (getsockname(fds[index], (struct sockaddr*)&addr,
+            &addrlen) == 0) && (getsockopt(fds[index], SOL_SOCKET,
+            SO_ACCEPTCONN, &listening, &len) == 0) && listening;
+        if (ok && (addr.ss_family == AF_INET))
+        {
+            ok = (ntohs(((struct sockaddr_in*)&addr)->sin_port) ==
+                ports[index]);
+        }
+        else if (ok)
+        {
+            ok = (addr.ss_family == AF_UNIX) && (ports[index] == 0);
+        }
+        if (!ok)
+        {
+            std::string str = "handed-off socket ";
+            str += std::to_string(index);
+            str += " does not match the -listen spec";
+            NetutilsException r(str);
+            throw(r);
+        }
+        set_flags(fds[index], O_NONBLOCK);
+    }
+}
+void Listener::prepare(int socketFD, int backlog)
+{
+    int optval = 1;
+    set_flags(socketFD, O_NONBLOCK);
+    NEGCHECK("setsockopt",
+        setsockopt(socketFD, SOL_SOCKET, SO_KEEPALIVE, &optval,
+        sizeof(optval)));
+    // Buffer sizes must be set before listen() to affect the window
+    // scale. Most other options are inherited by accepted sockets, but
+    // they are applied again in get_client().
+    set_sockopts(socketFD, sockopts);
+    NEGCHECK("listen",  listen(socketFD, backlog));
+}
 Listener::Listener(Listener&& other) :
     num_ports(other.num_ports), listening_ports(other.listening_ports),
-    pfds(other.pfds), accepted_queue(std::move(other.accepted_queue))
+    pfds(other.pfds), sockopts(other.sockopts),
+    unix_path(std::move(other.unix_path)),
+    accepted_queue(std::move(other.accepted_queue))
 {
+    other.num_ports = 0;
     other.listening_ports = nullptr;
     other.pfds = nullptr;
 }
 Listener& Listener::operator=(Listener&& other)
 {
     num_ports = other.num_ports;
+    other.num_ports = 0;
     listening_ports = other.listening_ports;
     other.listening_ports = nullptr;
     pfds = other.pfds;
     other.pfds = nullptr;
+    sockopts = other.sockopts;
+    unix_path = std::move(other.unix_path);
+    other.unix_path.clear();
     return *this;
 }
 
@@ -185,19 +516,56 @@ Listener::~Listener()
 {
     for (size_t index = 0 ; index < num_ports ; ++index)
     {
-        close(listening_ports[index]);
+        close(pfds[index].fd);
     }
+    if (!unix_path.empty()) unlink(unix_path.c_str());
     delete[] pfds;
     delete[] listening_ports;
 }
 
-Listener::SocketInfo Listener::get_client(unsigned client_num)
+bool Listener::accept_client(
+    size_t index, unsigned client_num, SocketInfo& info)
 {
+    info.port_num = listening_ports[index];
+    struct sockaddr_storage addr;
+    socklen_t addrlen = (socklen_t)sizeof(addr);
+    info.socketFD =
+        accept(pfds[index].fd, (struct sockaddr*)(&addr), &addrlen);
+    if (info.socketFD < 0)
+    {
+        // Another thread or process may have taken the client.
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK) ||
+            (errno == ECONNABORTED))
+        {
+            return false;
+        }
+        errorexit("accept");
+    }
+    set_client_sockopts(client_num, info.socketFD, sockopts);
+    TRACE(accept, client_num, info.socketFD, info.port_num);
+    if (log_level() >= 2)
+    {
+        LOG(2, client_num) << "accepted " << peer_name(addr) <<
+            "@" << info.port_num << " using FD " << info.socketFD;
+    }
+    else
+    {
+        LOG(1, client_num) << "accepted " << peer_name(addr) <<
+            "@" << info.port_num;
+    }
+    return true;
+}
+
+Listener::SocketInfo Listener::get_client(unsigned client_num, int abortfd)
+{
+    // The listening sockets, then abortfd, which poll() ignores if -1
+    std::vector<pollfd> pfd(pfds, pfds + num_ports);
+    pfd.push_back({abortfd, POLLIN, 0});
     while (accepted_queue.empty())
     {
         int poll_return;
         size_t index;
-        NEGCHECK("poll", (poll_return = poll(pfds, num_ports, -1)));
+        NEGCHECK("poll", (poll_return = poll(pfd.data(), pfd.size(), -1)));
         if (poll_return == 0)
         {
             // timeout
@@ -205,26 +573,16 @@ Listener::SocketInfo Listener::get_client(unsigned client_num)
                 std::endl;
             exit(1);
         }
+        if (pfd[num_ports].revents & POLLIN) return {0, -1};
         for (index = 0 ; index < num_ports ; ++index)
         {
-            if (pfds[index].revents & POLLIN)
+            if (pfd[index].revents & POLLIN)
             {
                 SocketInfo new_info;
-                new_info.port_num = listening_ports[index];
-                struct sockaddr_in addr;
-                socklen_t addrlen = (socklen_t)sizeof(addr);
-                NEGCHECK("accept", (new_info.socketFD = accept(
-                    pfds[index].fd, (struct sockaddr*)(&addr), &addrlen)));
-                accepted_queue.push_back(new_info);
-#if (VERBOSE >= 1)
-                    std::cerr << my_prefix(client_num) << "accepted " <<
-                        inet_ntoa(addr.sin_addr) <<
-                        "@" << new_info.port_num <<
-#if (VERBOSE >= 2)
-                        " using FD " << new_info.socketFD <<
-#endif
-                        std::endl;
-#endif
+                if (accept_client(index, client_num, new_info))
+                {
+                    accepted_queue.push_back(new_info);
+                }
             }
         }
     }
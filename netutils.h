@@ -14,18 +14,70 @@ struct NetutilsException
     std::string strng;
 };
 
+// Per-endpoint socket tuning. A value of -1 leaves the system default.
+struct SockOpts
+{
+    int nodelay{-1};        // TCP_NODELAY
+    // TCP_QUICKACK. Linux leaves quick ACK mode on its own, so the copy
+    // loops set it again after every read; coroutine relays do not.
+    int quickack{-1};
+    int rcvbuf{-1};         // SO_RCVBUF, bytes
+    int sndbuf{-1};         // SO_SNDBUF, bytes
+    int rcvlowat{-1};       // SO_RCVLOWAT, bytes
+    int notsent_lowat{-1};  // TCP_NOTSENT_LOWAT, bytes
+    int user_timeout{-1};   // TCP_USER_TIMEOUT, milliseconds
+    // SO_BUSY_POLL, microseconds: blocking reads poll the device queue
+    // instead of sleeping. Above net.core.busy_read, needs CAP_NET_ADMIN.
+    int busy_poll{-1};
+    int prefer_busy_poll{-1};  // SO_PREFER_BUSY_POLL, 0 or 1
+    // TCP Fast Open. When listening, the TCP_FASTOPEN queue length. When
+    // connecting, any positive value sets TCP_FASTOPEN_CONNECT, so that the
+    // first bytes written go out with the SYN. Not applied by
+    // set_sockopts().
+    int fastopen{-1};
+};
+
 // Sets SO_REUSEADDR and SO_REUSEPORT
 void set_reuse(int socket);
 
+// Applies every member of opts that is not -1. A failure exits: for a
+// listening socket, a bad option is a bad command line.
+void set_sockopts(int socket, const SockOpts& opts);
+// Same, for the socket of one client. A failure is logged, and the
+// connection goes on without that option, so that one client cannot stop
+// the server.
+void set_client_sockopts(
+    unsigned client_num, int socket, const SockOpts& opts);
+
 // Returns connected socket. Return value -1 indicates that
-// connect() was attempted, and failed.
+// connect() was attempted, and failed. See connect() below for abortfd.
 int socket_from_address(
     unsigned client_num, const std::string& hostname, int port_number,
-    int max_connect_time_ms = 300*1000);
+    int max_connect_time_ms = 300*1000, const SockOpts& opts = SockOpts(),
+    int abortfd = -1);
+
+// Same, for a Unix domain socket. A path starting with '@' names a socket
+// in the abstract namespace.
+int socket_from_unix_path(
+    unsigned client_num, const std::string& path,
+    int max_connect_time_ms = 300*1000, const SockOpts& opts = SockOpts(),
+    int abortfd = -1);
+
+// Starts a non-blocking connect() to a host and port, or to unix_path if
+// that is not empty. Returns the socket, or -1 with errno set if connect()
+// failed at once, as with EAGAIN from a Unix domain listener whose backlog
+// is full. If in_progress is set, the caller must wait for POLLOUT
+// and then check SO_ERROR.
+int socket_connect_start(
+    unsigned client_num, const std::string& hostname, int port_number,
+    const std::string& unix_path, const SockOpts& opts, bool& in_progress);
 
-// connect(2) wih selectable timeout
+// connect(2) wih selectable timeout. The attempt also fails, with errno
+// ETIMEDOUT, if abortfd becomes readable. A Unix domain listener with a
+// full backlog is retried until then.
 int connect(
-    int sockfd, const struct sockaddr *addr, socklen_t addrlen, int maxwait_ms);
+    int sockfd, const struct sockaddr *addr, socklen_t addrlen, int maxwait_ms,
+    int abortfd = -1);
 
 // listen(2) on a collection of ports
 class Listener
@@ -33,7 +85,16 @@ class Listener
 public:
     Listener(
         const std::string& hostname, const std::vector<int>& ports,
-        int backlog);
+        int backlog, const SockOpts& opts = SockOpts());
+    // Unix domain socket. A path starting with '@' names a socket in the
+    // abstract namespace. Clients are reported with port_num 0.
+    Listener(const std::string& unix_path, int backlog,
+        const SockOpts& opts = SockOpts());
+    // Sockets that already listen, as received in a handoff, one for each
+    // of ports. For a Unix domain socket, ports is {0}. Throws if a socket
+    // is not listening on its port.
+    Listener(const std::vector<int>& fds, const std::vector<int>& ports,
+        const SockOpts& opts = SockOpts());
     ~Listener();
     Listener(Listener&& other);
     Listener& operator=(Listener&& other);
@@ -42,14 +103,27 @@ public:
         int port_num;
         int socketFD;
     };
-    SocketInfo get_client(unsigned client_num);
+    // Returns socketFD -1 if abortfd, when given, becomes readable first.
+    SocketInfo get_client(unsigned client_num, int abortfd = -1);
+
+    // For callers with their own event loop: the listening sockets, and
+    // accept(2) on one of them. accept_client() returns false if no client
+    // was waiting.
+    size_t size() const { return num_ports; }
+    int fd(size_t index) const { return pfds[index].fd; }
+    bool accept_client(size_t index, unsigned client_num, SocketInfo& info);
+
     Listener() = delete;
     Listener(const Listener&) = delete;
     Listener& operator=(const Listener&) = delete;
 private:
+    void prepare(int socketFD, int backlog);
+
     size_t num_ports;
     int* listening_ports;
     pollfd* pfds;
+    SockOpts sockopts;
+    std::string unix_path;   // Only for a Unix domain socket
     std::list<SocketInfo> accepted_queue;
 };
 
@@ -0,0 +1,133 @@
+#include "pairing.h"
+#include "counters.h"
+#include "logger.h"
+#include "miscutils.h"
+
+#include <unistd.h>
+
+// Tuning (compile time)
+// For each listener. Beyond this, clients wait in the listen backlog.
+constexpr size_t max_unpaired{1024};
+
+Pairer::Pairer(const std::vector<Listener*>& listeners_, int timeout_ms_) :
+    listeners(listeners_), ready(listeners_.size()), timeout_ms(timeout_ms_)
+{
+}
+
+Pairer::~Pairer()
+{
+    for (auto& queue : ready)
+    {
+        for (const Waiting& waiting : queue) close(waiting.info.socketFD);
+    }
+}
+
+bool Pairer::paired() const
+{
+    for (const auto& queue : ready)
+    {
+        if (queue.empty()) return false;
+    }
+    return true;
+}
+
+int Pairer::next_expiry() const
+{
+    if (timeout_ms == 0) return -1;
+    int wait_ms = -1;
+    Clock::time_point now = Clock::now();
+    for (const auto& queue : ready)
+    {
+        if (queue.empty()) continue;
+        auto left = std::chrono::ceil<std::chrono::milliseconds>(
+            queue.front().since + std::chrono::milliseconds(timeout_ms) -
+            now).count();
+        int ms = (left < 0) ? 0 : (int)left;
+        if ((wait_ms == -1) || (ms < wait_ms)) wait_ms = ms;
+    }
+    return wait_ms;
+}
+
+void Pairer::expire()
+{
+    if (timeout_ms == 0) return;
+    Clock::time_point deadline =
+        Clock::now() - std::chrono::milliseconds(timeout_ms);
+    for (auto& queue : ready)
+    {
+        while (!queue.empty() && (queue.front().since <= deadline))
+        {
+            const Listener::SocketInfo& info = queue.front().info;
+            LOG(1, 0) << "no partner for the client @" << info.port_num <<
+                " in " << timeout_ms << " ms. Closing.";
+            close(info.socketFD);
+            counter_add(counter_pair_timeouts);
+            queue.pop_front();
+        }
+    }
+}
+
+bool Pairer::get_clients(unsigned client_num,
+    std::vector<Listener::SocketInfo>& info, int abortfd)
+{
+    // The listening sockets of every listener, then abortfd, which poll()
+    // ignores if -1
+    std::vector<pollfd> pfd;
+    std::vector<int> fds;
+    std::vector<size_t> owner;
+    std::vector<size_t> port;
+    for (size_t index = 0 ; index < listeners.size() ; ++index)
+    {
+        for (size_t num = 0 ; num < listeners[index]->size() ; ++num)
+        {
+            fds.push_back(listeners[index]->fd(num));
+            owner.push_back(index);
+            port.push_back(num);
+        }
+    }
+    pfd.resize(fds.size());
+    pfd.push_back({abortfd, POLLIN, 0});
+
+    while (true)
+    {
+        expire();
+        if (paired()) break;
+        for (size_t slot = 0 ; slot < fds.size() ; ++slot)
+        {
+            bool full = (ready[owner[slot]].size() >= max_unpaired);
+            pfd[slot] = {full ? -1 : fds[slot], POLLIN, 0};
+        }
+        NEGCHECK("poll", poll(pfd.data(), pfd.size(), next_expiry()));
+        if (pfd.back().revents & POLLIN)
+        {
+            // No more sessions: the waiting clients go now.
+            for (auto& queue : ready)
+            {
+                for (const Waiting& waiting : queue)
+                {
+                    close(waiting.info.socketFD);
+                }
+                queue.clear();
+            }
+            return false;
+        }
+        for (size_t slot = 0 ; slot < fds.size() ; ++slot)
+        {
+            if (!(pfd[slot].revents & POLLIN)) continue;
+            Waiting waiting;
+            if (listeners[owner[slot]]->accept_client(
+                port[slot], client_num, waiting.info))
+            {
+                waiting.since = Clock::now();
+                ready[owner[slot]].push_back(waiting);
+            }
+        }
+    }
+    info.resize(listeners.size());
+    for (size_t index = 0 ; index < listeners.size() ; ++index)
+    {
+        info[index] = ready[index].front().info;
+        ready[index].pop_front();
+    }
+    return true;
+}
@@ -0,0 +1,48 @@
+#ifndef __PAIRING_H_
+#define __PAIRING_H_
+
+// Pairing for more than one -listen spec, as in a reverse tunnel: every
+// session needs one client of each Listener. One thread polls all of them,
+// accepts whoever arrives, and queues each client until the others have
+// one too. A client that waits longer than the pairing timeout is closed.
+
+#include "netutils.h"
+
+#include <chrono>
+#include <deque>
+#include <vector>
+
+class Pairer
+{
+public:
+    // timeout_ms 0: clients wait for a partner without end
+    Pairer(const std::vector<Listener*>& listeners, int timeout_ms);
+    ~Pairer();
+
+    // Fills info with one client of each listener, in order, first come
+    // first paired. Returns false, with nothing filled, if abortfd, when
+    // given, becomes readable first.
+    bool get_clients(unsigned client_num,
+        std::vector<Listener::SocketInfo>& info, int abortfd = -1);
+
+    Pairer() = delete;
+    Pairer(const Pairer&) = delete;
+    Pairer& operator=(const Pairer&) = delete;
+private:
+    typedef std::chrono::steady_clock Clock;
+    struct Waiting
+    {
+        Listener::SocketInfo info;
+        Clock::time_point since;
+    };
+    bool paired() const;
+    // Milliseconds until the oldest client expires, for poll(). -1: never.
+    int next_expiry() const;
+    void expire();
+
+    std::vector<Listener*> listeners;
+    std::vector<std::deque<Waiting> > ready;  // For each listener
+    int timeout_ms;
+};
+
+#endif // __PAIRING_H_
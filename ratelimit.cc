@@ -0,0 +1,39 @@
+#include "ratelimit.h"
+
+#include <algorithm>
+#include <cmath>
+using namespace std::chrono;
+
+TokenBucket::TokenBucket(size_t rt, size_t bst)
+    : rate(std::max<double>(rt, 1)),
+      burst(std::max<double>(bst, 1)),
+      quantum(std::clamp<double>(rate / 100, 1, burst)),
+      tokens(burst),
+      last(steady_clock::now())
+{
+}
+
+size_t TokenBucket::available(int& wait_ms)
+{
+    const std::lock_guard<std::mutex> lock(mtx);
+    refill(steady_clock::now());
+    if (tokens >= quantum)
+    {
+        return (size_t)tokens;
+    }
+    wait_ms = (int)std::ceil(1000 * (quantum - tokens) / rate);
+    return 0;
+}
+
+void TokenBucket::consume(size_t bytes)
+{
+    const std::lock_guard<std::mutex> lock(mtx);
+    tokens -= bytes;
+}
+
+void TokenBucket::refill(steady_clock::time_point now)
+{
+    double elapsed = duration<double>(now - last).count();
+    last = now;
+    tokens = std::min(burst, tokens + elapsed * rate);
+}
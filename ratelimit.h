@@ -0,0 +1,39 @@
+#ifndef __RATELIMIT_H_
+#define __RATELIMIT_H_
+
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+
+// Token bucket. One token is one byte. Tokens accumulate at "rate" per
+// second, up to "burst". A bucket can be shared by several threads, for
+// instance as a budget for all clients of a server.
+class TokenBucket
+{
+public:
+    TokenBucket(size_t rate, size_t burst);
+    TokenBucket() = delete;
+    TokenBucket(const TokenBucket&) = delete;
+    TokenBucket& operator=(const TokenBucket&) = delete;
+
+    // Returns the number of bytes that may be transferred now. If the
+    // return value is 0, wait_ms is set to the time until that changes.
+    size_t available(int& wait_ms);
+
+    // Records bytes actually transferred. Concurrent users of a shared
+    // bucket may overdraw it slightly; the debt is repaid before any
+    // further bytes become available.
+    void consume(size_t bytes);
+
+private:
+    void refill(std::chrono::steady_clock::time_point now);
+
+    std::mutex mtx;
+    const double rate;     // Bytes per second
+    const double burst;    // Bytes
+    const double quantum;  // Smallest grant, to avoid tiny reads
+    double tokens;
+    std::chrono::steady_clock::time_point last;
+};
+
+#endif // __RATELIMIT_H_
@@ -0,0 +1,157 @@
+#include "recordring.h"
+
+#include <cassert>
+#include <cstring>
+#include <limits>
+
+RecordRing::RecordRing(size_t capacity) : bufr(capacity & ~(size_t)7)
+{
+    assert(bufr.capacity() >= 2 * sizeof(Header));
+}
+
+size_t RecordRing::max_length() const
+{
+    // Whatever the position, one of the two spans of an empty ring is at
+    // least half of it.
+    return (capacity() / 2 & ~(size_t)7) - sizeof(Header);
+}
+
+unsigned char* RecordRing::reserve(size_t length)
+{
+    reserved = nullptr;
+    if ((length > capacity() - sizeof(Header)) ||
+        (length > std::numeric_limits<uint32_t>::max()))
+    {
+        return nullptr;
+    }
+    size_t need = sizeof(Header) + padded(length);
+    size_t avail1, avail2;
+    unsigned char* start1;
+    unsigned char* start2;
+    bufr.pushInquire(avail1, start1, avail2, start2);
+    // When there is a second span, the first runs to the end of the store.
+    if (avail1 >= need)
+    {
+        reserved = start1;
+        skip = nullptr;
+        skip_length = 0;
+    }
+    else if (avail2 >= need)
+    {
+        reserved = start2;
+        skip = start1;
+        skip_length = avail1;
+    }
+    else
+    {
+        return nullptr;
+    }
+    reserved_length = length;
+    return reserved + sizeof(Header);
+}
+
+void RecordRing::commit(size_t length, uint32_t tag)
+{
+    assert(reserved && (length <= reserved_length) && (tag <= max_tag));
+    // Everything is a multiple of 8, so a skip always has room for its
+    // header.
+    if (skip_length)
+    {
+        Header header{(uint32_t)skip_length, skip_tag};
+        memcpy(skip, &header, sizeof(header));
+        bufr.push(skip_length);
+    }
+    Header header{(uint32_t)length, tag};
+    memcpy(reserved, &header, sizeof(header));
+    bufr.push(sizeof(Header) + padded(length));
+    reserved = nullptr;
+}
+
+RecordRing::const_iterator RecordRing::begin() const
+{
+    size_t avail1, avail2;
+    unsigned char* start1;
+    unsigned char* start2;
+    bufr.popInquire(avail1, start1, avail2, start2);
+    const_iterator it;
+    it.pos = start1;
+    it.left1 = avail1;
+    it.next = start2;
+    it.left2 = avail2;
+    it.offset = 0;
+    it.settle();
+    return it;
+}
+
+RecordRing::const_iterator RecordRing::end() const
+{
+    const_iterator it;
+    it.pos = nullptr;
+    it.left1 = 0;
+    it.next = nullptr;
+    it.left2 = 0;
+    it.offset = bufr.size();
+    return it;
+}
+
+void RecordRing::pop()
+{
+    const_iterator it = begin();
+    if (it == end()) return;
+    ++it;
+    bufr.pop(it.offset);
+}
+
+void RecordRing::pop(const const_iterator& it)
+{
+    bufr.pop(it.offset);
+}
+
+/////////////////////////////////////////////
+// RecordRing::const_iterator class methods //
+/////////////////////////////////////////////
+
+RecordRing::Record RecordRing::const_iterator::operator*() const
+{
+    Header header;
+    memcpy(&header, pos, sizeof(header));
+    return Record{pos + sizeof(Header), header.length, header.tag};
+}
+
+RecordRing::const_iterator& RecordRing::const_iterator::operator++()
+{
+    Header header;
+    memcpy(&header, pos, sizeof(header));
+    size_t step = sizeof(Header) + padded(header.length);
+    pos += step;
+    left1 -= step;
+    offset += step;
+    settle();
+    return *this;
+}
+
+// Moves on to the second span when the first is used up, and over a skip
+void RecordRing::const_iterator::settle()
+{
+    while (true)
+    {
+        if (left1 == 0)
+        {
+            if (left2 == 0) return;
+            pos = next;
+            left1 = left2;
+            next = nullptr;
+            left2 = 0;
+            continue;
+        }
+        Header header;
+        memcpy(&header, pos, sizeof(header));
+        if (header.tag != skip_tag) return;
+        // A skip runs to the end of the store, which ends the span.
+        assert(header.length == left1);
+        offset += left1;
+        left1 = 0;
+    }
+}
+
+#include "ringbufr.tcc"
@@ -0,0 +1,102 @@
+#ifndef __RECORDRING_H_
+#define __RECORDRING_H_
+
+// A ring of variable length records, on top of RingbufR<unsigned char>.
+// Each record is an 8 byte header (length and a tag) and its payload,
+// padded to a multiple of 8 bytes. A record never wraps: when it does not
+// fit before the end of the store, the rest of the store is marked to be
+// skipped and the record starts again at the front. So the producer gets
+// one contiguous span to fill, and the consumer sees whole records in
+// place.
+//
+//     unsigned char* p = ring.reserve(max_length);
+//     if (p) { ...fill up to max_length bytes...; ring.commit(length, tag); }
+//
+//     for (auto it = ring.begin() ; it != ring.end() ; ++it) use(*it);
+//     ring.pop(ring.end());
+//
+// Like RingbufRbase, not thread safe.
+
+#include "ringbufr.h"
+#include <cstddef>
+#include <cstdint>
+
+class RecordRing
+{
+public:
+    // capacity is in bytes, and rounded down to a multiple of 8
+    RecordRing(size_t capacity);
+    RecordRing(const RecordRing&) = delete;
+    RecordRing& operator=(const RecordRing&) = delete;
+
+    // Tag values from this one up are reserved
+    static constexpr uint32_t max_tag{0xFFFFFFFE};
+
+    // Producer side
+    // Contiguous space for a payload of up to length bytes, or nullptr if
+    // there is not room at the moment. A later reserve() cancels it.
+    unsigned char* reserve(size_t length);
+    // Publishes the reserved record, with length up to the amount reserved
+    void commit(size_t length, uint32_t tag = 0);
+    // The longest payload that always fits in an empty ring. Longer ones
+    // fit or not, depending on where the ring's content last ended.
+    size_t max_length() const;
+
+    // Consumer side
+    struct Record
+    {
+        const unsigned char* data;
+        size_t length;
+        uint32_t tag;
+    };
+    // Over the records present when begin() is called, oldest first
+    class const_iterator
+    {
+    public:
+        Record operator*() const;
+        const_iterator& operator++();
+        bool operator==(const const_iterator& other) const {
+            return offset == other.offset; }
+        bool operator!=(const const_iterator& other) const {
+            return offset != other.offset; }
+
+    private:
+        friend class RecordRing;
+        void settle();
+
+        const unsigned char* pos;   // Header of the current record
+        size_t left1;               // Bytes from pos to the end of its span
+        const unsigned char* next;  // The span after that, if any
+        size_t left2;
+        size_t offset;              // Bytes from the front of the ring
+    };
+    const_iterator begin() const;
+    const_iterator end() const;
+    // Removes the oldest record, or all records before it
+    void pop();
+    void pop(const const_iterator& it);
+
+    bool empty() const { return bufr.size() == 0; }
+    // Bytes in use, with headers and padding
+    size_t size() const { return bufr.size(); }
+    size_t capacity() const { return bufr.capacity(); }
+
+private:
+    struct Header
+    {
+        uint32_t length;
+        uint32_t tag;
+    };
+    static constexpr uint32_t skip_tag{0xFFFFFFFF};
+    static constexpr size_t padded(size_t length) {
+        return (length + 7) & ~(size_t)7; }
+
+    RingbufR<unsigned char> bufr;
+    // Of the pending reservation
+    unsigned char* reserved{nullptr};  // Header
+    size_t reserved_length{0};
+    unsigned char* skip{nullptr};      // Header of the end of the store
+    size_t skip_length{0};             // that is skipped before it
+};
+
+#endif // __RECORDRING_H_
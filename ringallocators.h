@@ -0,0 +1,77 @@
+#ifndef __RINGALLOCATORS_H_
+#define __RINGALLOCATORS_H_
+
+// Allocators for large RingbufR stores, for example
+//     RingbufR<unsigned char, HugePageAllocator<unsigned char>> ring(size);
+// Each maps whole pages with mmap(), so they suit a few big stores, not
+// many small ones. Failures throw std::bad_alloc.
+
+#include <cstddef>
+
+// 2 MiB pages: MAP_HUGETLB if the system has reserved huge pages, or else
+// transparent huge pages by madvise(MADV_HUGEPAGE).
+template<typename _T>
+class HugePageAllocator
+{
+public:
+    using value_type = _T;
+    HugePageAllocator() { }
+    template<typename _U>
+    HugePageAllocator(const HugePageAllocator<_U>&) { }
+
+    _T* allocate(size_t count);
+    void deallocate(_T* ptr, size_t count);
+};
+
+// Pages locked into RAM by mlock(), so that the store is never paged out.
+// Subject to RLIMIT_MEMLOCK.
+template<typename _T>
+class LockedAllocator
+{
+public:
+    using value_type = _T;
+    LockedAllocator() { }
+    template<typename _U>
+    LockedAllocator(const LockedAllocator<_U>&) { }
+
+    _T* allocate(size_t count);
+    void deallocate(_T* ptr, size_t count);
+};
+
+// Pages placed on one NUMA node by mbind(MPOL_PREFERRED). Node -1 means
+// the node of the CPU that constructs the allocator. Pages come from other
+// nodes only when the chosen node has none free.
+template<typename _T>
+class NumaAllocator
+{
+public:
+    using value_type = _T;
+    NumaAllocator(int node = -1);
+    template<typename _U>
+    NumaAllocator(const NumaAllocator<_U>& other) : _node(other.node()) { }
+
+    _T* allocate(size_t count);
+    void deallocate(_T* ptr, size_t count);
+    int node() const { return _node; }
+
+private:
+    int _node;
+};
+
+template<typename _T, typename _U>
+bool operator==(const HugePageAllocator<_T>&, const HugePageAllocator<_U>&)
+{
+    return true;
+}
+template<typename _T, typename _U>
+bool operator==(const LockedAllocator<_T>&, const LockedAllocator<_U>&)
+{
+    return true;
+}
+template<typename _T, typename _U>
+bool operator==(const NumaAllocator<_T>& a, const NumaAllocator<_U>& b)
+{
+    return a.node() == b.node();
+}
+
+#endif // __RINGALLOCATORS_H_
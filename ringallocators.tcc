@@ -0,0 +1,146 @@
+// Implementation of the RingbufR allocators
+#ifndef __RINGALLOCATORS_TCC
+#define __RINGALLOCATORS_TCC
+
+#include <cstdint>
+#include <new>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// Tuning (compile time)
+constexpr size_t huge_page_size{2*1024*1024};
+
+// From <numaif.h>, which needs libnuma to link
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+// Rounds bytes up to a multiple of granule
+static inline size_t ring_round_up(size_t bytes, size_t granule)
+{
+    return (bytes + granule - 1) / granule * granule;
+}
+
+static inline size_t ring_page_size()
+{
+    static const size_t page_size = sysconf(_SC_PAGESIZE);
+    return page_size;
+}
+
+// Anonymous private pages, or nullptr
+static inline void* ring_map(size_t bytes, int flags = 0)
+{
+    void* addr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    return (addr == MAP_FAILED) ? nullptr : addr;
+}
+
+////////////////////////////////////
+// HugePageAllocator class methods //
+////////////////////////////////////
+
+template<typename _T>
+_T* HugePageAllocator<_T>::allocate(size_t count)
+{
+    size_t bytes = ring_round_up(count * sizeof(_T), huge_page_size);
+#ifdef MAP_HUGE_2MB
+    void* addr = ring_map(bytes, MAP_HUGETLB | MAP_HUGE_2MB);
+#else
+    void* addr = ring_map(bytes, MAP_HUGETLB);
+#endif
+    if (addr == nullptr)
+    {
+        // No huge pages reserved. Ask for transparent ones, which cover
+        // only 2 MiB aligned ranges: map a huge page more than needed, and
+        // unmap the unaligned head and tail.
+        char* raw = (char*)ring_map(bytes + huge_page_size);
+        if (raw == nullptr) throw std::bad_alloc();
+        char* aligned =
+            (char*)ring_round_up((uintptr_t)raw, huge_page_size);
+        size_t head = aligned - raw;
+        if (head) munmap(raw, head);
+        if (huge_page_size - head)
+        {
+            munmap(aligned + bytes, huge_page_size - head);
+        }
+        addr = aligned;
+        madvise(addr, bytes, MADV_HUGEPAGE);
+    }
+    return (_T*)addr;
+}
+
+template<typename _T>
+void HugePageAllocator<_T>::deallocate(_T* ptr, size_t count)
+{
+    munmap(ptr, ring_round_up(count * sizeof(_T), huge_page_size));
+}
+
+//////////////////////////////////
+// LockedAllocator class methods //
+//////////////////////////////////
+
+template<typename _T>
+_T* LockedAllocator<_T>::allocate(size_t count)
+{
+    size_t bytes = ring_round_up(count * sizeof(_T), ring_page_size());
+    void* addr = ring_map(bytes);
+    if (addr == nullptr) throw std::bad_alloc();
+    if (mlock(addr, bytes) < 0)
+    {
+        munmap(addr, bytes);
+        throw std::bad_alloc();
+    }
+    return (_T*)addr;
+}
+
+template<typename _T>
+void LockedAllocator<_T>::deallocate(_T* ptr, size_t count)
+{
+    size_t bytes = ring_round_up(count * sizeof(_T), ring_page_size());
+    munlock(ptr, bytes);
+    munmap(ptr, bytes);
+}
+
+////////////////////////////////
+// NumaAllocator class methods //
+////////////////////////////////
+
+template<typename _T>
+NumaAllocator<_T>::NumaAllocator(int node) : _node(node)
+{
+    if (_node == -1)
+    {
+        unsigned cpu, current;
+        if (syscall(SYS_getcpu, &cpu, &current, nullptr) < 0) current = 0;
+        _node = current;
+    }
+}
+
+template<typename _T>
+_T* NumaAllocator<_T>::allocate(size_t count)
+{
+    size_t bytes = ring_round_up(count * sizeof(_T), ring_page_size());
+    void* addr = ring_map(bytes);
+    if (addr == nullptr) throw std::bad_alloc();
+    // Before any page is touched, so that each is placed on first touch.
+    // Failure (no NUMA support) leaves the default policy.
+    constexpr size_t bits = 8 * sizeof(unsigned long);
+    unsigned long nodemask[1024 / bits] = { };
+    if ((_node >= 0) && ((size_t)_node < 1024))
+    {
+        nodemask[_node / bits] = 1UL << (_node % bits);
+        syscall(SYS_mbind, addr, bytes, MPOL_PREFERRED, nodemask,
+            (unsigned long)1024, 0U);
+    }
+    return (_T*)addr;
+}
+
+template<typename _T>
+void NumaAllocator<_T>::deallocate(_T* ptr, size_t count)
+{
+    munmap(ptr, ring_round_up(count * sizeof(_T), ring_page_size()));
+}
+
+#endif // __RINGALLOCATORS_TCC
@@ -6,6 +6,8 @@
 #define __RINGBUFR_H_
 
 #include <cstddef>
+#include <memory>
+#include <optional>
 
 // Class RingbufRbase
 template<typename _T>
@@ -27,6 +29,7 @@ public:
         size_t& available1, _T*& start1, size_t& available2, _T*& start2) const;
     void pop(size_t oldContent);
     size_t size() const;
+    size_t capacity() const { return _capacity; }
 
     // For debugging
     const _T* ring_start() const;
@@ -58,14 +61,54 @@ private:
 };
 
 // Class RingbufR
-template<typename _T>
+// Owns its store, which comes from _Alloc. Any standard allocator will do,
+// including std::pmr::polymorphic_allocator<_T>. See also ringallocators.h.
+template<typename _T, typename _Alloc = std::allocator<_T>>
 class RingbufR : public RingbufRbase<_T>
 {
 public:
-    RingbufR (size_t capacity);
+    RingbufR (size_t capacity, const _Alloc& alloc = _Alloc());
     virtual ~RingbufR();
+    _Alloc get_allocator() const { return _alloc; }
     // For debugging
     static void validate(const _T* start, size_t count);
+
+private:
+    static _T* allocate(_Alloc alloc, size_t capacity);
+
+    _Alloc _alloc;
+};
+
+// Class RingbufRraw
+// Like RingbufR, but the store is raw memory: an element is constructed
+// when pushed and destroyed when popped, so _T needs neither a default
+// constructor nor assignment. After pushInquire(), construct each new
+// element in place (std::construct_at() will do) before push(). pop()
+// destroys the elements that it removes.
+template<typename _T, typename _Alloc = std::allocator<_T>>
+class RingbufRraw : public RingbufRbase<_T>
+{
+public:
+    RingbufRraw (size_t capacity, const _Alloc& alloc = _Alloc());
+    virtual ~RingbufRraw();
+    _Alloc get_allocator() const { return _alloc; }
+
+    // Constructs one element at the back. False if full.
+    template<typename... _Args>
+    bool emplace(_Args&&... args);
+    // Moves the front element into out, then pops it. False if empty.
+    bool take(_T& out);
+    // Same, moving into a new object. Empty if the ring is.
+    std::optional<_T> take();
+    // Destroys oldContent elements at the front, and removes them
+    void pop(size_t oldContent);
+    // For debugging
+    static void validate(const _T* start, size_t count);
+
+private:
+    static _T* allocate(_Alloc alloc, size_t capacity);
+
+    _Alloc _alloc;
 };
 
 #endif // __RINGBUFR_H_
@@ -4,22 +4,151 @@
 
 #include <cassert>
 #include <algorithm>
+#include <memory>
+#include <type_traits>
+#include <utility>
 #include <string.h>
 
-template<typename _T>
-RingbufR<_T>::RingbufR(size_t capacity)
-    : RingbufRbase<_T>(capacity, new _T[capacity])
+template<typename _T, typename _Alloc>
+RingbufR<_T, _Alloc>::RingbufR(size_t capacity, const _Alloc& alloc)
+    : RingbufRbase<_T>(capacity, allocate(alloc, capacity)), _alloc(alloc)
 {
 }
 
-template<typename _T>
-RingbufR<_T>::~RingbufR()
+// Like new _T[capacity]: elements of trivial types are left uninitialized,
+// so that no page of a large store is touched here.
+template<typename _T, typename _Alloc>
+_T* RingbufR<_T, _Alloc>::allocate(_Alloc alloc, size_t capacity)
 {
-    delete[] RingbufRbase<_T>::_ring_start;
+    using traits = std::allocator_traits<_Alloc>;
+    _T* store = traits::allocate(alloc, capacity);
+    if constexpr (!std::is_trivially_default_constructible_v<_T>)
+    {
+        size_t index = 0;
+        try
+        {
+            for ( ; index < capacity ; ++index)
+                traits::construct(alloc, store + index);
+        }
+        catch (...)
+        {
+            while (index > 0) traits::destroy(alloc, store + --index);
+            traits::deallocate(alloc, store, capacity);
+            throw;
+        }
+    }
+    return store;
 }
 
-template<typename _T>
-void RingbufR<_T>::validate(const _T* /*start*/, size_t /*count*/)
+template<typename _T, typename _Alloc>
+RingbufR<_T, _Alloc>::~RingbufR()
+{
+    using traits = std::allocator_traits<_Alloc>;
+    _T* store = RingbufRbase<_T>::_ring_start;
+    size_t capacity = RingbufRbase<_T>::capacity();
+    if constexpr (!std::is_trivially_destructible_v<_T>)
+    {
+        for (size_t index = 0 ; index < capacity ; ++index)
+            traits::destroy(_alloc, store + index);
+    }
+    traits::deallocate(_alloc, store, capacity);
+}
+
+template<typename _T, typename _Alloc>
+void RingbufR<_T, _Alloc>::validate(const _T* /*start*/, size_t /*count*/)
+{
+    // The user can override as desired.
+}
+
+template<typename _T, typename _Alloc>
+RingbufRraw<_T, _Alloc>::RingbufRraw(size_t capacity, const _Alloc& alloc)
+    : RingbufRbase<_T>(capacity, allocate(alloc, capacity)), _alloc(alloc)
+{
+}
+
+// Raw: nothing is constructed
+template<typename _T, typename _Alloc>
+_T* RingbufRraw<_T, _Alloc>::allocate(_Alloc alloc, size_t capacity)
+{
+    return std::allocator_traits<_Alloc>::allocate(alloc, capacity);
+}
+
+template<typename _T, typename _Alloc>
+RingbufRraw<_T, _Alloc>::~RingbufRraw()
+{
+    pop(RingbufRbase<_T>::size());
+    std::allocator_traits<_Alloc>::deallocate(
+        _alloc, RingbufRbase<_T>::_ring_start, RingbufRbase<_T>::capacity());
+}
+
+template<typename _T, typename _Alloc>
+template<typename... _Args>
+bool RingbufRraw<_T, _Alloc>::emplace(_Args&&... args)
+{
+    size_t available1, available2;
+    _T* start1;
+    _T* start2;
+    RingbufRbase<_T>::pushInquire(available1, start1, available2, start2);
+    if (available1 + available2 == 0) return false;
+    // At the end of the store, the room starts at the beginning.
+    std::allocator_traits<_Alloc>::construct(_alloc,
+        available1 ? start1 : start2, std::forward<_Args>(args)...);
+    RingbufRbase<_T>::push(1);
+    return true;
+}
+
+template<typename _T, typename _Alloc>
+bool RingbufRraw<_T, _Alloc>::take(_T& out)
+{
+    size_t available1, available2;
+    _T* start1;
+    _T* start2;
+    RingbufRbase<_T>::popInquire(available1, start1, available2, start2);
+    if (available1 + available2 == 0) return false;
+    // At the end of the store, the content starts at the beginning.
+    out = std::move(*(available1 ? start1 : start2));
+    pop(1);
+    return true;
+}
+
+template<typename _T, typename _Alloc>
+std::optional<_T> RingbufRraw<_T, _Alloc>::take()
+{
+    size_t available1, available2;
+    _T* start1;
+    _T* start2;
+    std::optional<_T> result;
+    RingbufRbase<_T>::popInquire(available1, start1, available2, start2);
+    if (available1 + available2)
+    {
+        result.emplace(std::move(*(available1 ? start1 : start2)));
+        pop(1);
+    }
+    return result;
+}
+
+template<typename _T, typename _Alloc>
+void RingbufRraw<_T, _Alloc>::pop(size_t oldContent)
+{
+    if constexpr (!std::is_trivially_destructible_v<_T>)
+    {
+        size_t available1, available2;
+        _T* start1;
+        _T* start2;
+        RingbufRbase<_T>::popInquire(available1, start1, available2, start2);
+        for (size_t index = 0 ; index < oldContent ; ++index)
+        {
+            _T* elem =
+                (index < available1) ? start1 + index :
+                                       start2 + (index - available1);
+            std::allocator_traits<_Alloc>::destroy(_alloc, elem);
+        }
+    }
+    RingbufRbase<_T>::pop(oldContent);
+}
+
+template<typename _T, typename _Alloc>
+void RingbufRraw<_T, _Alloc>::validate(const _T* /*start*/, size_t /*count*/)
 {
     // The user can override as desired.
 }
@@ -0,0 +1,88 @@
+// RingbufRshm class
+// A ring buffer in shared memory, for one producer process and one
+// consumer process. It has the pushInquire() / push() / popInquire() /
+// pop() interface of RingbufRbase, but the control block lives in the
+// mapping with the store, and holds running counts instead of pointers,
+// so that each process may map it at a different address. Pushing and
+// popping make no system call unless the other side sleeps in
+// wait_data() or wait_space(); those sleep on futexes in the mapping.
+
+#ifndef __RINGBUFRSHM_H_
+#define __RINGBUFRSHM_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// For system call failures and foreign mappings
+struct RingbufRshmException
+{
+    RingbufRshmException(const std::string& str) : strng(str) { }
+    std::string strng;
+};
+
+template<typename _T>
+class RingbufRshm
+{
+public:
+    // A new ring. An empty name makes an anonymous memfd, which the other
+    // process gets by fork() or over a Unix domain socket; see fd().
+    // Otherwise the ring is a POSIX shared memory object that is unlinked
+    // when the creator destroys its RingbufRshm.
+    static RingbufRshm create(size_t capacity, const std::string& name = "");
+    // An existing ring, by name or by file descriptor
+    static RingbufRshm attach(const std::string& name);
+    static RingbufRshm attach_fd(int fd);
+
+    RingbufRshm(RingbufRshm&& other);
+    ~RingbufRshm();
+    RingbufRshm() = delete;
+    RingbufRshm(const RingbufRshm&) = delete;
+    RingbufRshm& operator=(const RingbufRshm&) = delete;
+    RingbufRshm& operator=(RingbufRshm&&) = delete;
+
+    // Producer side
+    size_t pushInquire(
+        size_t& available1, _T*& start1, size_t& available2, _T*& start2) const;
+    void push(size_t newContent);
+    // Consumer side
+    size_t popInquire(
+        size_t& available1, _T*& start1, size_t& available2, _T*& start2) const;
+    void pop(size_t oldContent);
+
+    size_t size() const;
+    size_t capacity() const { return _capacity; }
+
+    // Block until there is content (consumer) or space (producer), the
+    // ring is closed, or timeout_ms passes (-1: forever). True if there is
+    // content or space.
+    bool wait_data(int timeout_ms = -1);
+    bool wait_space(int timeout_ms = -1);
+
+    // Ends the stream, from either side. Wakes both sides.
+    void close();
+    bool closed() const;
+
+    // Of the mapping, for passing to another process
+    int fd() const { return _fd; }
+
+private:
+    struct Control;
+    RingbufRshm(int fd, bool creator, const std::string& name, bool init,
+        size_t capacity);
+    bool wait(std::atomic<uint32_t>& seq, std::atomic<uint32_t>& waiting,
+        bool for_data, int timeout_ms);
+    void wake(std::atomic<uint32_t>& seq, std::atomic<uint32_t>& waiting);
+
+    int _fd;
+    bool _creator;
+    std::string _name;
+    void* _map;
+    size_t _map_size;
+    Control* _ctl;
+    _T* _store;
+    size_t _capacity;
+};
+
+#endif // __RINGBUFRSHM_H_
@@ -0,0 +1,324 @@
+// Implementation of RingbufRshm
+#ifndef __RINGBUFRSHM_TCC
+#define __RINGBUFRSHM_TCC
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+// Identifies a mapping made by RingbufRshm
+constexpr uint64_t ringbufrshm_magic{0x5247425546524d31};  // "RGBUFRM1"
+
+// Shared by both processes, at the start of the mapping. Each side writes
+// its own cache line.
+template<typename _T>
+struct RingbufRshm<_T>::Control
+{
+    uint64_t magic;              // Set last, by the creator
+    uint64_t elem_size;
+    uint64_t capacity;
+    // Producer
+    alignas(64) std::atomic<uint64_t> pushed;  // Elements ever pushed
+    std::atomic<uint32_t> producer_waiting;
+    std::atomic<uint32_t> space_seq;           // Futex for wait_space()
+    // Consumer
+    alignas(64) std::atomic<uint64_t> popped;  // Elements ever popped
+    std::atomic<uint32_t> consumer_waiting;
+    std::atomic<uint32_t> data_seq;            // Futex for wait_data()
+    // Either
+    alignas(64) std::atomic<uint32_t> is_closed;
+};
+
+static inline void ringbufrshm_error(const std::string& what)
+{
+    throw RingbufRshmException(what + " : " + strerror(errno));
+}
+
+template<typename _T>
+RingbufRshm<_T> RingbufRshm<_T>::create(
+    size_t capacity, const std::string& name)
+{
+    int fd;
+    if (name.empty())
+    {
+        fd = memfd_create("ringbufrshm", MFD_CLOEXEC);
+        if (fd < 0) ringbufrshm_error("memfd_create");
+    }
+    else
+    {
+        fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0) ringbufrshm_error("shm_open(" + name + ")");
+    }
+    return RingbufRshm(fd, true, name, true, capacity);
+}
+
+template<typename _T>
+RingbufRshm<_T> RingbufRshm<_T>::attach(const std::string& name)
+{
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) ringbufrshm_error("shm_open(" + name + ")");
+    return RingbufRshm(fd, false, name, false, 0);
+}
+
+template<typename _T>
+RingbufRshm<_T> RingbufRshm<_T>::attach_fd(int fd)
+{
+    int dupfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (dupfd < 0) ringbufrshm_error("fcntl");
+    return RingbufRshm(dupfd, false, "", false, 0);
+}
+
+template<typename _T>
+RingbufRshm<_T>::RingbufRshm(
+    int fd, bool creator, const std::string& name, bool init, size_t capacity)
+    : _fd(fd), _creator(creator), _name(name), _map(nullptr), _map_size(0),
+      _ctl(nullptr), _store(nullptr), _capacity(capacity)
+{
+    static_assert(std::is_trivially_copyable_v<_T>,
+        "Elements are shared between processes as raw bytes");
+    static_assert(std::atomic<uint64_t>::is_always_lock_free,
+        "Atomics in shared memory must be lock free");
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t ctl_size = (sizeof(Control) + page - 1) / page * page;
+    if (init)
+    {
+        _map_size = ctl_size + capacity * sizeof(_T);
+        if (ftruncate(_fd, _map_size) < 0)
+        {
+            int ern = errno;
+            ::close(_fd);
+            if (!_name.empty()) shm_unlink(_name.c_str());
+            errno = ern;
+            ringbufrshm_error("ftruncate");
+        }
+    }
+    else
+    {
+        struct stat st;
+        if (fstat(_fd, &st) < 0)
+        {
+            ::close(_fd);
+            ringbufrshm_error("fstat");
+        }
+        _map_size = st.st_size;
+    }
+    _map = mmap(
+        nullptr, _map_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (_map == MAP_FAILED)
+    {
+        _map = nullptr;
+        int ern = errno;
+        ::close(_fd);
+        if (init && !_name.empty()) shm_unlink(_name.c_str());
+        errno = ern;
+        ringbufrshm_error("mmap");
+    }
+    _ctl = (Control*)_map;
+    _store = (_T*)((char*)_map + ctl_size);
+    if (init)
+    {
+        // ftruncate() zeroed everything.
+        new (_ctl) Control;
+        _ctl->elem_size = sizeof(_T);
+        _ctl->capacity = capacity;
+        std::atomic_thread_fence(std::memory_order_release);
+        _ctl->magic = ringbufrshm_magic;
+    }
+    else
+    {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if ((_map_size < ctl_size) || (_ctl->magic != ringbufrshm_magic) ||
+            (_ctl->elem_size != sizeof(_T)) ||
+            (ctl_size + _ctl->capacity * sizeof(_T) > _map_size))
+        {
+            munmap(_map, _map_size);
+            ::close(_fd);
+            throw RingbufRshmException("Not a RingbufRshm of this type");
+        }
+        _capacity = _ctl->capacity;
+    }
+}
+
+template<typename _T>
+RingbufRshm<_T>::RingbufRshm(RingbufRshm&& other)
+    : _fd(other._fd), _creator(other._creator), _name(std::move(other._name)),
+      _map(other._map), _map_size(other._map_size), _ctl(other._ctl),
+      _store(other._store), _capacity(other._capacity)
+{
+    other._fd = -1;
+    other._creator = false;
+    other._map = nullptr;
+}
+
+template<typename _T>
+RingbufRshm<_T>::~RingbufRshm()
+{
+    if (_map) munmap(_map, _map_size);
+    if (_fd >= 0) ::close(_fd);
+    if (_creator && !_name.empty()) shm_unlink(_name.c_str());
+}
+
+template<typename _T>
+size_t RingbufRshm<_T>::pushInquire(
+    size_t& available1, _T*& start1, size_t& available2, _T*& start2) const
+{
+    uint64_t pushed = _ctl->pushed.load(std::memory_order_relaxed);
+    uint64_t popped = _ctl->popped.load(std::memory_order_acquire);
+    size_t free = _capacity - (size_t)(pushed - popped);
+    size_t offset = pushed % _capacity;
+    available1 = std::min(free, _capacity - offset);
+    available2 = free - available1;
+    start1 = available1 ? _store + offset : nullptr;
+    start2 = available2 ? _store : nullptr;
+    return (available1 ? 1 : 0) + (available2 ? 1 : 0);
+}
+
+template<typename _T>
+void RingbufRshm<_T>::push(size_t newContent)
+{
+    uint64_t pushed = _ctl->pushed.load(std::memory_order_relaxed);
+    // seq_cst, so that a consumer that is about to sleep sees either the
+    // new count or its own flag read back by us.
+    _ctl->pushed.store(pushed + newContent, std::memory_order_seq_cst);
+    if (_ctl->consumer_waiting.load(std::memory_order_seq_cst))
+    {
+        wake(_ctl->data_seq, _ctl->consumer_waiting);
+    }
+}
+
+template<typename _T>
+size_t RingbufRshm<_T>::popInquire(
+    size_t& available1, _T*& start1, size_t& available2, _T*& start2) const
+{
+    uint64_t popped = _ctl->popped.load(std::memory_order_relaxed);
+    uint64_t pushed = _ctl->pushed.load(std::memory_order_acquire);
+    size_t content = (size_t)(pushed - popped);
+    size_t offset = popped % _capacity;
+    available1 = std::min(content, _capacity - offset);
+    available2 = content - available1;
+    start1 = available1 ? _store + offset : nullptr;
+    start2 = available2 ? _store : nullptr;
+    return (available1 ? 1 : 0) + (available2 ? 1 : 0);
+}
+
+template<typename _T>
+void RingbufRshm<_T>::pop(size_t oldContent)
+{
+    uint64_t popped = _ctl->popped.load(std::memory_order_relaxed);
+    _ctl->popped.store(popped + oldContent, std::memory_order_seq_cst);
+    if (_ctl->producer_waiting.load(std::memory_order_seq_cst))
+    {
+        wake(_ctl->space_seq, _ctl->producer_waiting);
+    }
+}
+
+template<typename _T>
+size_t RingbufRshm<_T>::size() const
+{
+    return (size_t)(_ctl->pushed.load(std::memory_order_seq_cst) -
+        _ctl->popped.load(std::memory_order_seq_cst));
+}
+
+template<typename _T>
+bool RingbufRshm<_T>::wait_data(int timeout_ms)
+{
+    return wait(_ctl->data_seq, _ctl->consumer_waiting, true, timeout_ms);
+}
+
+template<typename _T>
+bool RingbufRshm<_T>::wait_space(int timeout_ms)
+{
+    return wait(_ctl->space_seq, _ctl->producer_waiting, false, timeout_ms);
+}
+
+template<typename _T>
+bool RingbufRshm<_T>::wait(std::atomic<uint32_t>& seq,
+    std::atomic<uint32_t>& waiting, bool for_data, int timeout_ms)
+{
+    auto ready = [this, for_data] () {
+        return for_data ? (size() > 0) : (size() < _capacity); };
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    if (timeout_ms > 0)
+    {
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+    while (true)
+    {
+        if (ready()) return true;
+        if (closed() || (timeout_ms == 0)) return false;
+        uint32_t snapshot = seq.load(std::memory_order_acquire);
+        waiting.store(1, std::memory_order_seq_cst);
+        // The other side may have moved before it could see the flag.
+        if (ready() || closed())
+        {
+            waiting.store(0, std::memory_order_relaxed);
+            continue;
+        }
+        struct timespec remaining;
+        struct timespec* timeout = nullptr;
+        if (timeout_ms > 0)
+        {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long long ns =
+                (long long)(deadline.tv_sec - now.tv_sec) * 1000000000 +
+                (deadline.tv_nsec - now.tv_nsec);
+            if (ns <= 0)
+            {
+                waiting.store(0, std::memory_order_relaxed);
+                return ready();
+            }
+            remaining.tv_sec = ns / 1000000000;
+            remaining.tv_nsec = ns % 1000000000;
+            timeout = &remaining;
+        }
+        // Not FUTEX_PRIVATE_FLAG: the waker is another process.
+        syscall(SYS_futex, &seq, FUTEX_WAIT, snapshot, timeout, nullptr, 0);
+    }
+}
+
+template<typename _T>
+void RingbufRshm<_T>::wake(
+    std::atomic<uint32_t>& seq, std::atomic<uint32_t>& waiting)
+{
+    if (waiting.exchange(0, std::memory_order_seq_cst) == 0) return;
+    seq.fetch_add(1, std::memory_order_release);
+    syscall(SYS_futex, &seq, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+template<typename _T>
+void RingbufRshm<_T>::close()
+{
+    _ctl->is_closed.store(1, std::memory_order_seq_cst);
+    for (std::atomic<uint32_t>* seq : {&_ctl->data_seq, &_ctl->space_seq})
+    {
+        seq->fetch_add(1, std::memory_order_release);
+        syscall(SYS_futex, seq, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+}
+
+template<typename _T>
+bool RingbufRshm<_T>::closed() const
+{
+    return _ctl->is_closed.load(std::memory_order_seq_cst) != 0;
+}
+
+#endif // __RINGBUFRSHM_TCC
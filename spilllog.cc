@@ -0,0 +1,131 @@
+#include "spilllog.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+//////////////////////////////
+// SpillBudget class methods //
+//////////////////////////////
+
+bool SpillBudget::take(size_t bytes)
+{
+    size_t avail = remaining.load(std::memory_order_relaxed);
+    do
+    {
+        if (avail < bytes) return false;
+    } while (!remaining.compare_exchange_weak(
+        avail, avail - bytes, std::memory_order_relaxed));
+    return true;
+}
+
+void SpillBudget::give(size_t bytes)
+{
+    remaining.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+///////////////////////////
+// SpillLog class methods //
+///////////////////////////
+
+SpillLog::SpillLog(
+        const std::string& dir, SpillBudget& bdgt, size_t seg_size)
+    : directory(dir), budget(bdgt), segment_size(seg_size) { }
+
+SpillLog::~SpillLog()
+{
+    while (!segments.empty()) drop_segment();
+}
+
+// An unlinked file in directory with its blocks allocated, so that a full
+// disk shows up here and not as SIGBUS on a store into the mapping.
+bool SpillLog::add_segment()
+{
+    if (!budget.take(segment_size)) return false;
+    int fd = open(directory.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if ((fd < 0) && ((errno == EOPNOTSUPP) || (errno == EISDIR)))
+    {
+        // No O_TMPFILE on this file system
+        std::string path = directory + "/spill.XXXXXX";
+        fd = mkostemp(&path[0], O_CLOEXEC);
+        if (fd >= 0) unlink(path.c_str());
+    }
+    void* map = MAP_FAILED;
+    int ern = 0;
+    if ((fd >= 0) && ((ern = posix_fallocate(fd, 0, segment_size)) == 0))
+    {
+        map = mmap(nullptr, segment_size,
+            PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) ern = errno;
+    }
+    else if (fd < 0)
+    {
+        ern = errno;
+    }
+    if (map == MAP_FAILED)
+    {
+        if (fd >= 0) close(fd);
+        budget.give(segment_size);
+        if (!failed)
+        {
+            failed = true;
+            LOG(1, 0) << "Spill to " << directory << " failed : "
+                << strerror(ern);
+        }
+        return false;
+    }
+    madvise(map, segment_size, MADV_SEQUENTIAL);
+    segments.push_back(Segment{fd, (unsigned char*)map, 0, 0});
+    return true;
+}
+
+void SpillLog::drop_segment()
+{
+    Segment& seg = segments.front();
+    munmap(seg.map, segment_size);
+    close(seg.fd);
+    segments.pop_front();
+    budget.give(segment_size);
+}
+
+size_t SpillLog::reserve(unsigned char*& start)
+{
+    if (segments.empty() || (segments.back().write_offset == segment_size))
+    {
+        if (!add_segment()) return 0;
+    }
+    Segment& seg = segments.back();
+    start = seg.map + seg.write_offset;
+    return segment_size - seg.write_offset;
+}
+
+void SpillLog::commit(size_t newContent)
+{
+    segments.back().write_offset += newContent;
+    stored += newContent;
+}
+
+size_t SpillLog::peek(const unsigned char*& start) const
+{
+    if (stored == 0) return 0;
+    const Segment& seg = segments.front();
+    start = seg.map + seg.read_offset;
+    return seg.write_offset - seg.read_offset;
+}
+
+void SpillLog::consume(size_t oldContent)
+{
+    Segment& seg = segments.front();
+    seg.read_offset += oldContent;
+    stored -= oldContent;
+    if (seg.read_offset < seg.write_offset) return;
+    // Read out, or caught up. Either way, it gives its disk space back, so
+    // that an idle connection holds none of a shared budget.
+    drop_segment();
+}
@@ -0,0 +1,74 @@
+#ifndef __SPILLLOG_H_
+#define __SPILLLOG_H_
+
+// Overflow storage for a copy engine whose writer has stalled. Bytes are
+// appended to memory mapped segment files, which are unlinked from the
+// start and freed as soon as they are read back, and read back in order.
+// An empty log holds no segment.
+// Disk use is bounded by a SpillBudget, which may be shared by many logs.
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <string>
+
+// Disk space, in bytes, that spill logs may use between them
+class SpillBudget
+{
+public:
+    SpillBudget(size_t bytes) : remaining(bytes) { }
+    SpillBudget(const SpillBudget&) = delete;
+    SpillBudget& operator=(const SpillBudget&) = delete;
+
+    // False, and nothing taken, if fewer than bytes remain
+    bool take(size_t bytes);
+    void give(size_t bytes);
+
+private:
+    std::atomic<size_t> remaining;
+};
+
+// Not thread safe. One producer and one consumer, on the same thread.
+class SpillLog
+{
+public:
+    // Segment files are created in directory dir. Each takes segment_size
+    // bytes from budget while it exists.
+    SpillLog(const std::string& dir, SpillBudget& budget,
+        size_t segment_size = default_segment_size);
+    ~SpillLog();
+    SpillLog(const SpillLog&) = delete;
+    SpillLog& operator=(const SpillLog&) = delete;
+
+    static constexpr size_t default_segment_size{16*1024*1024};
+
+    // Contiguous space for appending, or 0 if the budget is spent
+    size_t reserve(unsigned char*& start);
+    void commit(size_t newContent);
+    // The oldest contiguous content
+    size_t peek(const unsigned char*& start) const;
+    void consume(size_t oldContent);
+
+    size_t size() const { return stored; }
+    bool empty() const { return stored == 0; }
+
+private:
+    struct Segment
+    {
+        int fd;
+        unsigned char* map;
+        size_t write_offset;
+        size_t read_offset;
+    };
+    bool add_segment();
+    void drop_segment();
+
+    std::string directory;
+    SpillBudget& budget;
+    const size_t segment_size;
+    std::deque<Segment> segments;
+    size_t stored{0};
+    bool failed{false};   // Reported once
+};
+
+#endif // __SPILLLOG_H_
@@ -1,14 +1,26 @@
 #include "commonutils.h"
 #include "copyfd.h"
+#include "fanin.h"
+#include "counters.h"
+#include "crc32c.h"
+#include "logger.h"
 #include "mcleaner.h"
 using namespace MCleaner;
 #include "miscutils.h"
 #include "netutils.h"
+#include "pairing.h"
+#include "spilllog.h"
+#include "tee.h"
+#include "trace.h"
+#include "transform.h"
 
+#include <algorithm>
 #include <cstring>
+#include <deque>
 #include <fcntl.h>
 #include <iostream>
-#include <thread>
+#include <memory>
+#include <vector>
 #include <netdb.h>
 #include <signal.h>
 #include <unistd.h>
@@ -20,13 +32,46 @@ using namespace MCleaner;
 #define BUFFER_SIZE (4*1024)
 #endif
 constexpr int listen_backlog{10};
+constexpr int default_spill_budget_mb{1024};
+constexpr size_t tee_ring_size{4*1024*1024};
+constexpr size_t fanin_ring_size{64*1024};  // For each input
+
+// With more than one output
+static tee_policy lag_policy{tee_policy::block};
+// Merge all clients of the input spec, splitting records at this byte
+static bool fan_in{false};
+static int fan_in_delimiter{fanin_no_delimiter};
+
+// Overflow for a slow writer. Empty: no spilling.
+static std::string spill_dir;
+static size_t spill_budget{(size_t)default_spill_budget_mb * 1024 * 1024};
+
+// Between input and output. Empty: none.
+static std::string transform_name;
+
+// CRC32C of the copy, and what to do with a trailer
+static bool checksum{false};
+static crc_trailer trailer{crc_trailer::none};
+
+// Latency mode: spin this long before blocking in poll(). 0: do not spin.
+static unsigned spin_us{0};
+
+// With more than one listen spec. 0: wait for partners without end.
+static int pair_timeout_ms{0};
+
+// The input spec asks for TCP_QUICKACK, which the copy sets after reads
+static bool input_quickack{false};
 
 void usage_error();  // Note: will be exported for use in commonutils.
 
-static void responder(
-    const ServerInfo server_info[2], Listener::SocketInfo final_info[2]);
-static void handle_clients(const int sck[2]);
+static void responder(const std::vector<ServerInfo>& server_info,
+    std::vector<Listener::SocketInfo>& final_info);
+void handle_clients(const std::vector<int>& sck);
 static void copy(int firstFD, int secondFD);
+static void tee(int firstFD, const std::vector<int>& otherFDs);
+// A socket, or -1 with errno set
+static int connect_spec(const ServerInfo& si, int port_num);
+static void merge(Listener& listener, int outFD);
 
 int main (int argc, char* argv[])
 {
@@ -34,28 +79,122 @@ int main (int argc, char* argv[])
     int argc_copy = argc - 1;
     char** argv_copy = argv;
     ++argv_copy;
-    Uri uri[2];
-    uri[0]  = process_args(argc_copy, argv_copy);
-    uri[1] = process_args(argc_copy, argv_copy);
-    if (argc_copy != 0) usage_error();
+    std::string trace_path;
+    while (argc_copy >= 2)
+    {
+        if (strcmp(argv_copy[0], "-verbose") == 0)
+        {
+            set_log_level(mstoi(argv_copy[1]));
+        }
+        else if (strcmp(argv_copy[0], "-trace") == 0)
+        {
+            trace_path = argv_copy[1];
+        }
+        else if (strcmp(argv_copy[0], "-spill") == 0)
+        {
+            spill_dir = argv_copy[1];
+        }
+        else if (strcmp(argv_copy[0], "-spill_budget") == 0)
+        {
+            spill_budget = (size_t)mstoi(argv_copy[1]) * 1024 * 1024;
+        }
+        else if (strcmp(argv_copy[0], "-fan_in") == 0)
+        {
+            fan_in = true;
+            if (strcmp(argv_copy[1], "none") != 0)
+            {
+                fan_in_delimiter = mstoi(argv_copy[1], true);
+                if (fan_in_delimiter > 255) usage_error();
+            }
+        }
+        else if (strcmp(argv_copy[0], "-transform") == 0)
+        {
+            transform_name = argv_copy[1];
+            if (!make_transform(transform_name))
+            {
+                std::cerr << "Sorry, unknown transform \"" <<
+                    transform_name << "\"." << std::endl;
+                exit(1);
+            }
+        }
+        else if (strcmp(argv_copy[0], "-crc32c") == 0)
+        {
+            checksum = true;
+            if (strcmp(argv_copy[1], "report") == 0)
+                trailer = crc_trailer::none;
+            else if (strcmp(argv_copy[1], "append") == 0)
+                trailer = crc_trailer::append;
+            else if (strcmp(argv_copy[1], "verify") == 0)
+                trailer = crc_trailer::verify;
+            else
+                usage_error();
+        }
+        else if (strcmp(argv_copy[0], "-pair_timeout") == 0)
+        {
+            pair_timeout_ms = 1000 * mstoi(argv_copy[1], true);
+        }
+        else if (strcmp(argv_copy[0], "-spin") == 0)
+        {
+            spin_us = mstoi(argv_copy[1], true);
+        }
+        else if (strcmp(argv_copy[0], "-lag_policy") == 0)
+        {
+            if (strcmp(argv_copy[1], "block") == 0)
+                lag_policy = tee_policy::block;
+            else if (strcmp(argv_copy[1], "skip") == 0)
+                lag_policy = tee_policy::skip;
+            else if (strcmp(argv_copy[1], "disconnect") == 0)
+                lag_policy = tee_policy::disconnect;
+            else
+                usage_error();
+        }
+        else
+        {
+            break;
+        }
+        argv_copy += 2;
+        argc_copy -= 2;
+    }
+    // The input, then one or more outputs
+    std::vector<Uri> uri;
+    uri.push_back(process_args(argc_copy, argv_copy));
+    do
+    {
+        uri.push_back(process_args(argc_copy, argv_copy));
+    } while (argc_copy != 0);
+    size_t nspec = uri.size();
 
     // For error reporting
     try
     {
     // Initialize for listening, and do a test on connecting.
-    ServerInfo server_info[2];
-    for (size_t index = 0 ; index < 2 ; ++index)
+    std::vector<ServerInfo> server_info(nspec);
+    for (size_t index = 0 ; index < nspec ; ++index)
     {
         if (uri[index].listening)
         {
-            server_info[index].listener = new Listener(
-                uri[index].hostname, uri[index].ports, listen_backlog);
+            if (uri[index].unix_path.empty())
+            {
+                server_info[index].listener = new Listener(
+                    uri[index].hostname, uri[index].ports, listen_backlog,
+                    uri[index].sockopts);
+            }
+            else
+            {
+                server_info[index].listener = new Listener(
+                    uri[index].unix_path, listen_backlog,
+                    uri[index].sockopts);
+            }
         }
         else
         {
             server_info[index].port_num = uri[index].ports[0];
         }
         server_info[index].hostname = std::move(uri[index].hostname);
+        server_info[index].unix_path = std::move(uri[index].unix_path);
+        server_info[index].device = std::move(uri[index].device);
+        server_info[index].sockopts = uri[index].sockopts;
+        if (index == 0) input_quickack = (uri[index].sockopts.quickack == 1);
         // Give user immediate feedback. Otherwise, error message would only
         // appear when connection is attempted. That could be much later.
         if (server_info[index].hostname != "")
@@ -88,25 +227,101 @@ int main (int argc, char* argv[])
         exit(1);
     }
 
+    // Before any thread starts, so that all of them block SIGUSR1 and
+    // SIGUSR2
+    counters_dump_on_signal();
+    if (!trace_path.empty()) trace_start(trace_path);
+
+    if (!transform_name.empty() && (fan_in || (nspec != 2)))
+    {
+        std::cerr << "Sorry, \"-transform\" requires one input spec and "
+            "one output spec." << std::endl;
+        exit(1);
+    }
+    if (checksum && (fan_in || (nspec != 2)))
+    {
+        std::cerr << "Sorry, \"-crc32c\" requires one input spec and "
+            "one output spec." << std::endl;
+        exit(1);
+    }
+    if (spin_us && (fan_in || (nspec != 2)))
+    {
+        std::cerr << "Sorry, \"-spin\" requires one input spec and "
+            "one output spec." << std::endl;
+        exit(1);
+    }
+    if ((trailer != crc_trailer::none) && !transform_name.empty())
+    {
+        std::cerr << "Sorry, a CRC32C trailer does not work with "
+            "\"-transform\"." << std::endl;
+        exit(1);
+    }
+    if (fan_in)
+    {
+        if (!server_info[0].listening() || (nspec != 2))
+        {
+            std::cerr << "Sorry, \"-fan_in\" requires a -listen or "
+                "-listen_unix input spec and one output spec." << std::endl;
+            exit(1);
+        }
+        int outFD;
+        if (server_info[1].listening())
+        {
+            outFD = server_info[1].listener->get_client(0).socketFD;
+        }
+        else if (server_info[1].port_num == -1)
+        {
+            outFD = 1;
+        }
+        else
+        {
+            outFD = connect_spec(server_info[1], server_info[1].port_num);
+            if (outFD == -1) errorexit("connect to remote");
+        }
+        merge(*server_info[0].listener, outFD);
+        return 0;
+    }
+
     // Finish listening and connecting
-    Listener::SocketInfo final_info[2];
+    std::vector<Listener::SocketInfo> final_info(nspec);
     auto accept2 = [&server_info, &final_info] (int index) {
         final_info[index] =
             server_info[index].listener->get_client(0);
     };
-    // Special processing for double listen
-    if (server_info[0].listening() && server_info[1].listening())
+    // Special processing for more than one listen
+    if (std::count_if(server_info.begin(), server_info.end(),
+        [] (const ServerInfo& si) { return si.listening(); }) > 1)
     {
-        // wait for both clients to accept
-        std::thread t0(accept2, 0);
-        std::thread t1(accept2, 1);
-        t0.join();
-        t1.join();
+        // One client of each, accepted and paired by this thread
+        std::vector<Listener*> listeners;
+        for (size_t index = 0 ; index < nspec ; ++index)
+        {
+            if (server_info[index].listening())
+            {
+                listeners.push_back(server_info[index].listener);
+            }
+            else
+            {
+                final_info[index].port_num =
+                    server_info[index].port_num;
+                final_info[index].socketFD = -1;
+            }
+        }
+        Pairer pairer(listeners, pair_timeout_ms);
+        std::vector<Listener::SocketInfo> paired;
+        pairer.get_clients(0, paired);
+        for (size_t index = 0, next = 0 ; index < nspec ; ++index)
+        {
+            if (server_info[index].listening())
+            {
+                final_info[index] = paired[next++];
+            }
+        }
     }
     else
     {
         // Wait for client to listening socket, if any.
-        for (size_t index = 0 ; index < 2 ; ++index)
+        for (size_t index = 0 ; index < nspec ; ++index)
         {
             if (server_info[index].listening())
             {
@@ -136,24 +351,49 @@ int main (int argc, char* argv[])
 
 void usage_error()
 {
-    std::cerr << "Usage: tcpcat <input_spec> <output_spec>" << std::endl;
+    std::cerr << "Usage: tcpcat [-verbose n(" << default_log_level <<
+        ")] [-trace file.json]" << std::endl;
+    std::cerr << "    [-spill directory [-spill_budget mb(" <<
+        default_spill_budget_mb << ")]]" << std::endl;
+    std::cerr << "    [-lag_policy block|skip|disconnect(block)] "
+        "[-fan_in none|delimiter_byte]" << std::endl;
+    std::cerr << "    [-transform count|deflate[=level]|inflate] "
+        "[-crc32c report|append|verify]" << std::endl;
+    std::cerr << "    [-spin usec(0)] [-pair_timeout nnn(lots)]" << std::endl;
+    std::cerr << "    <input_spec> <output_spec> [<output_spec> ...]" <<
+        std::endl;
     std::cerr << "Each of <input_spec> and <output_spec> can be one of" <<
         std::endl;
     std::cerr << "    -pipe" << std::endl;
     std::cerr << "    -listen <port_number,port_number,...>" << std::endl;
     std::cerr << "    -listen <hostname>:<port_number,port_number,...>" << std::endl;
     std::cerr << "    -connect <hostname>:<port_number>" << std::endl;
+    std::cerr << "    -listen_unix <path>" << std::endl;
+    std::cerr << "    -connect_unix <path>" << std::endl;
+    std::cerr << "    -zero | -random | -null" << std::endl;
+    std::cerr << "A path starting with '@' is in the abstract namespace." <<
+        std::endl;
+    std::cerr << "-zero and -random read endless bytes, and -null reads none."
+        << std::endl;
+    std::cerr << "All three discard what is written to them." << std::endl;
+    std::cerr << "Each network spec can be followed by" << std::endl;
+    std::cerr << "    -sockopt <option,option,...>" << std::endl;
+    std::cerr << "with options nodelay[=0|1] quickack[=0|1] rcvbuf=nnn " <<
+        "sndbuf=nnn rcvlowat=nnn" << std::endl;
+    std::cerr << "    notsent_lowat=nnn user_timeout=msec fastopen[=nnn]" <<
+        std::endl;
+    std::cerr << "    busy_poll=usec prefer_busy_poll[=0|1]" << std::endl;
     exit (1);
 }
 
-void responder(
-    const ServerInfo server_info[2], Listener::SocketInfo final_info[2])
+void responder(const std::vector<ServerInfo>& server_info,
+    std::vector<Listener::SocketInfo>& final_info)
 {
-    int final_sock[2]{-1, -1};
-    SocketCloser sc0(final_sock[0]);
-    SocketCloser sc1(final_sock[1]);
+    std::vector<int> final_sock(server_info.size(), -1);
+    std::deque<SocketCloser> closers;
+    for (const int& sock : final_sock) closers.emplace_back(sock);
     bool success = true;
-    for (size_t index = 0 ; index < 2 ; ++index)
+    for (size_t index = 0 ; index < final_sock.size() ; ++index)
     {
         if (server_info[index].listening())
         {
@@ -164,30 +404,15 @@ void responder(
             if (final_info[index].port_num != -1)
             {
                 // Not stdin or stdout
-                try
-                {
-                    final_sock[index] =
-                        socket_from_address(
-                            0, server_info[index].hostname,
-                            final_info[index].port_num,
-                            std::numeric_limits<unsigned>::max());
-                }
-                catch (const NetutilsException& r)
-                {
-                    std::cerr << my_time() << " " <<
-                        r.strng << std::endl;
-                    exit(1);
-                }
+                final_sock[index] = connect_spec(
+                    server_info[index], final_info[index].port_num);
                 if (final_sock[index] == -1)
                 {
                     if ((errno == ETIMEDOUT) ||
                         (errno == EINPROGRESS))
                     {
-#if (VERBOSE >= 3)
-                        std::cerr << my_time() <<
-                            " Note: connect to listener: " <<
-                            strerror(errno) << std::endl;
-#endif
+                        LOG(3, 0) << "Note: connect to listener: " <<
+                            strerror(errno);
                         success = false;
                         break;
                     }
@@ -201,43 +426,43 @@ void responder(
     }
     if (success)
     {
-        // handle_clients() will close both sockets at a
+        // handle_clients() will close all sockets at a
         // future time.
-        sc0.disable();
-        sc1.disable();
+        for (SocketCloser& closer : closers) closer.disable();
         handle_clients(final_sock);
     }
     else
     {
-#if (VERBOSE >= 3)
-        std::cerr << my_time() << " early closing " <<
-            final_sock[0] << " " << final_sock[1] << std::endl;
-#endif
+        LOG(3, 0) << "early closing " <<
+            final_sock[0] << " " << final_sock[1];
     }
-#if (VERBOSE >= 2)
-    std::cerr << my_time() << " End copy loop FD " <<
-        final_sock[0] << " --> FD " << final_sock[1] << std::endl;
-#endif
+    LOG(2, 0) << "End copy loop FD " <<
+        final_sock[0] << " --> FD " << final_sock[1];
 }
 
-void handle_clients(const int sck[2])
+void handle_clients(const std::vector<int>& sck)
 {
-#if (VERBOSE >= 2)
-    std::cerr << my_time() << " Begin copy loop FD " << sck[0] << " --> FD " <<
-        sck[1] << std::endl;
-#endif
-    SocketCloser sc0(sck[0]);
-    SocketCloser sc1(sck[1]);
+    LOG(2, 0) << "Begin copy loop FD " << sck[0] << " --> FD " << sck[1];
+    std::deque<SocketCloser> closers;
+    for (const int& sock : sck) closers.emplace_back(sock);
 
-    int sock[2];
+    // -1 is stdin for the input, and stdout for an output
+    std::vector<int> sock(sck);
     sock[0] = (sck[0] == -1) ? 0 : sck[0];
-    sock[1] = (sck[1] == -1) ? 1 : sck[1];
-    copy(sock[0], sock[1]);
+    for (size_t index = 1 ; index < sock.size() ; ++index)
+    {
+        if (sock[index] == -1) sock[index] = 1;
+    }
+    if (sock.size() == 2)
+    {
+        copy(sock[0], sock[1]);
+    }
+    else
+    {
+        tee(sock[0], std::vector<int>(sock.begin() + 1, sock.end()));
+    }
 
-#if (VERBOSE >= 3)
-    std::cerr << my_time() << " closing FD " << sck[0] <<
-        " FD " << sck[1] << std::endl;
-#endif
+    LOG(3, 0) << "closing FD " << sck[0] << " FD " << sck[1];
 }
 
 void copy(int firstFD, int secondFD)
@@ -246,18 +471,53 @@ void copy(int firstFD, int secondFD)
     set_flags(secondFD, O_NONBLOCK);
     try
     {
-#if (VERBOSE >= 3)
-        std::cerr << my_time() << " starting copy, FD " << firstFD <<
-            " to FD " << secondFD << std::endl;
-        auto stats = copyfd<BUFFER_SIZE>(firstFD, secondFD);
-        std::cerr << my_time() << " FD " << firstFD << " --> FD " << secondFD <<
+        LOG(3, 0) << "starting copy, FD " << firstFD <<
+            " to FD " << secondFD;
+        iopackage_options opts;
+        std::unique_ptr<SpillBudget> budget;
+        std::unique_ptr<SpillLog> spill;
+        if (!spill_dir.empty() && spill_budget)
+        {
+            budget = std::make_unique<SpillBudget>(spill_budget);
+            spill = std::make_unique<SpillLog>(spill_dir, *budget,
+                std::min(SpillLog::default_segment_size, spill_budget));
+            opts.spill = spill.get();
+        }
+        std::unique_ptr<Transform> transform;
+        if (!transform_name.empty())
+        {
+            transform = make_transform(transform_name);
+            opts.transform = transform.get();
+        }
+        opts.checksum = checksum;
+        opts.trailer = trailer;
+        opts.spin_us = spin_us;
+        opts.quickack = input_quickack;
+        auto stats = copyfd<BUFFER_SIZE>(firstFD, secondFD, opts);
+        LOG(3, 0) << "FD " << firstFD << " --> FD " << secondFD <<
             ": " <<
             stats.bytes_copied << " bytes, " <<
             stats.reads << " reads, " <<
-            stats.writes << " writes." << std::endl;
-#else
-        copyfd<BUFFER_SIZE>(firstFD, secondFD);
-#endif
+            stats.writes << " writes, " <<
+            stats.bytes_spilled << " bytes spilled.";
+        if (spin_us)
+        {
+            LOG(3, 0) << "spun " << stats.spin_ns / 1000 << " us, blocked " <<
+                stats.blocked_ns / 1000 << " us";
+        }
+        if (checksum)
+        {
+            LOG(3, 0) << "CRC32C " << crc32c_string(stats.crc32c) <<
+                " (" << crc32c_method() << ")";
+        }
+        if (transform)
+        {
+            LOG(3, 0) << transform->report();
+        }
+    }
+    catch (const TransformException& t)
+    {
+        LOG(3, 0) << "Transform failure: " << t.strng;
     }
     catch (const IOPackageReadException& r)
     {
@@ -269,10 +529,14 @@ void copy(int firstFD, int secondFD)
                 << strerror(ECONNREFUSED) << std::endl;
             exit(1);
         }
-#if (VERBOSE >= 3)
-        std::cerr << my_time() << " Read failure after " << r.byte_count <<
-            " bytes: " << strerror(r.errn) << std::endl;
-#endif
+        if ((r.errn == EBADMSG) && (trailer == crc_trailer::verify))
+        {
+            std::cerr << my_time() << " CRC32C trailer missing or wrong "
+                "after " << r.byte_count << " bytes" << std::endl;
+            exit(1);
+        }
+        LOG(3, 0) << "Read failure after " << r.byte_count <<
+            " bytes: " << strerror(r.errn);
     }
     catch (const IOPackageWriteException& w)
     {
@@ -282,11 +546,78 @@ void copy(int firstFD, int secondFD)
                 << strerror(ECONNREFUSED) << std::endl;
             exit(1);
         }
-#if (VERBOSE >= 3)
-        std::cerr << my_time() << " Write failure after " << w.byte_count <<
-            " bytes: " << strerror(w.errn) << std::endl;
-#endif
+        LOG(3, 0) << "Write failure after " << w.byte_count <<
+            " bytes: " << strerror(w.errn);
+    }
+}
+
+void tee(int firstFD, const std::vector<int>& otherFDs)
+{
+    set_flags(firstFD, O_NONBLOCK);
+    for (int fd : otherFDs) set_flags(fd, O_NONBLOCK);
+    try
+    {
+        LOG(3, 0) << "starting tee, FD " << firstFD << " to " <<
+            otherFDs.size() << " outputs";
+        tee_stats stats =
+            copyfd_tee(firstFD, otherFDs, lag_policy, tee_ring_size);
+        LOG(3, 0) << "FD " << firstFD << ": " << stats.bytes_read <<
+            " bytes read.";
+        for (size_t index = 0 ; index < otherFDs.size() ; ++index)
+        {
+            LOG(3, 0) << "--> FD " << otherFDs[index] << ": " <<
+                stats.bytes_written[index] << " bytes, " <<
+                stats.bytes_skipped[index] << " bytes skipped" <<
+                ((stats.errn[index] == -1) ? ", disconnected." :
+                 stats.errn[index] ? ", failed." : ".");
+        }
+    }
+    catch (const IOPackageReadException& r)
+    {
+        LOG(3, 0) << "Read failure after " << r.byte_count <<
+            " bytes: " << strerror(r.errn);
+    }
+}
+
+int connect_spec(const ServerInfo& si, int port_num)
+{
+    if (!si.device.empty()) return open_device(si.device);
+    try
+    {
+        return si.unix_path.empty()
+            ? socket_from_address(
+                0, si.hostname, port_num,
+                std::numeric_limits<unsigned>::max(), si.sockopts)
+            : socket_from_unix_path(
+                0, si.unix_path,
+                std::numeric_limits<unsigned>::max(), si.sockopts);
+    }
+    catch (const NetutilsException& r)
+    {
+        std::cerr << my_time() << " " << r.strng << std::endl;
+        exit(1);
+    }
+}
+
+void merge(Listener& listener, int outFD)
+{
+    SocketCloser sc(outFD);
+    set_flags(outFD, O_NONBLOCK);
+    fanin_stats stats;
+    try
+    {
+        LOG(3, 0) << "starting fan-in to FD " << outFD;
+        copyfd_fanin(listener, outFD, fan_in_delimiter, fanin_ring_size,
+            stats);
+    }
+    catch (const IOPackageWriteException& w)
+    {
+        LOG(3, 0) << "Write failure after " << w.byte_count <<
+            " bytes: " << strerror(w.errn);
     }
+    LOG(3, 0) << "--> FD " << outFD << ": " << stats.inputs << " inputs, " <<
+        stats.bytes << " bytes, " << stats.batches << " writes of " <<
+        stats.segments << " buffers.";
 }
 
 #include "copyfd.tcc"
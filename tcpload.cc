@@ -0,0 +1,411 @@
+// A synthetic load generator. Keeps many connections open at once to one
+// target, each of which sends fixed size messages at a given rate, reads
+// whatever comes back, and closes after a given number of messages, to be
+// replaced by a new connection. All connections run as coroutines on one
+// CoScheduler, so that thousands of them cost one thread.
+
+#include "commonutils.h"
+#include "coroutine.h"
+#include "counters.h"
+#include "logger.h"
+#include "miscutils.h"
+#include "netutils.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <unordered_set>
+#include <vector>
+
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+// Tuning (compile time)
+constexpr int default_connections{100};
+constexpr int default_messages{10};
+constexpr int default_message_size{1024};
+constexpr int default_duration_sec{10};
+constexpr size_t drain_read_size{64*1024};
+constexpr int connect_retry_ms{100};
+constexpr int report_interval_ms{1000};
+
+using Clock = CoScheduler::Clock;
+
+struct LoadOptions
+{
+    int connections;   // At once
+    int total;         // Connections in all. 0: no limit.
+    int messages;      // For each connection, then it closes. 0: no limit.
+    int message_size;
+    int rate;          // Messages per second, each connection. 0: no pacing.
+    int duration_sec;  // 0: no limit
+};
+
+// Shared by all coroutines. Everything runs on one thread.
+struct Load
+{
+    CoScheduler sched;
+    LoadOptions options;
+    Uri target;
+    std::vector<unsigned char> message;
+    bool stopping{false};
+    int active_slots{0};
+    Clock::time_point finished;         // When the last slot ended
+    std::coroutine_handle<> reporter;   // While co_report() sleeps
+    std::unordered_set<int> open_fds;   // For cancelling at the deadline
+
+    unsigned started{0};
+    unsigned connected{0};
+    unsigned failed{0};
+    unsigned completed{0};  // Sent every message, or ran to the end
+    size_t sent{0};
+    size_t received{0};
+};
+
+// One connection, shared by its sender and the coroutine that drains it
+struct Connection
+{
+    int fd;
+    bool drained{false};
+    std::coroutine_handle<> waiter;
+};
+
+struct DrainAwaiter
+{
+    bool await_ready() { return conn.drained; }
+    void await_suspend(std::coroutine_handle<> h) { conn.waiter = h; }
+    void await_resume() { }
+
+    Connection& conn;
+};
+
+void usage_error();  // Note: will be exported for use in commonutils.
+static CoTask co_slot(Load& load);
+static CoTask co_report(Load& load, Clock::time_point deadline);
+static void raise_fd_limit();
+
+int main(int argc, char* argv[])
+{
+    // Process inputs
+    int argc_copy = argc - 1;
+    char** argv_copy = argv;
+    ++argv_copy;
+    LoadOptions options{default_connections, 0, default_messages,
+        default_message_size, 0, default_duration_sec};
+    while (argc_copy >= 2)
+    {
+        if (strcmp(argv_copy[0], "-verbose") == 0)
+        {
+            set_log_level(mstoi(argv_copy[1]));
+        }
+        else if (strcmp(argv_copy[0], "-connections") == 0)
+        {
+            options.connections = mstoi(argv_copy[1]);
+        }
+        else if (strcmp(argv_copy[0], "-total") == 0)
+        {
+            options.total = mstoi(argv_copy[1], true);
+        }
+        else if (strcmp(argv_copy[0], "-messages") == 0)
+        {
+            options.messages = mstoi(argv_copy[1], true);
+        }
+        else if (strcmp(argv_copy[0], "-size") == 0)
+        {
+            options.message_size = mstoi(argv_copy[1]);
+        }
+        else if (strcmp(argv_copy[0], "-rate") == 0)
+        {
+            options.rate = mstoi(argv_copy[1], true);
+        }
+        else if (strcmp(argv_copy[0], "-duration") == 0)
+        {
+            options.duration_sec = mstoi(argv_copy[1], true);
+        }
+        else
+        {
+            break;
+        }
+        argv_copy += 2;
+        argc_copy -= 2;
+    }
+    Uri target = process_args(argc_copy, argv_copy);
+    if (target.listening || (target.ports[0] == -1) ||
+        !target.device.empty() || (argc_copy != 0))
+    {
+        usage_error();
+    }
+    if (options.connections == 0)
+    {
+        std::cerr << "Sorry, \"-connections\" must be at least 1." <<
+            std::endl;
+        exit(1);
+    }
+    if ((options.messages == 0) && (options.duration_sec == 0))
+    {
+        std::cerr << "Sorry, \"-messages 0\" requires a \"-duration\"." <<
+            std::endl;
+        exit(1);
+    }
+
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+    {
+        perror("signal");
+        exit(1);
+    }
+    counters_dump_on_signal();
+    raise_fd_limit();
+
+    try
+    {
+        Load load;
+        load.options = options;
+        load.target = std::move(target);
+        load.message.resize(options.message_size);
+        for (size_t index = 0 ; index < load.message.size() ; ++index)
+        {
+            load.message[index] = 'a' + index % 26;
+        }
+
+        Clock::time_point start = Clock::now();
+        for (int slot = 0 ; slot < options.connections ; ++slot)
+        {
+            ++load.active_slots;
+            load.sched.spawn(co_slot(load));
+        }
+        load.sched.spawn(co_report(load, options.duration_sec
+            ? start + std::chrono::seconds(options.duration_sec)
+            : Clock::time_point::max()));
+        load.sched.run();
+
+        double seconds = std::chrono::duration<double>(
+            load.finished - start).count();
+        std::cerr << my_time() << " " << load.connected <<
+            " connections (" << load.completed << " completed, " <<
+            load.failed << " failed) in " << seconds << " s, " <<
+            load.connected / seconds << " per second" << std::endl;
+        std::cerr << my_time() << " sent " << load.sent << " bytes, " <<
+            load.sent / seconds / 1e6 << " MB/s, received " <<
+            load.received << " bytes, " <<
+            load.received / seconds / 1e6 << " MB/s" << std::endl;
+    }
+    catch (const NetutilsException& r)
+    {
+        std::cerr << my_time() << " " << r.strng << std::endl;
+        exit(1);
+    }
+    return 0;
+}
+
+void usage_error()
+{
+    std::cerr << "Usage: tcpload [-verbose n(" << default_log_level <<
+        ")] [-connections n(" << default_connections << ")] "
+        "[-total n(0)]" << std::endl;
+    std::cerr << "    [-messages n(" << default_messages << ")] [-size bytes(" <<
+        default_message_size << ")] [-rate messages_per_sec(0)]" <<
+        std::endl;
+    std::cerr << "    [-duration sec(" << default_duration_sec << ")] "
+        "<target_spec>" << std::endl;
+    std::cerr << "<target_spec> can be one of" << std::endl;
+    std::cerr << "    -connect <hostname>:<port_number>" << std::endl;
+    std::cerr << "    -connect_unix <path>" << std::endl;
+    std::cerr << "and can be followed by" << std::endl;
+    std::cerr << "    -sockopt <option,option,...>" << std::endl;
+    std::cerr << "-connections are kept open at once. Each sends -messages, "
+        "then closes, and" << std::endl;
+    std::cerr << "is replaced, until -total connections or -duration. "
+        "0 means no limit." << std::endl;
+    exit (1);
+}
+
+// Raised to the hard limit, for thousands of connections
+void raise_fd_limit()
+{
+    struct rlimit limit;
+    NEGCHECK("getrlimit", getrlimit(RLIMIT_NOFILE, &limit));
+    limit.rlim_cur = limit.rlim_max;
+    NEGCHECK("setrlimit", setrlimit(RLIMIT_NOFILE, &limit));
+}
+
+// Reads until the end, or until cancelled, then wakes the sender
+static CoTask co_drain(Load& load, std::shared_ptr<Connection> conn)
+{
+    std::vector<unsigned char> buffer(drain_read_size);
+    while (true)
+    {
+        ssize_t count = read(conn->fd, buffer.data(), buffer.size());
+        if (count > 0)
+        {
+            load.received += count;
+            counter_add(counter_reads);
+        }
+        else if ((count < 0) && (errno == EAGAIN))
+        {
+            counter_add(counter_eagains);
+            if (!co_await load.sched.readable(conn->fd)) break;
+        }
+        else
+        {
+            if (count < 0) counter_error(errno);
+            break;
+        }
+    }
+    conn->drained = true;
+    if (conn->waiter) load.sched.post(conn->waiter);
+}
+
+// Connections one after another, until the load stops
+CoTask co_slot(Load& load)
+{
+    const LoadOptions& options = load.options;
+    const Uri& target = load.target;
+    while (!load.stopping &&
+        ((options.total == 0) || (load.started < (unsigned)options.total)))
+    {
+        unsigned conn_num = ++load.started;
+        bool in_progress;
+        int fd = socket_connect_start(conn_num, target.hostname,
+            target.ports[0], target.unix_path, target.sockopts, in_progress);
+        if ((fd != -1) && in_progress)
+        {
+            load.open_fds.insert(fd);
+            bool waited = co_await load.sched.writable(fd);
+            int err = ECANCELED;
+            if (waited)
+            {
+                socklen_t len = sizeof(err);
+                NEGCHECK("getsockopt",
+                    getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len));
+            }
+            if (err)
+            {
+                counter_add(counter_connect_failures);
+                load.open_fds.erase(fd);
+                load.sched.cancel(fd);
+                close(fd);
+                fd = -1;
+                errno = err;
+            }
+        }
+        if (fd == -1)
+        {
+            if (errno != ECANCELED)
+            {
+                ++load.failed;
+                LOG(3, conn_num) << "Note: connect: " << strerror(errno);
+                // Not a busy loop against a target that is down
+                co_await load.sched.sleep_until(Clock::now() +
+                    std::chrono::milliseconds(connect_retry_ms));
+            }
+            continue;
+        }
+        load.open_fds.insert(fd);
+        ++load.connected;
+        LOG(3, conn_num) << "connected, FD " << fd;
+
+        auto conn = std::make_shared<Connection>();
+        conn->fd = fd;
+        load.sched.spawn(co_drain(load, conn));
+
+        std::chrono::nanoseconds interval{options.rate
+            ? 1000000000 / options.rate : 0};
+        Clock::time_point next_send = Clock::now();
+        bool ok = true;
+        int message = 0;
+        for ( ; ok && !load.stopping &&
+            ((options.messages == 0) || (message < options.messages)) ;
+            ++message)
+        {
+            if (options.rate)
+            {
+                co_await load.sched.sleep_until(next_send);
+                next_send += interval;
+                if (load.stopping) break;
+            }
+            size_t done = 0;
+            while (done < load.message.size())
+            {
+                ssize_t count = write(fd, load.message.data() + done,
+                    load.message.size() - done);
+                if (count > 0)
+                {
+                    done += count;
+                    load.sent += count;
+                    counter_add(counter_writes);
+                    counter_add(counter_bytes, count);
+                }
+                else if ((count < 0) && (errno == EAGAIN))
+                {
+                    counter_add(counter_eagains);
+                    if (!co_await load.sched.writable(fd))
+                    {
+                        ok = false;
+                        break;
+                    }
+                }
+                else
+                {
+                    if (count < 0) counter_error(errno);
+                    LOG(3, conn_num) << "Note: write: " << strerror(errno);
+                    ok = false;
+                    break;
+                }
+            }
+        }
+        // The target sees the end, and ends its replies
+        shutdown(fd, ok && !load.stopping ? SHUT_WR : SHUT_RDWR);
+        co_await DrainAwaiter{*conn};
+        load.open_fds.erase(fd);
+        load.sched.cancel(fd);
+        close(fd);
+        // Cut off at the deadline, it did not complete, unless it had no
+        // number of messages to send.
+        if (ok && ((options.messages == 0) || (message == options.messages)))
+        {
+            ++load.completed;
+        }
+        LOG(3, conn_num) << "closed FD " << fd;
+    }
+    if (--load.active_slots == 0)
+    {
+        load.finished = Clock::now();
+        // Not a report interval later
+        load.sched.wake(&load.reporter);
+    }
+}
+
+// Progress, once a report interval, while any slot runs. At the deadline,
+// stops the load and cancels whatever waits.
+CoTask co_report(Load& load, Clock::time_point deadline)
+{
+    unsigned last_connected = 0;
+    size_t last_sent = 0;
+    size_t last_received = 0;
+    Clock::time_point next = Clock::now();
+    while (load.active_slots)
+    {
+        next += std::chrono::milliseconds(report_interval_ms);
+        co_await load.sched.sleep_until(
+            load.stopping ? next : std::min(next, deadline), &load.reporter);
+        if (!load.active_slots) break;
+        if (!load.stopping && (Clock::now() >= deadline))
+        {
+            load.stopping = true;
+            // cancel() only posts waiters, so the set does not change here.
+            for (int fd : load.open_fds) load.sched.cancel(fd);
+        }
+        LOG(1, 0) << load.open_fds.size() << " open, " <<
+            (load.connected - last_connected) << " connected, " <<
+            (load.sent - last_sent) << " bytes sent, " <<
+            (load.received - last_received) << " bytes received";
+        last_connected = load.connected;
+        last_sent = load.sent;
+        last_received = load.received;
+    }
+}
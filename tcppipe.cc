@@ -1,15 +1,31 @@
+#include "admission.h"
+#include "affinity.h"
+#include "capture.h"
 #include "commonutils.h"
 #include "copyfd.h"
+#include "coroutine.h"
+#include "counters.h"
+#include "crc32c.h"
+#include "handoff.h"
+#include "logger.h"
 #include "mcleaner.h"
 #include "miscutils.h"
 #include "netutils.h"
+#include "pairing.h"
+#include "ratelimit.h"
+#include "spilllog.h"
+#include "timerwheel.h"
+#include "trace.h"
+#include "transform.h"
 using namespace MCleaner;
 
+#include <algorithm>
 #include <chrono>
 using namespace std::chrono_literals;
 #include <cstring>
 #include <iostream>
-#include <semaphore>
+#include <map>
+#include <memory>
 #include <thread>
 
 #include <fcntl.h>
@@ -17,28 +33,73 @@ using namespace std::chrono_literals;
 #include <signal.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 
 // Tuning (compile time)
 #ifndef BUFFER_SIZE
 #define BUFFER_SIZE (4*1024)
 #endif
-constexpr std::ptrdiff_t default_max_cip{10};
-constexpr std::ptrdiff_t default_max_clients{32};
+constexpr size_t default_max_cip{10};
+constexpr size_t default_max_clients{32};
 constexpr int default_max_connecttime_ms{300*1000};
-constexpr std::ptrdiff_t semaphore_max_max{256};
-constexpr int listen_backlog{10};
+// Deferred clients wait here. The kernel caps it at net.core.somaxconn.
+constexpr int listen_backlog{4096};
+constexpr size_t rate_limit_burst_ms{100};
+constexpr int timer_tick_ms{100};
+constexpr int default_spill_budget_mb{1024};
+constexpr int default_capture_size_mb{1024};
 
 struct Options
 {
-    std::ptrdiff_t max_cip;
-    std::ptrdiff_t max_clients;
+    size_t max_cip;
+    size_t max_clients;
+    size_t max_port_clients;   // For each listening port. 0: none.
+    bool overload_reject;      // Close clients over a limit, not defer them
     int max_iotime_ms;
     int max_connecttime_ms;
+    int max_idletime_ms;
+    int pair_timeout_ms;       // Two -listen specs. 0: wait for a partner.
+    size_t rate_limit;         // Bytes per second, each direction. 0: none.
+    size_t global_rate_limit;  // Same, for all clients together
+    TokenBucket* global_limit[2];
+    bool coroutines;           // All clients on one thread
+    std::string trace_path;    // Empty: no tracing
+    std::string spill_dir;     // Empty: no spilling
+    size_t spill_budget;       // Bytes, for all clients together
+    SpillBudget* spill_pool;
+    // Forward and backward. Empty: none.
+    std::string transform_name[2];
+    bool checksum;             // CRC32C of each direction, in the log
+    std::string capture_path;  // Empty: no capture
+    size_t capture_size;       // Bytes
+    CaptureFile* capture;
+    unsigned spin_us;          // Latency mode. 0: poll() at once.
+    bool quickack[2];          // TCP_QUICKACK, set again after reads
+    // Thread placement
+    bool pin_accept;
+    cpu_set_t accept_cpus;
+    bool pin_relay;            // With -relay_cpus or -incoming_cpu
+    cpu_set_t relay_cpus;      // Default: all that the process may use
+    bool incoming_cpu;         // Relay on the CPU of SO_INCOMING_CPU
+    // Restarts. Empty: none.
+    std::string handoff_path;  // Where a new process may take the listeners
+    std::string takeover_path; // Where to take them from an old process
 };
 static Options process_options(int& argc, char**& argv);
 static void handle_clients(
-    unsigned client_num, const int sck[2], int max_iotime_ms);
+    unsigned client_num, const int sck[2], const Options& options,
+    SessionTimer& timer);
+static void run_coroutines(
+    const ServerInfo server_info[2], const Options& options);
+static void serve_handoff(
+    Listener* handoff, std::vector<int> fds, int eventFD);
+static bool try_admit(AdmissionController& clients_limiter,
+    AdmissionController* const port_limiter[2]);
+static void reject_client(unsigned client_num, int socketFD);
+static void place_relay(unsigned client_num,
+    const ServerInfo server_info[2],
+    const ByValue<Listener::SocketInfo,2>& fi, const Options& options);
 void usage_error();  // Note: will be exported for use in commonutils.
 
 int main(int argc, char* argv[])
@@ -56,13 +117,59 @@ int main(int argc, char* argv[])
     uri[1] = process_args(argc_copy, argv_copy);
     if (argc_copy != 0) usage_error();
 
+    // Before any thread starts, so that all of them block SIGUSR1 and
+    // SIGUSR2. The first LOG starts the logger thread, and a takeover
+    // logs before the listeners exist.
+    counters_dump_on_signal();
+    if (!options.trace_path.empty()) trace_start(options.trace_path);
+
+    // Listening sockets handed over by an old process, in spec order
+    std::vector<int> taken;
+    size_t next_taken = 0;
+    int takeover_sock = -1;
+    if (!options.takeover_path.empty())
+    {
+        taken = handoff_take(options.takeover_path, takeover_sock);
+    }
+
     ServerInfo server_info[2];
+    // Per listening port, by port number
+    std::map<int, std::unique_ptr<AdmissionController> > port_limit[2];
     for (size_t index = 0 ; index < 2 ; ++index)
     {
-        if (uri[index].listening)
+        if (uri[index].listening && options.max_port_clients)
         {
+            for (int port : uri[index].ports)
+            {
+                port_limit[index][port] =
+                    std::make_unique<AdmissionController>(
+                        options.max_port_clients);
+            }
+        }
+        if (uri[index].listening && (takeover_sock != -1))
+        {
+            size_t count = std::min(
+                uri[index].ports.size(), taken.size() - next_taken);
+            std::vector<int> fds(taken.begin() + next_taken,
+                taken.begin() + next_taken + count);
+            next_taken += count;
             server_info[index].listener = new Listener(
-                uri[index].hostname, uri[index].ports, listen_backlog);
+                fds, uri[index].ports, uri[index].sockopts);
+        }
+        else if (uri[index].listening)
+        {
+            if (uri[index].unix_path.empty())
+            {
+                server_info[index].listener = new Listener(
+                    uri[index].hostname, uri[index].ports, listen_backlog,
+                    uri[index].sockopts);
+            }
+            else
+            {
+                server_info[index].listener = new Listener(
+                    uri[index].unix_path, listen_backlog,
+                    uri[index].sockopts);
+            }
         }
         else
         {
@@ -70,6 +177,10 @@ int main(int argc, char* argv[])
             server_info[index].port_num = uri[index].ports[0];
         }
         server_info[index].hostname = std::move(uri[index].hostname);
+        server_info[index].unix_path = std::move(uri[index].unix_path);
+        server_info[index].device = std::move(uri[index].device);
+        server_info[index].sockopts = uri[index].sockopts;
+        options.quickack[index] = (uri[index].sockopts.quickack == 1);
         // Give user immediate feedback. Otherwise, error message would only
         // appear when connection is attempted. That could be much later.
         if (server_info[index].hostname != "")
@@ -90,6 +201,52 @@ int main(int argc, char* argv[])
 
     // Programming note: user inputs processed, and uri is now obsolete.
 
+    if (takeover_sock != -1)
+    {
+        if (next_taken != taken.size())
+        {
+            std::cerr << "Sorry, the old process has more listening "
+                "sockets than the -listen specs." << std::endl;
+            exit(1);
+        }
+        // The old process stops accepting now.
+        handoff_done(takeover_sock);
+        LOG(1, 0) << "took over " << taken.size() << " listening sockets";
+    }
+
+    // Budgets shared by all clients, one for each direction
+    std::unique_ptr<TokenBucket> global_limit[2];
+    if (options.global_rate_limit)
+    {
+        for (size_t index = 0 ; index < 2 ; ++index)
+        {
+            global_limit[index] = std::make_unique<TokenBucket>(
+                options.global_rate_limit,
+                options.global_rate_limit * rate_limit_burst_ms / 1000);
+            options.global_limit[index] = global_limit[index].get();
+        }
+    }
+
+    // Spill space shared by all clients
+    std::unique_ptr<SpillBudget> spill_pool;
+    if (!options.spill_dir.empty() && options.spill_budget)
+    {
+        spill_pool = std::make_unique<SpillBudget>(options.spill_budget);
+        options.spill_pool = spill_pool.get();
+    }
+
+    // One file for all clients
+    std::unique_ptr<CaptureFile> capture;
+    if (!options.capture_path.empty())
+    {
+        capture = std::make_unique<CaptureFile>(
+            options.capture_path, options.capture_size);
+        options.capture = capture.get();
+    }
+
+    // Deadlines for all clients
+    TimerWheel timer_wheel(timer_tick_ms);
+
     // Prevent a crash
     if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
     {
@@ -102,31 +259,160 @@ int main(int argc, char* argv[])
         exit(1);
     }
 
+    // copyfd2() ends a session when either direction ends, and -null
+    // ends its direction at once.
+    if ((server_info[0].device == "/dev/null") ||
+        (server_info[1].device == "/dev/null"))
+    {
+        std::cerr << "Sorry, \"-null\" does not work with tcppipe. "
+            "For a sink, try" << std::endl;
+        std::cerr << "    tcpcat -fan_in none -listen <port_number> -null" <<
+            std::endl;
+        exit(1);
+    }
+    if (options.coroutines)
+    {
+        if (!server_info[0].listening() || server_info[1].listening() ||
+            (server_info[1].port_num == -1) ||
+            !server_info[1].device.empty())
+        {
+            std::cerr << "Sorry, \"-coroutines\" requires a -listen spec "
+                "followed by a -connect spec." << std::endl;
+            exit(1);
+        }
+        if (!options.spill_dir.empty())
+        {
+            std::cerr << "Sorry, \"-spill\" does not work with "
+                "\"-coroutines\"." << std::endl;
+            exit(1);
+        }
+        if (!options.capture_path.empty())
+        {
+            std::cerr << "Sorry, \"-capture\" does not work with "
+                "\"-coroutines\"." << std::endl;
+            exit(1);
+        }
+        if (options.checksum)
+        {
+            std::cerr << "Sorry, \"-crc32c\" does not work with "
+                "\"-coroutines\"." << std::endl;
+            exit(1);
+        }
+        if (!options.transform_name[0].empty() ||
+            !options.transform_name[1].empty())
+        {
+            std::cerr << "Sorry, transforms do not work with "
+                "\"-coroutines\"." << std::endl;
+            exit(1);
+        }
+        if (options.spin_us)
+        {
+            std::cerr << "Sorry, \"-spin\" does not work with "
+                "\"-coroutines\"." << std::endl;
+            exit(1);
+        }
+        if (options.pin_relay)
+        {
+            std::cerr << "Sorry, with \"-coroutines\", one thread does "
+                "everything. Use \"-accept_cpus\"." << std::endl;
+            exit(1);
+        }
+        if (!options.handoff_path.empty())
+        {
+            std::cerr << "Sorry, \"-handoff_path\" does not work with "
+                "\"-coroutines\"." << std::endl;
+            exit(1);
+        }
+        if (options.overload_reject || options.max_port_clients)
+        {
+            std::cerr << "Sorry, \"-overload\" and \"-max_port_clients\" "
+                "do not work with \"-coroutines\"." << std::endl;
+            exit(1);
+        }
+        if (options.rate_limit || options.global_rate_limit)
+        {
+            std::cerr << "Sorry, \"-rate_limit\" and \"-global_rate_limit\" "
+                "do not work with \"-coroutines\"." << std::endl;
+            exit(1);
+        }
+        if ((options.max_iotime_ms != -1) || (options.max_idletime_ms != -1))
+        {
+            std::cerr << "Sorry, \"-max_iotime\" and \"-max_idletime\" "
+                "do not work with \"-coroutines\"." << std::endl;
+            exit(1);
+        }
+        if (options.pin_accept) pin_thread(options.accept_cpus);
+        run_coroutines(server_info, options);
+        return 0;
+    }
+
+    // Relay threads inherit this, and each chooses its own.
+    if (options.pin_accept) pin_thread(options.accept_cpus);
+
     bool repeat =
         (server_info[0].listening() || server_info[1].listening());
+
+    // Readable once the listening sockets are handed off
+    int handoff_event = -1;
+    if (!options.handoff_path.empty())
+    {
+        if (!repeat)
+        {
+            std::cerr << "Sorry, \"-handoff_path\" requires a -listen or "
+                "-listen_unix spec." << std::endl;
+            exit(1);
+        }
+        std::vector<int> fds;
+        for (size_t index = 0 ; index < 2 ; ++index)
+        {
+            if (!server_info[index].listening()) continue;
+            const Listener& listener = *server_info[index].listener;
+            for (size_t port = 0 ; port < listener.size() ; ++port)
+            {
+                fds.push_back(listener.fd(port));
+            }
+        }
+        NEGCHECK("eventfd", (handoff_event = eventfd(0, EFD_CLOEXEC)));
+        Listener* handoff = new Listener(options.handoff_path, 1);
+        std::thread(serve_handoff, handoff, fds, handoff_event).detach();
+    }
+
+    bool handed_off = false;
     std::thread last_thread;
-    std::counting_semaphore<semaphore_max_max>
-        clients_limiter{options.max_clients};
-    std::counting_semaphore<semaphore_max_max> cip_limiter{options.max_cip};
+    // Double listen: one thread accepts on both sides, and pairs clients.
+    std::unique_ptr<Pairer> pairer;
+    if (server_info[0].listening() && server_info[1].listening())
+    {
+        pairer = std::make_unique<Pairer>(std::vector<Listener*>{
+            server_info[0].listener, server_info[1].listener},
+            options.pair_timeout_ms);
+    }
+    AdmissionController clients_limiter(options.max_clients);
+    AdmissionController cip_limiter(options.max_cip);
     unsigned client_num{0};
     // Loop over clients
     do
     {
-        clients_limiter.acquire();
+        // Deferred clients wait in the listen backlog meanwhile.
+        uint64_t waited_ns = 0;
+        if (!options.overload_reject) waited_ns = clients_limiter.acquire();
         ++client_num;
         Listener::SocketInfo final_info[2];
-        auto accept2 = [client_num, &server_info, &final_info] (int index) {
-            final_info[index] =
-                server_info[index].listener->get_client(client_num);
+        auto accept2 = [client_num, &server_info, &final_info,
+            handoff_event] (int index) {
+            final_info[index] = server_info[index].listener->get_client(
+                client_num, handoff_event);
         };
         // Special processing for double listen
-        if (server_info[0].listening() && server_info[1].listening())
+        if (pairer)
         {
-            // wait for both clients to accept
-            std::thread t0(accept2, 0);
-            std::thread t1(accept2, 1);
-            t0.join();
-            t1.join();
+            std::vector<Listener::SocketInfo> paired;
+            if (!pairer->get_clients(client_num, paired, handoff_event))
+            {
+                paired.assign(2, {0, -1});
+            }
+            final_info[0] = paired[0];
+            final_info[1] = paired[1];
         }
         else
         {
@@ -143,19 +429,101 @@ int main(int argc, char* argv[])
                 }
             }
         }
+        for (size_t index = 0 ; index < 2 ; ++index)
+        {
+            if (server_info[index].listening() &&
+                (final_info[index].socketFD == -1))
+            {
+                handed_off = true;
+            }
+        }
+        if (handed_off)
+        {
+            // A client accepted on the other listener of a double listen
+            for (size_t index = 0 ; index < 2 ; ++index)
+            {
+                if (server_info[index].listening() &&
+                    (final_info[index].socketFD != -1))
+                {
+                    close(final_info[index].socketFD);
+                }
+            }
+            if (!options.overload_reject) clients_limiter.release();
+            break;
+        }
+
+        AdmissionController* port_limiter[2]{nullptr, nullptr};
+        for (size_t index = 0 ; index < 2 ; ++index)
+        {
+            auto found = port_limit[index].find(final_info[index].port_num);
+            if (server_info[index].listening() &&
+                (found != port_limit[index].end()))
+            {
+                port_limiter[index] = found->second.get();
+            }
+        }
+        if (options.overload_reject &&
+            !try_admit(clients_limiter, port_limiter))
+        {
+            for (size_t index = 0 ; index < 2 ; ++index)
+            {
+                if (server_info[index].listening())
+                {
+                    reject_client(client_num, final_info[index].socketFD);
+                }
+            }
+            continue;
+        }
 
         ByValue<Listener::SocketInfo,2> fi(final_info);
         auto responder =
-            [client_num, &clients_limiter, &cip_limiter, &server_info, fi,
-                &options] ()
+            [client_num, &clients_limiter, &cip_limiter, port_limiter,
+                waited_ns, &server_info, fi, &options, &timer_wheel] ()
             {
-                SemaphoreReleaser clientsToken(clients_limiter);
+                Releaser<AdmissionController> clientsToken(clients_limiter);
+                // Deferred, a client waits for its port here, so that it
+                // does not hold up the accept loop. It gives back its
+                // client slot meanwhile, so that a port at its limit does
+                // not use up -max_clients for the other ports.
+                uint64_t queued_ns = waited_ns;
+                Releaser<AdmissionController> port_token[2];
+                for (size_t index = 0 ; index < 2 ; ++index)
+                {
+                    if (!port_limiter[index]) continue;
+                    if (!options.overload_reject &&
+                        !port_limiter[index]->try_acquire())
+                    {
+                        clientsToken.disable();
+                        clients_limiter.release();
+                        queued_ns += port_limiter[index]->acquire();
+                        queued_ns += clients_limiter.acquire();
+                        clientsToken =
+                            Releaser<AdmissionController>(clients_limiter);
+                    }
+                    port_token[index] =
+                        Releaser<AdmissionController>(*port_limiter[index]);
+                }
+                if (queued_ns)
+                {
+                    counter_add(counter_admission_waits);
+                    counter_add(counter_admission_wait_ns, queued_ns);
+                    LOG(3, client_num) << "admitted after " <<
+                        queued_ns / 1000 << " us";
+                }
+                // Not left where the accept thread runs
+                if (options.pin_relay || options.pin_accept)
+                {
+                    place_relay(client_num, server_info, fi, options);
+                }
                 int final_sock[2]{-1, -1};
                 SocketCloser sc0(final_sock[0]);
                 SocketCloser sc1(final_sock[1]);
+                SessionTimer timer(timer_wheel);
                 cip_limiter.acquire();
+                timer.arm(SessionTimer::connect_deadline,
+                    options.max_connecttime_ms);
                 bool success = true;
-                {   SemaphoreReleaser cip_token(cip_limiter);
+                {   Releaser<AdmissionController> cip_token(cip_limiter);
                     for (size_t index = 0 ; index < 2 ; ++index)
                     {
                         if (server_info[index].listening())
@@ -164,28 +532,34 @@ int main(int argc, char* argv[])
                         }
                         else
                         {
-                            if (fi[index].port_num != -1)
+                            if (!server_info[index].device.empty())
+                            {
+                                final_sock[index] =
+                                    open_device(server_info[index].device);
+                            }
+                            else if (fi[index].port_num != -1)
                             {
                                 // Not stdin or stdout
                                 try
                                 {
-                                    final_sock[index] =
-                                        socket_from_address(
-                                            client_num,
-                                            server_info[index].hostname,
-                                            fi[index].port_num,
-                                            options.max_connecttime_ms);
+                                    const ServerInfo& si =
+                                        server_info[index];
+                                    final_sock[index] = si.unix_path.empty()
+                                        ? socket_from_address(
+                                            client_num, si.hostname,
+                                            fi[index].port_num, -1,
+                                            si.sockopts, timer.fd())
+                                        : socket_from_unix_path(
+                                            client_num, si.unix_path, -1,
+                                            si.sockopts, timer.fd());
                                     if (final_sock[index] == -1)
                                     {
                                         if ((errno == ETIMEDOUT) ||
                                             (errno == EINPROGRESS))
                                         {
-#if (VERBOSE >= 3)
-                                            std::cerr <<
-                                                my_prefix(client_num) <<
+                                            LOG(3, client_num) <<
                                                 "Note: connect to listener: " <<
-                                                strerror(errno) << std::endl;
-#endif
+                                                strerror(errno);
                                             success = false;
                                             break;
                                         }
@@ -207,27 +581,39 @@ int main(int argc, char* argv[])
                 }
                 if (success)
                 {
-                    handle_clients(
-                        client_num, final_sock, options.max_iotime_ms);
+                    timer.disarm(SessionTimer::connect_deadline);
+                    timer.arm(SessionTimer::session_deadline,
+                        options.max_iotime_ms);
+                    timer.arm(SessionTimer::idle_deadline,
+                        options.max_idletime_ms);
+                    handle_clients(client_num, final_sock, options, timer);
                 }
                 else
                 {
-#if (VERBOSE >= 3)
-                    std::cerr << my_prefix(client_num) <<
+                    LOG(3, client_num) <<
                         "early closing " << final_sock[0] << " " <<
-                        final_sock[1] << std::endl;
-#endif
+                        final_sock[1];
                 }
-#if (VERBOSE >= 2)
-                std::cerr << my_prefix(client_num) <<
+                LOG(2, client_num) <<
                     "End copy loop FD " << final_sock[0] << " <--> FD " <<
-                    final_sock[1] << std::endl;
-#endif
+                    final_sock[1];
             };
         last_thread = std::thread(responder);
         if (repeat) last_thread.detach();
     } while (repeat);
-    last_thread.join();
+    if (handed_off)
+    {
+        // Every relay gives its token back when it ends.
+        LOG(1, 0) << "Handed off. Waiting for relays to end.";
+        for (size_t token = 0 ; token < options.max_clients ; ++token)
+        {
+            clients_limiter.acquire();
+        }
+    }
+    else
+    {
+        last_thread.join();
+    }
 
     }
     catch (const NetutilsException& r)
@@ -235,10 +621,13 @@ int main(int argc, char* argv[])
         std::cerr << my_time() << " " << r.strng << std::endl;
         exit(1);
     }
+    catch (const HandoffException& h)
+    {
+        std::cerr << my_time() << " " << h.strng << std::endl;
+        exit(1);
+    }
 
-#if (VERBOSE >= 2)
-    std::cerr << my_time() << " Normal exit" << std::endl;
-#endif
+    LOG(2, 0) << "Normal exit";
     return 0;
 }
 
@@ -248,8 +637,29 @@ Options process_options(int& argc, char**& argv)
     Options options;
     options.max_cip = default_max_cip;
     options.max_clients = default_max_clients;
+    options.max_port_clients = 0;
+    options.overload_reject = false;
     options.max_iotime_ms = -1;
     options.max_connecttime_ms = default_max_connecttime_ms;
+    options.max_idletime_ms = -1;
+    options.pair_timeout_ms = 0;
+    options.rate_limit = 0;
+    options.global_rate_limit = 0;
+    options.global_limit[0] = nullptr;
+    options.global_limit[1] = nullptr;
+    options.coroutines = false;
+    options.quickack[0] = false;
+    options.quickack[1] = false;
+    options.checksum = false;
+    options.capture_size = (size_t)default_capture_size_mb * 1024 * 1024;
+    options.capture = nullptr;
+    options.spill_budget = (size_t)default_spill_budget_mb * 1024 * 1024;
+    options.spill_pool = nullptr;
+    options.spin_us = 0;
+    options.pin_accept = false;
+    options.pin_relay = false;
+    options.relay_cpus = process_cpus();
+    options.incoming_cpu = false;
 
     while (argc > 2)
     {
@@ -261,15 +671,6 @@ Options process_options(int& argc, char**& argv)
             options.max_cip = mstoi(value);
             argv += 2;
             argc -=2;
-            if (options.max_cip > semaphore_max_max)
-            {
-                 std::cerr << "Sorry, \"-max_cip\" cannot be greater than " <<
-                     semaphore_max_max << "." << std::endl;
-                std::cerr <<
-                    "Recompile program with a larger \"semaphore_max_max\" "
-                        "to correct." << std::endl;
-                exit(1);
-            }
         }
         else if (strcmp(option, "-max_clients") == 0)
         {
@@ -278,16 +679,33 @@ Options process_options(int& argc, char**& argv)
             options.max_clients = mstoi(value);
             argv += 2;
             argc -=2;
-            if (options.max_clients > semaphore_max_max)
+        }
+        else if (strcmp(option, "-max_port_clients") == 0)
+        {
+            if (argc < 1) usage_error();
+            const char* value = argv[1];
+            options.max_port_clients = mstoi(value);
+            argv += 2;
+            argc -=2;
+        }
+        else if (strcmp(option, "-overload") == 0)
+        {
+            if (argc < 1) usage_error();
+            const char* value = argv[1];
+            if (strcmp(value, "reject") == 0)
             {
-                 std::cerr <<
-                     "Sorry, \"-options.max_clients\" cannot be greater than " <<
-                     semaphore_max_max << "." << std::endl;
-                std::cerr <<
-                    "Recompile program with a larger \"semaphore_max_max\" "
-                        "to correct." << std::endl;
-                exit(1);
+                options.overload_reject = true;
             }
+            else if (strcmp(value, "defer") == 0)
+            {
+                options.overload_reject = false;
+            }
+            else
+            {
+                usage_error();
+            }
+            argv += 2;
+            argc -=2;
         }
         else if (strcmp(option, "-max_iotime") == 0)
         {
@@ -299,6 +717,157 @@ Options process_options(int& argc, char**& argv)
             argv += 2;
             argc -=2;
         }
+        else if (strcmp(option, "-pair_timeout") == 0)
+        {
+            if (argc < 1) usage_error();
+            const char* value = argv[1];
+            options.pair_timeout_ms = 1000 * mstoi(value, true);
+            argv += 2;
+            argc -=2;
+        }
+        else if (strcmp(option, "-max_idletime") == 0)
+        {
+            if (argc < 1) usage_error();
+            const char* value = argv[1];
+            options.max_idletime_ms = 1000 * mstoi(value);
+            argv += 2;
+            argc -=2;
+        }
+        else if (strcmp(option, "-verbose") == 0)
+        {
+            if (argc < 1) usage_error();
+            const char* value = argv[1];
+            set_log_level(mstoi(value));
+            argv += 2;
+            argc -=2;
+        }
+        else if (strcmp(option, "-trace") == 0)
+        {
+            if (argc < 1) usage_error();
+            options.trace_path = argv[1];
+            argv += 2;
+            argc -=2;
+        }
+        else if (strcmp(option, "-spill") == 0)
+        {
+            if (argc < 1) usage_error();
+            options.spill_dir = argv[1];
+            argv += 2;
+            argc -=2;
+        }
+        else if (strcmp(option, "-spill_budget") == 0)
+        {
+            if (argc < 1) usage_error();
+            const char* value = argv[1];
+            options.spill_budget = (size_t)mstoi(value) * 1024 * 1024;
+            argv += 2;
+            argc -=2;
+        }
+        else if ((strcmp(option, "-forward_transform") == 0) ||
+            (strcmp(option, "-backward_transform") == 0))
+        {
+            if (argc < 1) usage_error();
+            size_t direction = (option[1] == 'f') ? 0 : 1;
+            options.transform_name[direction] = argv[1];
+            if (!make_transform(argv[1]))
+            {
+                std::cerr << "Sorry, unknown transform \"" << argv[1] <<
+                    "\"." << std::endl;
+                exit(1);
+            }
+            argv += 2;
+            argc -=2;
+        }
+        else if (strcmp(option, "-capture") == 0)
+        {
+            if (argc < 1) usage_error();
+            options.capture_path = argv[1];
+            argv += 2;
+            argc -=2;
+        }
+        else if (strcmp(option, "-capture_size") == 0)
+        {
+            if (argc < 1) usage_error();
+            const char* value = argv[1];
+            options.capture_size = (size_t)mstoi(value) * 1024 * 1024;
+            argv += 2;
+            argc -=2;
+        }
+        else if (strcmp(option, "-coroutines") == 0)
+        {
+            options.coroutines = true;
+            ++argv;
+            --argc;
+        }
+        else if (strcmp(option, "-crc32c") == 0)
+        {
+            options.checksum = true;
+            ++argv;
+            --argc;
+        }
+        else if (strcmp(option, "-rate_limit") == 0)
+        {
+            if (argc < 1) usage_error();
+            const char* value = argv[1];
+            options.rate_limit = mstoi(value);
+            argv += 2;
+            argc -=2;
+        }
+        else if (strcmp(option, "-global_rate_limit") == 0)
+        {
+            if (argc < 1) usage_error();
+            const char* value = argv[1];
+            options.global_rate_limit = mstoi(value);
+            argv += 2;
+            argc -=2;
+        }
+        else if ((strcmp(option, "-accept_cpus") == 0) ||
+                 (strcmp(option, "-relay_cpus") == 0))
+        {
+            if (argc < 1) usage_error();
+            const char* value = argv[1];
+            bool accept = (option[1] == 'a');
+            cpu_set_t& cpus =
+                accept ? options.accept_cpus : options.relay_cpus;
+            if (!parse_cpu_list(value, cpus)) usage_error();
+            cpu_set_t allowed = process_cpus();
+            CPU_AND(&cpus, &cpus, &allowed);
+            if (CPU_COUNT(&cpus) == 0)
+            {
+                std::cerr << "Sorry, \"" << option << " " << value <<
+                    "\" names no CPU that this process may use." <<
+                    std::endl;
+                exit(1);
+            }
+            (accept ? options.pin_accept : options.pin_relay) = true;
+            argv += 2;
+            argc -=2;
+        }
+        else if ((strcmp(option, "-handoff_path") == 0) ||
+                 (strcmp(option, "-takeover") == 0))
+        {
+            if (argc < 1) usage_error();
+            const char* value = argv[1];
+            ((option[1] == 'h') ? options.handoff_path :
+                options.takeover_path) = value;
+            argv += 2;
+            argc -=2;
+        }
+        else if (strcmp(option, "-incoming_cpu") == 0)
+        {
+            options.incoming_cpu = true;
+            options.pin_relay = true;
+            ++argv;
+            --argc;
+        }
+        else if (strcmp(option, "-spin") == 0)
+        {
+            if (argc < 1) usage_error();
+            const char* value = argv[1];
+            options.spin_us = mstoi(value, true);
+            argv += 2;
+            argc -=2;
+        }
         else
         {
             break;
@@ -314,6 +883,24 @@ void usage_error()
         ")] [-max_cip nnn(" << default_max_cip <<
         ")] [-max_iotime nnn(lots)] " <<
         std::endl;
+    std::cerr << "    [-max_port_clients nnn] [-overload defer|reject(defer)]" <<
+        std::endl;
+    std::cerr << "    [-pair_timeout nnn(lots)]" << std::endl;
+    std::cerr << "    [-max_idletime nnn(lots)] [-coroutines] [-verbose n(" <<
+        default_log_level << ")]" << std::endl;
+    std::cerr << "    [-rate_limit bytes_per_sec] "
+        "[-global_rate_limit bytes_per_sec]" << std::endl;
+    std::cerr << "    [-trace file.json] [-spill directory [-spill_budget mb(" <<
+        default_spill_budget_mb << ")]]" << std::endl;
+    std::cerr << "    [-forward_transform transform] "
+        "[-backward_transform transform]" << std::endl;
+    std::cerr << "with transform count|deflate[=level]|inflate" << std::endl;
+    std::cerr << "    [-crc32c] [-capture file [-capture_size mb(" <<
+        default_capture_size_mb << ")]]" << std::endl;
+    std::cerr << "    [-spin usec(0)] [-accept_cpus list] [-relay_cpus list] "
+        "[-incoming_cpu]" << std::endl;
+    std::cerr << "with list like 0-3,8,10-11" << std::endl;
+    std::cerr << "    [-handoff_path path] [-takeover path]" << std::endl;
     std::cerr << "    <first_spec> <second_spec>" << std::endl;
     std::cerr << "Each of <first_spec> and <second_spec> can be one of" <<
         std::endl;
@@ -322,40 +909,188 @@ void usage_error()
     std::cerr << "    -listen <address>:<port_number,port_number,...>" <<
         std::endl;
     std::cerr << "    -connect <hostname>:<port_number>" << std::endl;
+    std::cerr << "    -listen_unix <path>" << std::endl;
+    std::cerr << "    -connect_unix <path>" << std::endl;
+    std::cerr << "    -zero | -random" << std::endl;
+    std::cerr << "A path starting with '@' is in the abstract namespace." <<
+        std::endl;
+    std::cerr << "-zero and -random read endless bytes, and discard what is "
+        "written." << std::endl;
+    std::cerr << "Each network spec can be followed by" << std::endl;
+    std::cerr << "    -sockopt <option,option,...>" << std::endl;
+    std::cerr << "with options nodelay[=0|1] quickack[=0|1] rcvbuf=nnn " <<
+        "sndbuf=nnn rcvlowat=nnn" << std::endl;
+    std::cerr << "    notsent_lowat=nnn user_timeout=msec fastopen[=nnn]" <<
+        std::endl;
+    std::cerr << "    busy_poll=usec prefer_busy_poll[=0|1]" << std::endl;
     exit (1);
 }
 
+// Waits on handoff for a new process, and gives it the listening sockets.
+// Then makes eventFD readable, so that this process stops accepting.
+void serve_handoff(Listener* handoff, std::vector<int> fds, int eventFD)
+{
+    while (true)
+    {
+        Listener::SocketInfo info = handoff->get_client(0);
+        try
+        {
+            handoff_give(info.socketFD, fds);
+            close(info.socketFD);
+            break;
+        }
+        catch (const HandoffException& h)
+        {
+            LOG(1, 0) << h.strng;
+            close(info.socketFD);
+        }
+    }
+    // handoff is never destroyed: the new process may already have bound
+    // the same path for its own successor.
+    LOG(1, 0) << "gave " << fds.size() << " listening sockets";
+    uint64_t one = 1;
+    NEGCHECK("eventfd", write(eventFD, &one, sizeof(one)));
+}
+
+// Takes a client slot and a slot on each of the client's ports, or none
+bool try_admit(AdmissionController& clients_limiter,
+    AdmissionController* const port_limiter[2])
+{
+    if (!clients_limiter.try_acquire()) return false;
+    for (size_t index = 0 ; index < 2 ; ++index)
+    {
+        if (port_limiter[index] && !port_limiter[index]->try_acquire())
+        {
+            if (index && port_limiter[0]) port_limiter[0]->release();
+            clients_limiter.release();
+            return false;
+        }
+    }
+    return true;
+}
+
+// Closes with a reset, so that the client learns at once, and nothing is
+// left in TIME_WAIT.
+void reject_client(unsigned client_num, int socketFD)
+{
+    struct linger lng{1, 0};
+    setsockopt(socketFD, SOL_SOCKET, SO_LINGER, &lng, sizeof(lng));
+    close(socketFD);
+    counter_add(counter_admission_rejects);
+    LOG(2, client_num) << "rejected, overloaded";
+}
+
+// Moves a relay thread onto the CPU that processes its accepted socket,
+// if that is one of the relay CPUs, or else onto the relay CPUs.
+void place_relay(unsigned client_num,
+    const ServerInfo server_info[2],
+    const ByValue<Listener::SocketInfo,2>& fi, const Options& options)
+{
+    if (options.incoming_cpu)
+    {
+        for (size_t index = 0 ; index < 2 ; ++index)
+        {
+            if (!server_info[index].listening()) continue;
+            int cpu = incoming_cpu(fi[index].socketFD);
+            if ((cpu >= 0) && CPU_ISSET(cpu, &options.relay_cpus))
+            {
+                LOG(3, client_num) << "relaying on CPU " << cpu;
+                pin_thread(cpu);
+                return;
+            }
+        }
+    }
+    pin_thread(options.relay_cpus);
+}
+
 void handle_clients(
-    unsigned client_num, const int sck[2], int max_iotime_ms)
+    unsigned client_num, const int sck[2], const Options& options,
+    SessionTimer& timer)
 {
-#if (VERBOSE >= 1)
-    my_prefix mp(client_num);
-#endif
-#if (VERBOSE >= 2)
-    std::cerr << mp << "Begin copy loop FD " << sck[0] <<
-        " <--> FD " << sck[1] << std::endl;
-#endif
+    LOG(2, client_num) << "Begin copy loop FD " << sck[0] <<
+        " <--> FD " << sck[1];
 
     try
     {
-#if (VERBOSE >= 3)
         iopackage_stats stats[2];
-#else
-        iopackage_stats* stats(nullptr);
-#endif
-        copyfd2<BUFFER_SIZE>(sck[0], sck[1], max_iotime_ms, stats);
-#if (VERBOSE >= 3)
-        std::cerr << mp << "FD " << sck[0] << " --> FD " << sck[1] <<
+        // Rate limits for this client, one for each direction
+        std::unique_ptr<TokenBucket> limit[2];
+        // Overflow for a slow writer, one for each direction
+        std::unique_ptr<SpillLog> spill[2];
+        std::unique_ptr<Transform> transform[2];
+        iopackage_options opts[2];
+        for (size_t index = 0 ; index < 2 ; ++index)
+        {
+            if (options.spill_pool)
+            {
+                spill[index] = std::make_unique<SpillLog>(
+                    options.spill_dir, *options.spill_pool,
+                    std::min(SpillLog::default_segment_size,
+                        options.spill_budget));
+                opts[index].spill = spill[index].get();
+            }
+            if (options.rate_limit)
+            {
+                limit[index] = std::make_unique<TokenBucket>(
+                    options.rate_limit,
+                    options.rate_limit * rate_limit_burst_ms / 1000);
+                opts[index].connection_limit = limit[index].get();
+            }
+            if (!options.transform_name[index].empty())
+            {
+                transform[index] =
+                    make_transform(options.transform_name[index]);
+                opts[index].transform = transform[index].get();
+            }
+            opts[index].checksum = options.checksum;
+            opts[index].capture = options.capture;
+            opts[index].capture_direction = index;
+            opts[index].global_limit = options.global_limit[index];
+            opts[index].trace_id = client_num;
+            opts[index].spin_us = options.spin_us;
+            opts[index].quickack = options.quickack[index];
+        }
+        if (options.capture) options.capture->open(client_num);
+        copyfd2<BUFFER_SIZE>(sck[0], sck[1], &timer, stats, opts);
+        if (timer.expired())
+        {
+            LOG(3, client_num) << "Note: time limit reached";
+        }
+        LOG(3, client_num) << "FD " << sck[0] << " --> FD " << sck[1] <<
             ": " <<
             stats[0].bytes_copied << " bytes, " <<
             stats[0].reads << " reads, " <<
-            stats[0].writes << " writes." << std::endl;
-        std::cerr << mp << "FD " << sck[1] << " --> FD " << sck[0] <<
+            stats[0].writes << " writes, " <<
+            stats[0].bytes_spilled << " bytes spilled.";
+        LOG(3, client_num) << "FD " << sck[1] << " --> FD " << sck[0] <<
             ": " <<
             stats[1].bytes_copied << " bytes, " <<
             stats[1].reads << " reads, " <<
-            stats[1].writes << " writes." << std::endl;
-#endif
+            stats[1].writes << " writes, " <<
+            stats[1].bytes_spilled << " bytes spilled.";
+        if (options.spin_us)
+        {
+            LOG(3, client_num) << "spun " << stats[0].spin_ns / 1000 <<
+                " us, blocked " << stats[0].blocked_ns / 1000 << " us";
+        }
+        if (options.checksum)
+        {
+            LOG(3, client_num) << "CRC32C " <<
+                crc32c_string(stats[0].crc32c) << " forward, " <<
+                crc32c_string(stats[1].crc32c) << " backward (" <<
+                crc32c_method() << ")";
+        }
+        for (size_t index = 0 ; index < 2 ; ++index)
+        {
+            if (transform[index])
+            {
+                LOG(3, client_num) << transform[index]->report();
+            }
+        }
+    }
+    catch (const TransformException& t)
+    {
+        LOG(3, client_num) << "Transform failure: " << t.strng;
     }
     catch (const IOPackageReadException& r)
     {
@@ -367,10 +1102,8 @@ void handle_clients(
                 strerror(ECONNREFUSED) << std::endl;
             exit(1);
         }
-#if (VERBOSE >= 3)
-        std::cerr << mp << "Read failure after " << r.byte_count <<
-            " bytes: " << strerror(r.errn) << std::endl;
-#endif
+        LOG(3, client_num) << "Read failure after " << r.byte_count <<
+            " bytes: " << strerror(r.errn);
     }
     catch (const IOPackageWriteException& w)
     {
@@ -380,14 +1113,154 @@ void handle_clients(
                 strerror(ECONNREFUSED) << std::endl;
             exit(1);
         }
-#if (VERBOSE >= 3)
-        std::cerr << mp << "Write failure after " << w.byte_count <<
-            " bytes: " << strerror(w.errn) << std::endl;
-#endif
+        LOG(3, client_num) << "Write failure after " << w.byte_count <<
+            " bytes: " << strerror(w.errn);
     }
-#if (VERBOSE >= 3)
-    std::cerr << mp << "closing FD " << sck[0] << " FD " << sck[1] << std::endl;
-#endif
+    if (options.capture) options.capture->close(client_num);
+    LOG(3, client_num) << "closing FD " << sck[0] << " FD " << sck[1];
+}
+
+// -max_clients and -max_cip for the coroutines, which all run on one
+// thread. An acceptor that finds either limit reached sleeps until a
+// client ends or finishes connecting.
+struct CoAdmission
+{
+    CoAdmission(CoScheduler& sch, size_t clients, size_t cip)
+        : sched(sch), max_clients(clients), max_cip(cip) { }
+    bool full() const {
+        return (clients >= max_clients) || (connecting >= max_cip); }
+    void connected() { --connecting; wake_all(); }
+    void ended() { --clients; wake_all(); }
+    void wake_all()
+    {
+        for (std::coroutine_handle<>* acceptor : waiting)
+        {
+            sched.wake(acceptor);
+        }
+        waiting.clear();
+    }
+
+    CoScheduler& sched;
+    size_t max_clients;
+    size_t max_cip;
+    size_t clients{0};
+    size_t connecting{0};
+    std::vector<std::coroutine_handle<>*> waiting;
+};
+
+// Connects one client, then relays it with co_relay()
+static CoTask co_client(
+    CoScheduler& sched, unsigned client_num, int clientFD,
+    const ServerInfo& server, int connect_ms, CoAdmission& admission)
+{
+    bool in_progress;
+    int serverFD = socket_connect_start(client_num,
+        server.hostname, server.port_num, server.unix_path, server.sockopts,
+        in_progress);
+    TRACE(connect_start, client_num, serverFD, server.port_num);
+    if ((serverFD != -1) && in_progress)
+    {
+        // As in thread mode, -1 waits without end.
+        std::unique_ptr<CoDeadline> deadline;
+        if (connect_ms != -1)
+        {
+            deadline = std::make_unique<CoDeadline>(sched, serverFD,
+                CoScheduler::Clock::now() +
+                std::chrono::milliseconds(connect_ms));
+        }
+        bool connected = co_await sched.writable(serverFD);
+        if (deadline) deadline->disarm();
+        int err = ETIMEDOUT;
+        socklen_t len = sizeof(err);
+        if (connected)
+        {
+            NEGCHECK("getsockopt",
+                getsockopt(serverFD, SOL_SOCKET, SO_ERROR, &err, &len));
+        }
+        TRACE(connect_finish, client_num, serverFD, err);
+        if (err)
+        {
+            counter_add(counter_connect_failures);
+            close(serverFD);
+            serverFD = -1;
+            errno = err;
+        }
+    }
+    admission.connected();
+    if (serverFD == -1)
+    {
+        LOG(3, client_num) <<
+            "Note: connect to listener: " << strerror(errno);
+        shutdown(clientFD, SHUT_RDWR);
+        close(clientFD);
+        admission.ended();
+        co_return;
+    }
+    LOG(2, client_num) << "Begin copy loop FD " <<
+        clientFD << " <--> FD " << serverFD;
+    co_relay(sched, clientFD, serverFD, BUFFER_SIZE,
+        [client_num, clientFD, serverFD, &admission] (
+            const iopackage_stats stats[2])
+        {
+            admission.ended();
+            LOG(3, client_num) << "FD " << clientFD <<
+                " --> FD " << serverFD << ": " <<
+                stats[0].bytes_copied << " bytes, " <<
+                stats[0].reads << " reads, " <<
+                stats[0].writes << " writes.";
+            LOG(3, client_num) << "FD " << serverFD <<
+                " --> FD " << clientFD << ": " <<
+                stats[1].bytes_copied << " bytes, " <<
+                stats[1].reads << " reads, " <<
+                stats[1].writes << " writes.";
+            LOG(2, client_num) << "End copy loop FD " <<
+                clientFD << " <--> FD " << serverFD;
+        }, client_num);
+}
+
+// Accepts clients on one listening socket, forever
+static CoTask co_accept(
+    CoScheduler& sched, Listener& listener, size_t index,
+    const ServerInfo& server, int connect_ms, CoAdmission& admission,
+    unsigned& client_num)
+{
+    std::coroutine_handle<> handle;
+    while (true)
+    {
+        if (admission.full())
+        {
+            // Clients wait in the listen backlog, as in thread mode.
+            admission.waiting.push_back(&handle);
+            co_await sched.sleep_until(
+                CoScheduler::Clock::time_point::max(), &handle);
+            continue;
+        }
+        Listener::SocketInfo info;
+        if (!listener.accept_client(index, client_num + 1, info))
+        {
+            co_await sched.readable(listener.fd(index));
+            continue;
+        }
+        ++client_num;
+        ++admission.clients;
+        ++admission.connecting;
+        sched.spawn(co_client(sched, client_num, info.socketFD, server,
+            connect_ms, admission));
+    }
+}
+
+void run_coroutines(const ServerInfo server_info[2], const Options& options)
+{
+    CoScheduler sched;
+    CoAdmission admission(sched, options.max_clients, options.max_cip);
+    unsigned client_num{0};
+    Listener& listener = *server_info[0].listener;
+    for (size_t index = 0 ; index < listener.size() ; ++index)
+    {
+        sched.spawn(co_accept(sched, listener, index, server_info[1],
+            options.max_connecttime_ms, admission, client_num));
+    }
+    sched.run();
 }
 
 #include "copyfd.tcc"
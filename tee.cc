@@ -0,0 +1,247 @@
+#include "tee.h"
+#include "counters.h"
+#include "iopackage.h"
+#include "logger.h"
+#include "miscutils.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+//////////////////////////
+// TeeRing class methods //
+//////////////////////////
+
+TeeRing::TeeRing(size_t capacity, size_t cursors)
+    : _capacity(capacity), store(new unsigned char[capacity]),
+      popped(cursors, 0), is_active(cursors, true) { }
+
+size_t TeeRing::inquire(uint64_t from, size_t count,
+    size_t& available1, unsigned char*& start1,
+    size_t& available2, unsigned char*& start2) const
+{
+    size_t offset = from % _capacity;
+    available1 = std::min(count, _capacity - offset);
+    available2 = count - available1;
+    start1 = available1 ? store.get() + offset : nullptr;
+    start2 = available2 ? store.get() : nullptr;
+    return (available1 ? 1 : 0) + (available2 ? 1 : 0);
+}
+
+size_t TeeRing::pushInquire(size_t& available1, unsigned char*& start1,
+    size_t& available2, unsigned char*& start2) const
+{
+    return inquire(pushed, _capacity - size(),
+        available1, start1, available2, start2);
+}
+
+void TeeRing::push(size_t newContent)
+{
+    pushed += newContent;
+}
+
+size_t TeeRing::popInquire(size_t cursor,
+    size_t& available1, unsigned char*& start1,
+    size_t& available2, unsigned char*& start2) const
+{
+    return inquire(popped[cursor], lag(cursor),
+        available1, start1, available2, start2);
+}
+
+void TeeRing::pop(size_t cursor, size_t oldContent)
+{
+    bool was_oldest = (popped[cursor] == oldest);
+    popped[cursor] += oldContent;
+    if (was_oldest) reclaim();
+}
+
+size_t TeeRing::skip(size_t cursor)
+{
+    size_t passed = lag(cursor);
+    popped[cursor] = pushed;
+    reclaim();
+    return passed;
+}
+
+void TeeRing::remove(size_t cursor)
+{
+    is_active[cursor] = false;
+    reclaim();
+}
+
+// Once per pop of the slowest cursor: a linear scan suits a few dozen
+// outputs.
+void TeeRing::reclaim()
+{
+    uint64_t least = pushed;
+    for (size_t index = 0 ; index < popped.size() ; ++index)
+    {
+        if (is_active[index]) least = std::min(least, popped[index]);
+    }
+    oldest = least;
+}
+
+////////////////
+// copyfd_tee //
+////////////////
+
+tee_stats copyfd_tee(int readfd, const std::vector<int>& writefds,
+    tee_policy policy, size_t ring_size)
+{
+    size_t outputs = writefds.size();
+    TeeRing ring(ring_size, outputs);
+    tee_stats stats;
+    stats.bytes_read = 0;
+    stats.bytes_written.assign(outputs, 0);
+    stats.bytes_skipped.assign(outputs, 0);
+    stats.errn.assign(outputs, 0);
+    // Input, then the outputs
+    std::vector<pollfd> pfd(outputs + 1);
+    size_t remaining = outputs;
+    bool eof = false;
+    bool input_waiting = false;
+
+    while (remaining)
+    {
+        bool progress = false;
+        for (pollfd& p : pfd) p.events = 0;
+
+        // Read
+        if (!eof)
+        {
+            size_t avail1, avail2;
+            unsigned char* start1;
+            unsigned char* start2;
+            size_t nseg = ring.pushInquire(avail1, start1, avail2, start2);
+            if ((nseg == 0) && input_waiting && (policy != tee_policy::block))
+            {
+                // Full, and input is waiting: the laggards give way.
+                for (size_t index = 0 ; index < outputs ; ++index)
+                {
+                    if (!ring.active(index) ||
+                        (ring.lag(index) < ring.capacity()))
+                    {
+                        continue;
+                    }
+                    if (policy == tee_policy::skip)
+                    {
+                        stats.bytes_skipped[index] += ring.skip(index);
+                        LOG(4, 0) << "Output FD " << writefds[index] <<
+                            " skipped ahead";
+                    }
+                    else
+                    {
+                        ring.remove(index);
+                        shutdown(writefds[index], SHUT_RDWR);
+                        stats.errn[index] = -1;
+                        --remaining;
+                        LOG(3, 0) << "Output FD " << writefds[index] <<
+                            " disconnected for lagging";
+                    }
+                }
+                progress = true;
+                nseg = ring.pushInquire(avail1, start1, avail2, start2);
+            }
+            input_waiting = false;
+            if (nseg)
+            {
+                struct iovec vec[2] = {{start1, avail1}, {start2, avail2}};
+                ssize_t bytes_read = readv(readfd, vec, nseg);
+                if (bytes_read < 0)
+                {
+                    if ((errno == EWOULDBLOCK) || (errno == EAGAIN))
+                    {
+                        pfd[0].events = POLLIN;
+                        counter_add(counter_eagains);
+                    }
+                    else
+                    {
+                        counter_error(errno);
+                        IOPackageReadException r(errno, stats.bytes_read);
+                        throw(r);
+                    }
+                }
+                else if (bytes_read == 0)
+                {
+                    eof = true;
+                    progress = true;
+                }
+                else
+                {
+                    ring.push(bytes_read);
+                    stats.bytes_read += bytes_read;
+                    counter_add(counter_reads);
+                    progress = true;
+                }
+            }
+            else if (policy != tee_policy::block)
+            {
+                // Full. Wake up if input arrives, to apply the policy.
+                pfd[0].events = POLLIN;
+            }
+        }
+
+        // Write, to each output that is behind
+        for (size_t index = 0 ; index < outputs ; ++index)
+        {
+            if (!ring.active(index)) continue;
+            size_t avail1, avail2;
+            unsigned char* start1;
+            unsigned char* start2;
+            size_t nseg =
+                ring.popInquire(index, avail1, start1, avail2, start2);
+            if (nseg == 0) continue;
+            struct iovec vec[2] = {{start1, avail1}, {start2, avail2}};
+            ssize_t bytes_write = writev(writefds[index], vec, nseg);
+            if (bytes_write > 0)
+            {
+                ring.pop(index, bytes_write);
+                stats.bytes_written[index] += bytes_write;
+                counter_add(counter_writes);
+                counter_add(counter_bytes, bytes_write);
+                progress = true;
+            }
+            else if ((bytes_write < 0) &&
+                ((errno == EWOULDBLOCK) || (errno == EAGAIN)))
+            {
+                pfd[index + 1].events = POLLOUT;
+                counter_add(counter_eagains);
+            }
+            else
+            {
+                // This output is gone. The others go on.
+                int ern = (bytes_write < 0) ? errno : EPIPE;
+                counter_error(ern);
+                ring.remove(index);
+                stats.errn[index] = ern;
+                --remaining;
+                progress = true;
+                LOG(3, 0) << "Output FD " << writefds[index] <<
+                    " failed after " << stats.bytes_written[index] <<
+                    " bytes: " << strerror(ern);
+            }
+        }
+
+        if (eof && (ring.size() == 0)) break;
+
+        if (!progress)
+        {
+            // poll() ignores negative descriptors, so that an idle output
+            // that has hung up does not wake us.
+            pfd[0].fd = pfd[0].events ? readfd : -1;
+            for (size_t index = 0 ; index < outputs ; ++index)
+            {
+                pfd[index + 1].fd =
+                    pfd[index + 1].events ? writefds[index] : -1;
+            }
+            NEGCHECK("poll", poll(pfd.data(), pfd.size(), -1));
+            counter_add(counter_polls);
+            input_waiting = (pfd[0].revents != 0);
+        }
+    }
+    return stats;
+}
@@ -0,0 +1,79 @@
+#ifndef __TEE_H_
+#define __TEE_H_
+
+// Fan-out: one input read once into a shared ring, and copied to several
+// outputs, each through a cursor of its own. Space is reclaimed as the
+// slowest cursor advances.
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// What to do with an output that holds the ring full while input waits
+enum class tee_policy
+{
+    block,       // Stop reading until it catches up
+    skip,        // Drop what it has not sent, and go on from the newest data
+    disconnect   // Shut it down, and go on without it
+};
+
+// A ring with one producer and many consumers. Not thread safe.
+class TeeRing
+{
+public:
+    TeeRing(size_t capacity, size_t cursors);
+    TeeRing(const TeeRing&) = delete;
+    TeeRing& operator=(const TeeRing&) = delete;
+
+    // The producer, with the interface of RingbufRbase
+    size_t pushInquire(size_t& available1, unsigned char*& start1,
+        size_t& available2, unsigned char*& start2) const;
+    void push(size_t newContent);
+    // Each consumer
+    size_t popInquire(size_t cursor, size_t& available1, unsigned char*& start1,
+        size_t& available2, unsigned char*& start2) const;
+    void pop(size_t cursor, size_t oldContent);
+
+    // Bytes not yet consumed by cursor
+    size_t lag(size_t cursor) const { return pushed - popped[cursor]; }
+    // Moves cursor to the newest data. Returns the bytes it passed over.
+    size_t skip(size_t cursor);
+    // The cursor no longer holds space
+    void remove(size_t cursor);
+    bool active(size_t cursor) const { return is_active[cursor]; }
+
+    size_t size() const { return pushed - oldest; }
+    size_t capacity() const { return _capacity; }
+
+private:
+    void reclaim();
+    size_t inquire(uint64_t from, size_t count, size_t& available1,
+        unsigned char*& start1, size_t& available2,
+        unsigned char*& start2) const;
+
+    const size_t _capacity;
+    std::unique_ptr<unsigned char[]> store;
+    uint64_t pushed{0};       // Bytes ever pushed
+    uint64_t oldest{0};       // Least of popped[], over active cursors
+    std::vector<uint64_t> popped;
+    std::vector<bool> is_active;
+};
+
+struct tee_stats
+{
+    size_t bytes_read;
+    // For each output
+    std::vector<size_t> bytes_written;
+    std::vector<size_t> bytes_skipped;
+    std::vector<int> errn;    // Why it was dropped: errno, -1 for the policy
+};
+
+// Copies readfd to every one of writefds, which are non-blocking, until
+// end of input or until no output is left. An output that fails is
+// dropped, and the others go on. Failure to read throws
+// IOPackageReadException.
+tee_stats copyfd_tee(int readfd, const std::vector<int>& writefds,
+    tee_policy policy, size_t ring_size);
+
+#endif // __TEE_H_
@@ -0,0 +1,397 @@
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "coroutine.h"
+#include "miscutils.h"
+
+using namespace std::chrono_literals;
+using Clock = CoScheduler::Clock;
+
+// Tuning
+static const size_t ring_capacity = 1000;
+static const size_t ring_stream_size = 1024 * 1024;
+static const size_t relay_ring_size = 16 * 1024;
+static const size_t forward_size = 4 * 1024 * 1024;
+static const size_t backward_size = 1024 * 1024;
+static const auto deadline = 100ms;
+// Far enough that a lingering watchdog shows
+static const auto late_deadline = 10s;
+
+static void Usage_exit (int exit_val);
+
+// Deterministic bytes, so that a failure repeats
+static unsigned char next_byte(uint32_t& state)
+{
+    state = state * 1664525 + 1013904223;
+    return state >> 24;
+}
+
+static size_t my_rand(size_t lower, size_t upper)
+{
+    if (lower == upper) return lower;
+    return lower + rand() % (upper - lower);
+}
+
+static double ms_since(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(
+        Clock::now() - start).count();
+}
+
+static CoTask sleeper(CoScheduler& sched, std::chrono::milliseconds ms,
+    std::vector<int>& order)
+{
+    co_await sched.sleep_until(Clock::now() + ms);
+    order.push_back(ms.count());
+}
+
+static CoTask woken_sleeper(CoScheduler& sched,
+    std::coroutine_handle<>& handle, bool& slept)
+{
+    slept = co_await sched.sleep_until(Clock::now() + late_deadline, &handle);
+}
+
+static CoTask waker(CoScheduler& sched, std::coroutine_handle<>& handle)
+{
+    co_await sched.sleep_until(Clock::now() + 10ms);
+    sched.wake(&handle);
+}
+
+// Sleepers wake soonest first, whatever their order of arrival, and a
+// woken sleeper learns that it was woken.
+static void sleep_order()
+{
+    CoScheduler sched;
+    std::vector<int> order;
+    for (int ms : {30, 10, 20})
+    {
+        sched.spawn(sleeper(sched, std::chrono::milliseconds(ms), order));
+    }
+    std::coroutine_handle<> handle;
+    bool slept = true;
+    sched.spawn(woken_sleeper(sched, handle, slept));
+    sched.spawn(waker(sched, handle));
+    auto start = Clock::now();
+    sched.run();
+    if (order != std::vector<int>{10, 20, 30})
+    {
+        std::cerr << "DEFECT: sleepers woke out of order" << std::endl;
+        exit(1);
+    }
+    if (slept || (ms_since(start) > 1000))
+    {
+        std::cerr << "DEFECT: wake() did not end a sleep" << std::endl;
+        exit(1);
+    }
+    assert(sched.tasks() == 0);
+    std::cout << "sleep order: " << ms_since(start) << " ms" << std::endl;
+}
+
+static CoTask ring_producer(CoRing<unsigned char>& ring)
+{
+    uint32_t state = 1;
+    size_t pushed = 0;
+    while (pushed < ring_stream_size)
+    {
+        size_t want = std::min(my_rand(1, ring_capacity / 2),
+            ring_stream_size - pushed);
+        auto seg = co_await ring.space(want);
+        assert(seg.total() >= want);
+        for (size_t index = 0 ; index < want ; ++index)
+        {
+            unsigned char byte = next_byte(state);
+            if (index < seg.available1)
+            {
+                seg.start1[index] = byte;
+            }
+            else
+            {
+                seg.start2[index - seg.available1] = byte;
+            }
+        }
+        ring.push(want);
+        pushed += want;
+    }
+    ring.close();
+}
+
+static CoTask ring_consumer(CoRing<unsigned char>& ring, size_t& popped)
+{
+    uint32_t state = 1;
+    while (true)
+    {
+        auto seg = co_await ring.data(my_rand(1, ring_capacity / 2));
+        // Closed and empty
+        if (seg.nseg == 0) break;
+        size_t count = seg.total();
+        for (size_t index = 0 ; index < count ; ++index)
+        {
+            unsigned char byte = (index < seg.available1) ?
+                seg.start1[index] : seg.start2[index - seg.available1];
+            if (byte != next_byte(state))
+            {
+                std::cerr << "DEFECT: CoRing byte " << popped + index <<
+                    " differs" << std::endl;
+                exit(1);
+            }
+        }
+        ring.pop(count);
+        popped += count;
+    }
+}
+
+// A stream through a small CoRing, in chunks of random sizes on both
+// sides, arrives whole and in order. Neither side asks for more than half
+// the ring, or both could wait on each other.
+static void ring_stream()
+{
+    CoScheduler sched;
+    CoRing<unsigned char> ring(sched, ring_capacity);
+    size_t popped = 0;
+    sched.spawn(ring_consumer(ring, popped));
+    sched.spawn(ring_producer(ring));
+    sched.run();
+    if (popped != ring_stream_size)
+    {
+        std::cerr << "DEFECT: CoRing delivered " << popped << " of " <<
+            ring_stream_size << " bytes" << std::endl;
+        exit(1);
+    }
+    std::cout << "ring stream: " << popped << " bytes through " <<
+        ring_capacity << std::endl;
+}
+
+static CoTask deadline_waiter(CoScheduler& sched, int fd,
+    Clock::duration after, bool& readable, bool& expired)
+{
+    CoDeadline deadline(sched, fd, Clock::now() + after);
+    readable = co_await sched.readable(fd);
+    deadline.disarm();
+    expired = deadline.expired();
+}
+
+static CoTask pipe_writer(CoScheduler& sched, int fd)
+{
+    co_await sched.sleep_until(Clock::now() + 10ms);
+    NEGCHECK("write", write(fd, "x", 1));
+}
+
+// A CoDeadline ends a wait that nothing else would, as for a connect to
+// a host that never answers. Disarmed, it leaves nothing behind.
+static void connect_deadline()
+{
+    int pipeFD[2];
+    NEGCHECK("pipe", pipe2(pipeFD, O_NONBLOCK));
+    {
+        CoScheduler sched;
+        bool readable = true;
+        bool expired = false;
+        auto start = Clock::now();
+        sched.spawn(deadline_waiter(sched, pipeFD[0], deadline, readable,
+            expired));
+        sched.run();
+        double elapsed = ms_since(start);
+        if (readable || !expired || (elapsed < deadline.count()))
+        {
+            std::cerr << "DEFECT: wait not ended at its deadline, after " <<
+                elapsed << " ms" << std::endl;
+            exit(1);
+        }
+        std::cout << "deadline: expired after " << elapsed << " ms" <<
+            std::endl;
+    }
+    {
+        CoScheduler sched;
+        bool readable = false;
+        bool expired = true;
+        auto start = Clock::now();
+        sched.spawn(deadline_waiter(sched, pipeFD[0], late_deadline,
+            readable, expired));
+        sched.spawn(pipe_writer(sched, pipeFD[1]));
+        sched.run();
+        double elapsed = ms_since(start);
+        if (!readable || expired || (elapsed > 1000))
+        {
+            std::cerr << "DEFECT: disarmed deadline lingered for " <<
+                elapsed << " ms" << std::endl;
+            exit(1);
+        }
+        std::cout << "deadline: disarmed after " << elapsed << " ms" <<
+            std::endl;
+    }
+    close(pipeFD[0]);
+    close(pipeFD[1]);
+}
+
+// A connected TCP pair over the loopback interface, both ends nonblocking
+static void loopback_pair(int& clientFD, int& serverFD)
+{
+    int listenFD;
+    NEGCHECK("socket", (listenFD = socket(AF_INET, SOCK_STREAM, 0)));
+    sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(sa);
+    NEGCHECK("bind", bind(listenFD, (sockaddr*)&sa, len));
+    NEGCHECK("listen", listen(listenFD, 1));
+    NEGCHECK("getsockname", getsockname(listenFD, (sockaddr*)&sa, &len));
+    NEGCHECK("socket", (clientFD = socket(AF_INET, SOCK_STREAM, 0)));
+    NEGCHECK("connect", connect(clientFD, (sockaddr*)&sa, len));
+    NEGCHECK("accept", (serverFD = accept(listenFD, nullptr, nullptr)));
+    close(listenFD);
+    set_flags(clientFD, O_NONBLOCK);
+    set_flags(serverFD, O_NONBLOCK);
+}
+
+// One direction of the relayed traffic: count bytes of the stream that
+// seed starts
+class Traffic
+{
+public:
+    Traffic(uint32_t seed, size_t count) : state(seed), _count(count) { }
+    bool finished() const { return _done == _count; }
+
+    // Writes what the socket takes. false: it took nothing, wait.
+    bool send(int fd)
+    {
+        unsigned char buf[8192];
+        size_t chunk = std::min(sizeof(buf), _count - _done);
+        uint32_t next = state;
+        for (size_t index = 0 ; index < chunk ; ++index)
+        {
+            buf[index] = next_byte(next);
+        }
+        ssize_t bytes = write(fd, buf, chunk);
+        if ((bytes < 0) && (errno == EAGAIN)) return false;
+        NEGCHECK("write", bytes);
+        // Only the bytes that went
+        for (ssize_t index = 0 ; index < bytes ; ++index) next_byte(state);
+        _done += bytes;
+        return true;
+    }
+    // Reads and checks what has arrived. false: nothing yet, wait. At end
+    // of input, the whole stream must have arrived.
+    bool receive(int fd, bool& eof)
+    {
+        unsigned char buf[8192];
+        ssize_t bytes = read(fd, buf, sizeof(buf));
+        if ((bytes < 0) && (errno == EAGAIN)) return false;
+        NEGCHECK("read", bytes);
+        for (ssize_t index = 0 ; index < bytes ; ++index)
+        {
+            if ((_done + index >= _count) || (buf[index] != next_byte(state)))
+            {
+                std::cerr << "DEFECT: relayed byte " << _done + index <<
+                    " differs" << std::endl;
+                exit(1);
+            }
+        }
+        _done += bytes;
+        eof = (bytes == 0);
+        if (eof && !finished())
+        {
+            std::cerr << "DEFECT: relayed " << _done << " of " << _count <<
+                " bytes" << std::endl;
+            exit(1);
+        }
+        return true;
+    }
+
+private:
+    uint32_t state;
+    size_t _count;
+    size_t _done{0};
+};
+
+static CoTask relay_end(CoScheduler& sched, int fd, Traffic& first,
+    Traffic& second, bool client)
+{
+    bool eof = false;
+    // The client sends, then reads the reply. The server answers.
+    while (!first.finished())
+    {
+        if (!(client ? first.send(fd) : first.receive(fd, eof)))
+        {
+            co_await (client ? sched.writable(fd) : sched.readable(fd));
+        }
+    }
+    while (!second.finished())
+    {
+        if (!(client ? second.receive(fd, eof) : second.send(fd)))
+        {
+            co_await (client ? sched.readable(fd) : sched.writable(fd));
+        }
+    }
+    // Then the client hangs up, which ends the relay, and so the server.
+    if (client) shutdown(fd, SHUT_WR);
+    Traffic nothing(0, 0);
+    eof = false;
+    while (!eof)
+    {
+        if (!nothing.receive(fd, eof)) co_await sched.readable(fd);
+    }
+    close(fd);
+}
+
+// co_relay() between two loopback connections carries both directions
+// whole, and ends when the client hangs up.
+static void relay_loopback()
+{
+    int leftClient, leftServer, rightClient, rightServer;
+    loopback_pair(leftClient, leftServer);
+    loopback_pair(rightClient, rightServer);
+    CoScheduler sched;
+    iopackage_stats stats[2];
+    bool done = false;
+    Traffic forward[2]{{1, forward_size}, {1, forward_size}};
+    Traffic backward[2]{{2, backward_size}, {2, backward_size}};
+    sched.spawn(
+        relay_end(sched, leftClient, forward[0], backward[0], true));
+    sched.spawn(
+        relay_end(sched, rightServer, forward[1], backward[1], false));
+    co_relay(sched, leftServer, rightClient, relay_ring_size,
+        [&stats, &done] (const iopackage_stats relayed[2])
+        {
+            stats[0] = relayed[0];
+            stats[1] = relayed[1];
+            done = true;
+        });
+    auto start = Clock::now();
+    sched.run();
+    if (!done || (stats[0].bytes_copied != forward_size) ||
+        (stats[1].bytes_copied != backward_size))
+    {
+        std::cerr << "DEFECT: relay reported " << stats[0].bytes_copied <<
+            " and " << stats[1].bytes_copied << " bytes" << std::endl;
+        exit(1);
+    }
+    std::cout << "relay: " << forward_size << " bytes forward, " <<
+        backward_size << " backward in " << ms_since(start) << " ms" <<
+        std::endl;
+}
+
+int main (int argc, char* argv[])
+{
+    if (argc != 1) Usage_exit (0);
+    sleep_order();
+    ring_stream();
+    connect_deadline();
+    relay_loopback();
+}
+
+static void Usage_exit (int exit_val)
+{
+    std::cerr << "Usage: testcoroutine" << std::endl;
+    exit (exit_val);
+}
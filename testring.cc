@@ -8,24 +8,38 @@
 #include <thread>
 #include <stdio.h>
 #include <chrono>
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <type_traits>
 using namespace std::chrono_literals;
+#include "ringallocators.h"
 #include "ringbufr.h"
+#include "ringbufrshm.h"
 #include "miscutils.h"
+#include <sys/wait.h>
 
 // Tuning
 static const int read_usleep_range  = 50000;
 static const int write_usleep_range = 50000;
 static const size_t ring_size = 37;
 static const size_t verbose = 1;
+// Bigger than a huge page, and not a multiple of one
+static const size_t big_ring_size = 3 * 1024 * 1024 + 4099;
+// Small, so that both processes often wait on each other
+static const size_t shm_ring_size = 1021;
+static const uint64_t shm_elements = 4 * 1024 * 1024;
 #define DEFAULT_RUN_SECONDS 300
 
 static std::mutex ringMutex;
 int last_read_value, last_write_value;
 
+// Room for any int, as "-2147483648", and the null
+static const size_t name_size = 12;
+
 void itoa(int num, char* str)
 {
-    sprintf(str, "%d", num);
+    snprintf(str, name_size, "%d", num);
 }
 class TestClass
 {
@@ -33,7 +47,7 @@ public:
     TestClass(int serial=0)
      : serialNumber(serial)
     {
-        name = new char[9];
+        name = new char[name_size];
         itoa(serial, name);
     }
     ~TestClass()
@@ -42,6 +56,11 @@ public:
     }
     TestClass(const TestClass&) = delete;
     TestClass& operator=(const TestClass&) = delete;
+    TestClass(TestClass&& other)
+     : serialNumber(other.serialNumber), name(other.name)
+    {
+        other.name = nullptr;
+    }
     TestClass& operator=(TestClass&& other)
     {
         serialNumber = other.serialNumber;
@@ -87,8 +106,8 @@ std::ostream& operator<<(std::ostream& ost, const TestClass& tc)
 {
     return tc.print(ost);
 }
-template <>
-void RingbufR<TestClass>::validate(const TestClass* start, size_t count)
+// Serial numbers that count up by one, each with its own name
+static void validate_serials(const TestClass* start, size_t count)
 {
     if (count == 0) return;
     int serial = start->serial();
@@ -101,6 +120,16 @@ void RingbufR<TestClass>::validate(const TestClass* start, size_t count)
         assert(converted == serial);
     }
 }
+template <>
+void RingbufR<TestClass>::validate(const TestClass* start, size_t count)
+{
+    validate_serials(start, count);
+}
+template <>
+void RingbufRraw<TestClass>::validate(const TestClass* start, size_t count)
+{
+    validate_serials(start, count);
+}
 
 const TestClass* buffer;
 
@@ -110,11 +139,30 @@ int my_rand(int lower, int upper)
     return lower + rand() % (upper - lower);
 }
 
-static RingbufR<TestClass> rbuf (ring_size);
+// Slots of a RingbufR hold a TestClass, with its name buffer, from the
+// start. Slots of a RingbufRraw hold none until pushed.
+static void store(RingbufR<TestClass>&, TestClass* slot, int serial)
+{
+    *slot = serial;
+}
+static void store(RingbufRraw<TestClass>&, TestClass* slot, int serial)
+{
+    std::construct_at(slot, serial);
+}
+
 static bool running = true;
+static bool writer_done = false;  // Under ringMutex
 
-static void Reader ();
-static void Writer ();
+template<typename _Ring>
+static void Reader (_Ring& rbuf);
+template<typename _Ring>
+static void Writer (_Ring& rbuf);
+template<typename _Ring>
+static void run_threads (const char* name, int run_seconds);
+template<typename _Alloc>
+static void round_trip (const char* name, const _Alloc& alloc);
+static void shm_round_trip (const std::string& name);
+static void raw_wrap ();
 static void Usage_exit (int exit_val);
 
 int main (int argc, char* argv[])
@@ -144,22 +192,263 @@ int main (int argc, char* argv[])
         Usage_exit (0);
         break;
     }
+
+    round_trip("std::allocator", std::allocator<unsigned char>());
+    round_trip("HugePageAllocator", HugePageAllocator<unsigned char>());
+    round_trip("LockedAllocator", LockedAllocator<unsigned char>());
+    round_trip("NumaAllocator", NumaAllocator<unsigned char>());
+    raw_wrap();
+    // Before any thread starts, for fork()
+    shm_round_trip("");
+    shm_round_trip("/testring-" + std::to_string(getpid()));
+
+    run_threads<RingbufR<TestClass> >("RingbufR", run_seconds);
+    run_threads<RingbufRraw<TestClass> >("RingbufRraw", run_seconds);
+}
+
+// emplace() and take() one element at a time, from every position of the
+// cursors, including the end of the store, where the room or content
+// starts again at the beginning. Each round fills the ring, then drains
+// it, alternately by the two take()s; and then, so that the cursors move
+// on by one, pushes and takes one more.
+static void raw_wrap ()
+{
+    RingbufRraw<TestClass> rbuf(ring_size);
+    int next_in = 0;
+    int next_out = 0;
+    auto check = [&next_out] (const TestClass& tc)
+    {
+        if ((tc.serial() != next_out) || (mstoi(tc.desc()) != next_out))
+        {
+            std::cerr << "DEFECT: took " << tc << ", expected " <<
+                next_out << std::endl;
+            exit(1);
+        }
+        ++next_out;
+    };
+    for (size_t round = 0 ; round < 3 * ring_size ; ++round)
+    {
+        while (rbuf.emplace(next_in)) ++next_in;
+        assert(rbuf.size() == ring_size);
+        while (true)
+        {
+            if (next_out % 2)
+            {
+                TestClass out;
+                if (!rbuf.take(out)) break;
+                check(out);
+            }
+            else
+            {
+                std::optional<TestClass> out = rbuf.take();
+                if (!out) break;
+                check(*out);
+            }
+        }
+        assert(rbuf.size() == 0);
+        assert(next_out == next_in);
+        std::optional<TestClass> out;
+        if (rbuf.emplace(next_in++)) out = rbuf.take();
+        if (!out)
+        {
+            std::cerr << "DEFECT: one element in an empty ring did not "
+                "come back" << std::endl;
+            exit(1);
+        }
+        check(*out);
+    }
+    std::cout << "=== RingbufRraw wrap: " << next_out <<
+        " elements taken" << std::endl;
+}
+
+// A byte ring from alloc, filled and drained several times over, in
+// random steps. Skipped if alloc cannot have the memory, as when mlock()
+// is over RLIMIT_MEMLOCK.
+template<typename _Alloc>
+static void round_trip (const char* name, const _Alloc& alloc)
+{
+    std::unique_ptr<RingbufR<unsigned char, _Alloc> > ring;
+    try
+    {
+        ring = std::make_unique<RingbufR<unsigned char, _Alloc> >(
+            big_ring_size, alloc);
+    }
+    catch (const std::bad_alloc&)
+    {
+        std::cout << "=== " << name << ": no memory, skipped" << std::endl;
+        return;
+    }
+    if (std::is_same_v<_Alloc, HugePageAllocator<unsigned char> > &&
+        ((uintptr_t)ring->ring_start() % (2 * 1024 * 1024)))
+    {
+        std::cerr << "DEFECT: " << name << ": store not 2 MiB aligned" <<
+            std::endl;
+        exit(1);
+    }
+    size_t pushed = 0;
+    size_t popped = 0;
+    while (popped < 4 * big_ring_size)
+    {
+        size_t available1, available2;
+        unsigned char* start1;
+        unsigned char* start2;
+        ring->pushInquire(available1, start1, available2, start2);
+        size_t count = my_rand(0, available1 + available2);
+        for (size_t i = 0 ; i < count ; ++i)
+        {
+            unsigned char* slot =
+                (i < available1) ? start1 + i : start2 + (i - available1);
+            *slot = (pushed + i) % 251;
+        }
+        ring->push(count);
+        pushed += count;
+
+        ring->popInquire(available1, start1, available2, start2);
+        count = my_rand(0, available1 + available2);
+        for (size_t i = 0 ; i < count ; ++i)
+        {
+            const unsigned char* slot =
+                (i < available1) ? start1 + i : start2 + (i - available1);
+            if (*slot != (popped + i) % 251)
+            {
+                std::cerr << "DEFECT: " << name << ": byte " <<
+                    popped + i << " is " << (int)*slot << std::endl;
+                exit(1);
+            }
+        }
+        ring->pop(count);
+        popped += count;
+    }
+    std::cout << "=== " << name << ": " << popped <<
+        " bytes through a ring of " << big_ring_size << std::endl;
+}
+
+// This process produces the numbers 1 to shm_elements, and a child
+// process, attached by file descriptor or by name, consumes and checks
+// them. Each sleeps in wait_space() or wait_data() when it must.
+static void shm_round_trip (const std::string& name)
+{
+    const char* kind = name.empty() ? "RingbufRshm (memfd)" :
+        "RingbufRshm (shm_open)";
+    try
+    {
+        RingbufRshm<uint64_t> ring =
+            RingbufRshm<uint64_t>::create(shm_ring_size, name);
+        pid_t child = fork();
+        if (child < 0) errorexit("fork");
+        if (child == 0)
+        {
+            // Consumer. _exit(), so that nothing of the parent's is
+            // destroyed here.
+            int status = 0;
+            try
+            {
+                RingbufRshm<uint64_t> theirs = name.empty()
+                    ? RingbufRshm<uint64_t>::attach_fd(ring.fd())
+                    : RingbufRshm<uint64_t>::attach(name);
+                uint64_t expected = 0;
+                while (theirs.wait_data())
+                {
+                    size_t available1, available2;
+                    uint64_t* start1;
+                    uint64_t* start2;
+                    theirs.popInquire(available1, start1, available2, start2);
+                    size_t count = my_rand(1, available1 + available2);
+                    for (size_t i = 0 ; i < count ; ++i)
+                    {
+                        uint64_t value = (i < available1)
+                            ? start1[i] : start2[i - available1];
+                        if (value != ++expected)
+                        {
+                            std::cerr << "DEFECT: " << kind << ": got " <<
+                                value << ", expected " << expected <<
+                                std::endl;
+                            _exit(1);
+                        }
+                    }
+                    theirs.pop(count);
+                }
+                if (expected != shm_elements)
+                {
+                    std::cerr << "DEFECT: " << kind << ": only " <<
+                        expected << " elements" << std::endl;
+                    status = 1;
+                }
+            }
+            catch (const RingbufRshmException& r)
+            {
+                std::cerr << "DEFECT: " << kind << ": " << r.strng <<
+                    std::endl;
+                status = 1;
+            }
+            _exit(status);
+        }
+        // Producer
+        uint64_t value = 0;
+        while (value < shm_elements)
+        {
+            if (!ring.wait_space()) break;
+            size_t available1, available2;
+            uint64_t* start1;
+            uint64_t* start2;
+            ring.pushInquire(available1, start1, available2, start2);
+            size_t count = std::min((uint64_t)my_rand(1,
+                available1 + available2), shm_elements - value);
+            for (size_t i = 0 ; i < count ; ++i)
+            {
+                ((i < available1) ? start1[i] : start2[i - available1]) =
+                    ++value;
+            }
+            ring.push(count);
+        }
+        ring.close();
+        int status;
+        NEGCHECK("waitpid", waitpid(child, &status, 0));
+        if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+        {
+            std::cerr << "DEFECT: " << kind << ": consumer failed" <<
+                std::endl;
+            exit(1);
+        }
+    }
+    catch (const RingbufRshmException& r)
+    {
+        std::cerr << "DEFECT: " << kind << ": " << r.strng << std::endl;
+        exit(1);
+    }
+    std::cout << "=== " << kind << ": " << shm_elements <<
+        " elements between processes" << std::endl;
+}
+
+// One writer thread and one reader thread, for run_seconds
+template<typename _Ring>
+static void run_threads (const char* name, int run_seconds)
+{
+    std::cout << "=== " << name << ", " << run_seconds << " seconds" <<
+        std::endl;
+    _Ring rbuf (ring_size);
     // Cheat
     buffer = rbuf.ring_start();
+    last_read_value = last_write_value = 0;
+    running = true;
+    writer_done = false;
 
-    std::thread hReader (Reader);
-    std::thread hWriter (Writer);
+    std::thread hReader (Reader<_Ring>, std::ref(rbuf));
+    std::thread hWriter (Writer<_Ring>, std::ref(rbuf));
     sleep (run_seconds);
 
     running = false;
     hWriter.join();
     hReader.join();
     assert (last_read_value == last_write_value);
+    std::cout << "=== " << name << ": " << last_read_value <<
+        " elements passed" << std::endl;
 }
 
-static void Writer ()
+template<typename _Ring>
+static void Writer (_Ring& rbuf)
 {
-    static __thread int serial = 0;
+    int serial = 0;
 
     while (running)
     {
@@ -192,11 +481,11 @@ static void Writer ()
             }
             for (size_t i = 0 ; i < std::min(count, available1) ; ++i)
             {
-                *start1++ = ++serial;
+                store(rbuf, start1++, ++serial);
             }
             for (size_t i = std::min(count, available1) ; i < count ; ++i)
             {
-                *start2++ = ++serial;
+                store(rbuf, start2++, ++serial);
             }
             rbuf.push(count);
             last_write_value = serial;
@@ -208,12 +497,15 @@ static void Writer ()
             std::cout << "(will push 0 (buffer is full))" << std::endl;
         }
     }
+    const std::lock_guard<std::mutex> lock(ringMutex);
+    writer_done = true;
 }
 
 
-static void Reader ()
+template<typename _Ring>
+static void Reader (_Ring& rbuf)
 {
-    static __thread int serial = 0;
+    int serial = 0;
 
     while (true)
     {
@@ -262,15 +554,33 @@ static void Reader ()
                 ++tc;
             };
 
-            for (size_t i = 0 ; i < std::min(count, available1) ; ++i)
+            bool taken_one = false;
+            if constexpr (std::is_same_v<_Ring, RingbufRraw<TestClass> >)
             {
-                tester(i, start1, serial);
+                if (count == 1)
+                {
+                    // Move out, instead of inspecting in place
+                    std::optional<TestClass> taken = rbuf.take();
+                    assert(taken);
+                    TestClass* tc = &*taken;
+                    tester(0, tc, serial);
+                    taken_one = true;
+                }
             }
-            for (size_t i = std::min(count, available1) ; i < count ; ++i)
+            if (!taken_one)
             {
-                tester(i, start2, serial);
+                _Ring::validate(start1, std::min(count, available1));
+                _Ring::validate(start2, count - std::min(count, available1));
+                for (size_t i = 0 ; i < std::min(count, available1) ; ++i)
+                {
+                    tester(i, start1, serial);
+                }
+                for (size_t i = std::min(count, available1) ; i < count ; ++i)
+                {
+                    tester(i, start2, serial);
+                }
+                rbuf.pop(count);
             }
-            rbuf.pop(count);
             last_read_value = serial;
             std::cout << "size is now " << rbuf.size() << std::endl;
         }
@@ -278,7 +588,8 @@ static void Reader ()
         {
             assert(rbuf.size() == 0);
             std::cout << "(will pop 0 (buffer is empty))" << std::endl;
-            if (!running)
+            // Not just !running: the writer may be about to push.
+            if (writer_done)
             {
                 break;
             }
@@ -292,4 +603,6 @@ static void Usage_exit (int exit_val)
     exit (exit_val);
 }
 
+#include "ringallocators.tcc"
 #include "ringbufr.tcc"
+#include "ringbufrshm.tcc"
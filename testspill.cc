@@ -0,0 +1,163 @@
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "crc32c.h"
+#include "spilllog.h"
+
+// Tuning
+static const size_t segment_size = 64 * 1024;
+static const size_t budget_segments = 4;
+static const size_t stream_size = 8 * 1024 * 1024;
+static const size_t idle_logs = 16;
+#define DEFAULT_DIRECTORY "/tmp"
+
+static void Usage_exit (int exit_val);
+
+// Deterministic bytes, so that a failure repeats
+static unsigned char next_byte(uint32_t& state)
+{
+    state = state * 1664525 + 1013904223;
+    return state >> 24;
+}
+
+static size_t my_rand(size_t lower, size_t upper)
+{
+    if (lower == upper) return lower;
+    return lower + rand() % (upper - lower);
+}
+
+// A writer faster than its reader, through a budget of a few segments.
+// Whatever does not fit waits, as a stalled copy loop would. The bytes
+// read back must be the bytes written, in order.
+static void slow_reader(const std::string& dir)
+{
+    SpillBudget budget(budget_segments * segment_size);
+    SpillLog log(dir, budget, segment_size);
+    uint32_t state = 1;
+    uint32_t crc_in = 0;
+    uint32_t crc_out = 0;
+    size_t written = 0;
+    size_t read = 0;
+    size_t budget_full = 0;
+    while (read < stream_size)
+    {
+        // Writer: a burst, as much of it as fits
+        size_t burst = my_rand(1, 3 * segment_size);
+        while ((burst > 0) && (written < stream_size))
+        {
+            unsigned char* start;
+            size_t room = log.reserve(start);
+            if (room == 0)
+            {
+                ++budget_full;
+                break;
+            }
+            size_t count = std::min({room, burst, stream_size - written});
+            for (size_t index = 0 ; index < count ; ++index)
+            {
+                start[index] = next_byte(state);
+            }
+            crc_in = crc32c(crc_in, start, count);
+            log.commit(count);
+            written += count;
+            burst -= count;
+        }
+        // Reader: less than the writer, on average
+        size_t want = my_rand(1, 2 * segment_size);
+        while ((want > 0) && !log.empty())
+        {
+            const unsigned char* start;
+            size_t count = std::min(log.peek(start), want);
+            assert(count > 0);
+            crc_out = crc32c(crc_out, start, count);
+            log.consume(count);
+            read += count;
+            want -= count;
+        }
+        assert(log.size() == written - read);
+    }
+    assert(written == stream_size);
+    assert(log.empty());
+    if (crc_in != crc_out)
+    {
+        std::cerr << "DEFECT: spilled " << crc32c_string(crc_in) <<
+            " but read back " << crc32c_string(crc_out) << std::endl;
+        exit(1);
+    }
+    // Otherwise the test did not test the budget
+    assert(budget_full > 0);
+    // Caught up, the log gives all of its space back.
+    if (!budget.take(budget_segments * segment_size))
+    {
+        std::cerr << "DEFECT: caught up, but budget not refunded" <<
+            std::endl;
+        exit(1);
+    }
+    std::cout << "slow reader: " << written << " bytes, CRC32C " <<
+        crc32c_string(crc_out) << ", budget spent " << budget_full <<
+        " times" << std::endl;
+}
+
+// Many connections that spilled once and caught up. None may keep space
+// that the others need.
+static void idle_logs_refund(const std::string& dir)
+{
+    SpillBudget budget(budget_segments * segment_size);
+    std::vector<std::unique_ptr<SpillLog> > logs;
+    for (size_t num = 0 ; num < idle_logs ; ++num)
+    {
+        logs.push_back(std::make_unique<SpillLog>(dir, budget, segment_size));
+        SpillLog& log = *logs.back();
+        unsigned char* start;
+        size_t room = log.reserve(start);
+        if (room == 0)
+        {
+            std::cerr << "DEFECT: idle log " << num - 1 <<
+                " kept its spill space" << std::endl;
+            exit(1);
+        }
+        memset(start, 'x', 100);
+        log.commit(100);
+        const unsigned char* from;
+        assert(log.peek(from) == 100);
+        log.consume(100);
+        assert(log.empty());
+    }
+    if (!budget.take(budget_segments * segment_size))
+    {
+        std::cerr << "DEFECT: idle logs kept spill space" << std::endl;
+        exit(1);
+    }
+    std::cout << "idle logs: " << idle_logs << " logs in a budget of " <<
+        budget_segments << " segments" << std::endl;
+}
+
+int main (int argc, char* argv[])
+{
+    std::string dir = DEFAULT_DIRECTORY;
+    switch (argc)
+    {
+    case 1:
+        break;
+    case 2:
+        dir = argv[1];
+        break;
+    default:
+        Usage_exit (0);
+        break;
+    }
+    slow_reader(dir);
+    idle_logs_refund(dir);
+}
+
+static void Usage_exit (int exit_val)
+{
+    std::cerr << "Usage: testspill [directory]" << std::endl;
+    exit (exit_val);
+}
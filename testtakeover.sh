@@ -0,0 +1,56 @@
+#!/bin/sh
+# A tcppipe that took over its listening sockets must still dump counters
+# on SIGUSR1, not die of it.
+# Usage: testtakeover.sh [path_to_tcppipe]
+
+TCPPIPE=${1:-./tcppipe}
+LISTEN=@testtakeover-listen-$$
+HANDOFF=@testtakeover-handoff-$$
+OLD_LOG=/tmp/testtakeover-old-$$.log
+NEW_LOG=/tmp/testtakeover-new-$$.log
+old=
+new=
+
+finish()
+{
+    [ -n "$old" ] && kill "$old" 2>/dev/null
+    [ -n "$new" ] && kill "$new" 2>/dev/null
+    rm -f "$OLD_LOG" "$NEW_LOG"
+    exit "$1"
+}
+fail()
+{
+    echo "FAIL: $1"
+    echo "--- old process:"; cat "$OLD_LOG"
+    echo "--- new process:"; cat "$NEW_LOG"
+    finish 1
+}
+# Waits up to 5 seconds for $2 in file $1
+wait_for()
+{
+    tries=0
+    while ! grep -q "$2" "$1"
+    do
+        tries=$((tries + 1))
+        [ $tries -gt 50 ] && return 1
+        sleep 0.1
+    done
+}
+
+"$TCPPIPE" -verbose 1 -handoff_path $HANDOFF \
+    -listen_unix $LISTEN -connect_unix @testtakeover-nowhere-$$ \
+    > "$OLD_LOG" 2>&1 &
+old=$!
+sleep 0.3
+"$TCPPIPE" -verbose 1 -takeover $HANDOFF \
+    -listen_unix $LISTEN -connect_unix @testtakeover-nowhere-$$ \
+    > "$NEW_LOG" 2>&1 &
+new=$!
+wait_for "$NEW_LOG" "took over" || fail "no takeover"
+
+kill -USR1 $new
+wait_for "$NEW_LOG" "counters:" || fail "no counters after SIGUSR1"
+kill -0 $new 2>/dev/null || fail "SIGUSR1 killed the new process"
+
+echo "PASS: takeover, then SIGUSR1"
+finish 0
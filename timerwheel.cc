@@ -0,0 +1,254 @@
+#include "timerwheel.h"
+#include "miscutils.h"
+
+#include <algorithm>
+#include <cstring>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+/////////////////////////////
+// TimerWheel class methods //
+/////////////////////////////
+
+TimerWheel::TimerWheel(int tk_ms)
+    : tick_ms(std::max(tk_ms, 1))
+{
+    memset(wheel, 0, sizeof(wheel));
+    NEGCHECK("timerfd_create",
+        (timerFD = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)));
+    NEGCHECK("eventfd", (stopFD = eventfd(0, EFD_CLOEXEC)));
+    struct itimerspec spec;
+    spec.it_interval.tv_sec  = tick_ms / 1000;
+    spec.it_interval.tv_nsec = (tick_ms % 1000) * 1000000L;
+    spec.it_value = spec.it_interval;
+    NEGCHECK("timerfd_settime", timerfd_settime(timerFD, 0, &spec, nullptr));
+    thread = std::thread(&TimerWheel::run, this);
+}
+
+TimerWheel::~TimerWheel()
+{
+    uint64_t one = 1;
+    NEGCHECK("write", write(stopFD, &one, sizeof(one)));
+    thread.join();
+    close(timerFD);
+    close(stopFD);
+}
+
+uint64_t TimerWheel::ticks(int ms) const
+{
+    return std::max<uint64_t>((ms + tick_ms - 1) / tick_ms, 1);
+}
+
+void TimerWheel::schedule(WheelTimer& timer, uint64_t when)
+{
+    const std::lock_guard<std::mutex> lock(mtx);
+    schedule_locked(timer, when);
+}
+
+void TimerWheel::schedule_locked(WheelTimer& timer, uint64_t when)
+{
+    if (timer.linked) unlink(timer);
+    timer.expires = std::max(when, now());
+    insert(timer);
+}
+
+void TimerWheel::cancel(WheelTimer& timer)
+{
+    const std::lock_guard<std::mutex> lock(mtx);
+    if (timer.linked) unlink(timer);
+}
+
+void TimerWheel::insert(WheelTimer& timer)
+{
+    uint64_t delta = timer.expires - now();
+    size_t level = 0;
+    while ((level < levels - 1) &&
+           (delta >> (level_bits * (level + 1))) != 0)
+    {
+        ++level;
+    }
+    if ((delta >> (level_bits * (level + 1))) != 0)
+    {
+        // Beyond the range of the wheel. Fire as late as possible; the
+        // owner can reschedule from expire().
+        timer.expires = now() + (uint64_t(1) << (level_bits * levels)) - 1;
+    }
+    WheelTimer*& head =
+        wheel[level][(timer.expires >> (level_bits * level)) & (slots - 1)];
+    timer.prev = nullptr;
+    timer.next = head;
+    if (head) head->prev = &timer;
+    head = &timer;
+    timer.linked = true;
+}
+
+void TimerWheel::unlink(WheelTimer& timer)
+{
+    if (timer.next) timer.next->prev = timer.prev;
+    if (timer.prev)
+    {
+        timer.prev->next = timer.next;
+    }
+    else
+    {
+        // First in its slot. Find the slot.
+        for (size_t level = 0 ; level < levels ; ++level)
+        {
+            WheelTimer*& head = wheel[level]
+                [(timer.expires >> (level_bits * level)) & (slots - 1)];
+            if (head == &timer)
+            {
+                head = timer.next;
+                break;
+            }
+        }
+    }
+    timer.prev = nullptr;
+    timer.next = nullptr;
+    timer.linked = false;
+}
+
+void TimerWheel::advance()
+{
+    uint64_t current = now();
+    size_t index = current & (slots - 1);
+
+    // Move timers down from higher levels as their time approaches
+    if (index == 0)
+    {
+        for (size_t level = 1 ; level < levels ; ++level)
+        {
+            size_t upper = (current >> (level_bits * level)) & (slots - 1);
+            WheelTimer* timer = wheel[level][upper];
+            wheel[level][upper] = nullptr;
+            while (timer)
+            {
+                WheelTimer* next = timer->next;
+                timer->linked = false;
+                insert(*timer);
+                timer = next;
+            }
+            if (upper != 0) break;
+        }
+    }
+
+    WheelTimer* timer = wheel[0][index];
+    wheel[0][index] = nullptr;
+    while (timer)
+    {
+        WheelTimer* next = timer->next;
+        timer->prev = nullptr;
+        timer->next = nullptr;
+        timer->linked = false;
+        uint64_t again = timer->expire(current);
+        if (again)
+        {
+            // Cannot land in the slot being emptied: again > current.
+            timer->expires = std::max(again, current + 1);
+            insert(*timer);
+        }
+        timer = next;
+    }
+
+    _now.store(current + 1, std::memory_order_relaxed);
+}
+
+void TimerWheel::run()
+{
+    pollfd pfd[2];
+    memset(pfd, 0, 2 * sizeof(pollfd));
+    pfd[0].fd = timerFD;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = stopFD;
+    pfd[1].events = POLLIN;
+    while (true)
+    {
+        int poll_return;
+        NEGCHECK("poll", (poll_return = poll(pfd, 2, -1)));
+        if (pfd[1].revents) break;
+        if (pfd[0].revents & POLLIN)
+        {
+            uint64_t expirations;
+            NEGCHECK("read",
+                read(timerFD, &expirations, sizeof(expirations)));
+            const std::lock_guard<std::mutex> lock(mtx);
+            while (expirations--) advance();
+        }
+    }
+}
+
+///////////////////////////////
+// SessionTimer class methods //
+///////////////////////////////
+
+SessionTimer::SessionTimer(TimerWheel& wheel)
+    : _wheel(wheel), last_activity(wheel.now())
+{
+    NEGCHECK("eventfd",
+        (eventFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)));
+    for (size_t kind = 0 ; kind < kinds ; ++kind)
+    {
+        ticks[kind] = 0;
+        start[kind] = 0;
+    }
+}
+
+SessionTimer::~SessionTimer()
+{
+    _wheel.cancel(*this);
+    close(eventFD);
+}
+
+void SessionTimer::arm(Kind kind, int ms)
+{
+    const std::lock_guard<std::mutex> lock(_wheel.mutex());
+    if (ms == -1)
+    {
+        // A pending wake-up is harmless; expire() finds nothing to do.
+        ticks[kind] = 0;
+        return;
+    }
+    ticks[kind] = _wheel.ticks(ms);
+    start[kind] = _wheel.now();
+    if (kind == idle_deadline) touch();
+    // The earliest deadline may have changed
+    uint64_t when = 0;
+    for (size_t kd = 0 ; kd < kinds ; ++kd)
+    {
+        if (ticks[kd] == 0) continue;
+        uint64_t dl = deadline(Kind(kd));
+        if ((when == 0) || (dl < when)) when = dl;
+    }
+    _wheel.schedule_locked(*this, when);
+}
+
+uint64_t SessionTimer::deadline(Kind kind) const
+{
+    if (kind == idle_deadline)
+    {
+        return last_activity.load(std::memory_order_relaxed) + ticks[kind];
+    }
+    return start[kind] + ticks[kind];
+}
+
+uint64_t SessionTimer::expire(uint64_t now)
+{
+    if (_expired.load(std::memory_order_relaxed)) return 0;
+    uint64_t when = 0;
+    for (size_t kind = 0 ; kind < kinds ; ++kind)
+    {
+        if (ticks[kind] == 0) continue;
+        uint64_t dl = deadline(Kind(kind));
+        if (dl <= now)
+        {
+            _expired.store(true, std::memory_order_relaxed);
+            uint64_t one = 1;
+            NEGCHECK("write", write(eventFD, &one, sizeof(one)));
+            return 0;
+        }
+        if ((when == 0) || (dl < when)) when = dl;
+    }
+    return when;
+}
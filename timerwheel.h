@@ -0,0 +1,116 @@
+#ifndef __TIMERWHEEL_H_
+#define __TIMERWHEEL_H_
+
+// Coarse timers for many connections. One thread, driven by a timerfd on
+// CLOCK_MONOTONIC, advances a hierarchical wheel; scheduling and
+// cancelling are O(1). Wall clock changes have no effect.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+class TimerWheel;
+
+// Base class for anything the wheel can expire
+class WheelTimer
+{
+public:
+    WheelTimer() { }
+    virtual ~WheelTimer() { }
+    WheelTimer(const WheelTimer&) = delete;
+    WheelTimer& operator=(const WheelTimer&) = delete;
+
+protected:
+    // Called on the wheel thread with the wheel locked, at or after the
+    // scheduled tick. Returns 0, or a later tick to be called again.
+    virtual uint64_t expire(uint64_t now) = 0;
+
+private:
+    friend class TimerWheel;
+    WheelTimer* prev{nullptr};
+    WheelTimer* next{nullptr};
+    uint64_t expires{0};
+    bool linked{false};
+};
+
+class TimerWheel
+{
+public:
+    TimerWheel(int tick_ms);
+    ~TimerWheel();
+    TimerWheel() = delete;
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    // The current tick. Cheap enough for the data path.
+    uint64_t now() const { return _now.load(std::memory_order_relaxed); }
+    // Number of ticks covering ms milliseconds, at least 1
+    uint64_t ticks(int ms) const;
+
+    // (Re)schedules timer for tick "when". A tick already passed means
+    // the next tick.
+    void schedule(WheelTimer& timer, uint64_t when);
+    void cancel(WheelTimer& timer);
+
+    // Locks out the wheel thread, so that state read by expire() can be
+    // changed safely.
+    std::mutex& mutex() { return mtx; }
+    void schedule_locked(WheelTimer& timer, uint64_t when);
+
+private:
+    static constexpr unsigned level_bits{6};
+    static constexpr size_t slots{size_t(1) << level_bits};
+    static constexpr size_t levels{4};
+
+    void run();
+    void advance();
+    void insert(WheelTimer& timer);
+    void unlink(WheelTimer& timer);
+
+    const int tick_ms;
+    int timerFD;
+    int stopFD;
+    std::mutex mtx;
+    std::atomic<uint64_t> _now{0};
+    WheelTimer* wheel[levels][slots];
+    std::thread thread;
+};
+
+// Connect, session and idle deadlines for one client. When any of them
+// passes, fd() becomes readable and expired() returns true.
+class SessionTimer : public WheelTimer
+{
+public:
+    enum Kind { connect_deadline, session_deadline, idle_deadline, kinds };
+
+    SessionTimer(TimerWheel& wheel);
+    ~SessionTimer();
+    SessionTimer() = delete;
+
+    // Starts a deadline ms milliseconds from now. -1 means none. For the
+    // idle deadline, the time is measured from the latest touch().
+    void arm(Kind kind, int ms);
+    void disarm(Kind kind) { arm(kind, -1); }
+
+    // Records activity, for the idle deadline
+    void touch() {
+        last_activity.store(_wheel.now(), std::memory_order_relaxed); }
+
+    bool expired() const { return _expired.load(std::memory_order_relaxed); }
+    int fd() const { return eventFD; }
+
+private:
+    uint64_t expire(uint64_t now) override;
+    uint64_t deadline(Kind kind) const;
+
+    TimerWheel& _wheel;
+    int eventFD;
+    uint64_t ticks[kinds];   // 0 means disarmed
+    uint64_t start[kinds];
+    std::atomic<uint64_t> last_activity;
+    std::atomic<bool> _expired{false};
+};
+
+#endif // __TIMERWHEEL_H_
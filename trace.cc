@@ -0,0 +1,155 @@
+#include "trace.h"
+#include "miscutils.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// Tuning (compile time)
+constexpr size_t trace_capacity{64*1024};  // Events kept, a power of 2
+
+std::atomic<bool> trace_enabled{false};
+
+namespace
+{
+
+// One event. seq is index + 1 once the event is complete, and 0 while it
+// is being written, so that a dump taken while tracing skips torn slots.
+struct TraceSlot
+{
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> nsec;   // CLOCK_MONOTONIC
+    std::atomic<uint64_t> ids;    // Thread, connection and kind
+    std::atomic<int64_t> a;
+    std::atomic<int64_t> b;
+};
+TraceSlot* slots{nullptr};
+std::atomic<uint64_t> trace_next{0};
+
+const char* const trace_names[num_trace_kinds] = {
+    "accept", "connect_start", "connect_finish", "read", "write",
+    "poll", "poll"};
+const char* const trace_args[num_trace_kinds][2] = {
+    {"fd", "port"}, {"fd", "port"}, {"fd", "errno"},
+    {"bytes", "ring_size"}, {"bytes", "ring_size"},
+    {"fds", "timeout_ms"}, {"return", "unused"}};
+
+thread_local uint32_t trace_tid{0};
+
+std::string trace_path;
+std::mutex trace_file_mtx;
+
+void trace_to_file()
+{
+    std::lock_guard<std::mutex> lock(trace_file_mtx);
+    std::ofstream ost(trace_path);
+    trace_dump(ost);
+}
+
+} // anonymous namespace
+
+void trace_record(trace_kind kind, unsigned conn, int64_t a, int64_t b)
+{
+    if (trace_tid == 0) trace_tid = (uint32_t)syscall(SYS_gettid);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t index = trace_next.fetch_add(1, std::memory_order_relaxed);
+    TraceSlot& slot = slots[index & (trace_capacity - 1)];
+    slot.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.nsec.store(
+        (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec,
+        std::memory_order_relaxed);
+    slot.ids.store(
+        ((uint64_t)trace_tid << 32) | ((uint64_t)conn << 8) | kind,
+        std::memory_order_relaxed);
+    slot.a.store(a, std::memory_order_relaxed);
+    slot.b.store(b, std::memory_order_relaxed);
+    slot.seq.store(index + 1, std::memory_order_release);
+}
+
+void trace_dump(std::ostream& ost)
+{
+    ost << "{\"traceEvents\":[" << std::endl;
+    if (slots)
+    {
+        uint64_t next = trace_next.load(std::memory_order_acquire);
+        uint64_t first = (next > trace_capacity) ? next - trace_capacity : 0;
+        pid_t pid = getpid();
+        bool comma = false;
+        for (uint64_t index = first ; index < next ; ++index)
+        {
+            TraceSlot& slot = slots[index & (trace_capacity - 1)];
+            uint64_t seq = slot.seq.load(std::memory_order_acquire);
+            uint64_t nsec = slot.nsec.load(std::memory_order_relaxed);
+            uint64_t ids = slot.ids.load(std::memory_order_relaxed);
+            int64_t a = slot.a.load(std::memory_order_relaxed);
+            int64_t b = slot.b.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            // Overwritten, or not finished
+            if ((seq != index + 1) ||
+                (slot.seq.load(std::memory_order_relaxed) != seq))
+            {
+                continue;
+            }
+            unsigned kind = ids & 0xff;
+            unsigned conn = (ids >> 8) & 0xffffff;
+            unsigned tid = ids >> 32;
+            if (kind >= num_trace_kinds) continue;
+            char ts[32];
+            snprintf(ts, sizeof(ts), "%llu.%03llu",
+                (unsigned long long)(nsec / 1000),
+                (unsigned long long)(nsec % 1000));
+            const char* phase = (kind == trace_poll_enter) ? "B" :
+                (kind == trace_poll_exit) ? "E" : "i";
+            // One track per connection; the thread goes in args.
+            if (comma) ost << "," << std::endl;
+            comma = true;
+            ost << "{\"name\":\"" << trace_names[kind] <<
+                "\",\"ph\":\"" << phase << "\"";
+            if (*phase == 'i') ost << ",\"s\":\"t\"";
+            ost << ",\"ts\":" << ts << ",\"pid\":" << pid <<
+                ",\"tid\":" << conn << ",\"args\":{\"thread\":" << tid <<
+                ",\"" << trace_args[kind][0] << "\":" << a <<
+                ",\"" << trace_args[kind][1] << "\":" << b << "}}";
+        }
+    }
+    ost << std::endl << "]}" << std::endl;
+}
+
+void trace_start(const std::string& path)
+{
+    slots = new TraceSlot[trace_capacity]();
+    trace_path = path;
+    trace_enabled.store(true, std::memory_order_relaxed);
+    atexit(trace_to_file);
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR2);
+    ZEROCHECK("pthread_sigmask", pthread_sigmask(SIG_BLOCK, &set, nullptr));
+    // The new thread blocks every signal, so that none is delivered to it
+    // but by sigwait().
+    sigset_t all, old;
+    sigfillset(&all);
+    ZEROCHECK("pthread_sigmask", pthread_sigmask(SIG_SETMASK, &all, &old));
+    std::thread([set] ()
+        {
+            while (true)
+            {
+                int sig;
+                if (sigwait(&set, &sig) != 0) continue;
+                trace_to_file();
+            }
+        }).detach();
+    ZEROCHECK("pthread_sigmask", pthread_sigmask(SIG_SETMASK, &old, nullptr));
+}
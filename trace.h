@@ -0,0 +1,65 @@
+#ifndef __TRACE_H_
+#define __TRACE_H_
+
+// Event tracing for the copy engine. Each TRACE() is a USDT probe in the
+// "ringbufrv" provider, for perf and bpftrace, when <sys/sdt.h> is
+// available. While tracing is on, the event is also stored in an
+// in-memory buffer of the most recent events, which trace_dump() writes
+// as Chrome trace JSON (chrome://tracing, ui.perfetto.dev). Storing takes
+// one atomic fetch_add and no lock.
+//
+//     TRACE(read, conn, bytes, ring_size);
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_PROBE(name, conn, a, b) \
+    DTRACE_PROBE3(ringbufrv, name, conn, a, b)
+#endif
+#endif
+#ifndef TRACE_PROBE
+#define TRACE_PROBE(name, conn, a, b) do { } while (false)
+#endif
+
+// Meaning of a and b, by event
+enum trace_kind
+{
+    trace_accept,          // fd, port
+    trace_connect_start,   // fd, port
+    trace_connect_finish,  // fd, errno or 0
+    // The ring size is taken before the read or write is committed: the
+    // data ahead of a read, and all that a write had to offer.
+    trace_read,            // bytes or -errno, ring size before
+    trace_write,           // bytes or -errno, ring size before
+    trace_poll_enter,      // number of fds, timeout ms
+    trace_poll_exit,       // poll() return, 0
+    num_trace_kinds
+};
+
+extern std::atomic<bool> trace_enabled;
+inline bool trace_on()
+{
+    return trace_enabled.load(std::memory_order_relaxed);
+}
+void trace_record(trace_kind kind, unsigned conn, int64_t a, int64_t b);
+
+#define TRACE(name, conn, a, b) \
+    do { \
+    TRACE_PROBE(name, (conn), (a), (b)); \
+    if (trace_on()) \
+        trace_record(trace_##name, (conn), (a), (b)); \
+    } while (false)
+
+// Starts recording. The events are written to path at exit, and on every
+// SIGUSR2. Call from main() before any other thread is created, since
+// SIGUSR2 is blocked here and handled by sigwait() in a thread of its own.
+void trace_start(const std::string& path);
+// Writes the recorded events, oldest first
+void trace_dump(std::ostream& ost);
+
+#endif // __TRACE_H_
@@ -0,0 +1,225 @@
+#include "transform.h"
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+// Tuning (compile time)
+constexpr int default_deflate_level{1};  // Fastest: a relay is not an archive
+
+////////////////////////////
+// Transform class methods //
+////////////////////////////
+
+void Transform::filter(unsigned char*, size_t) { }
+
+size_t Transform::convert(const unsigned char* in, size_t in_length,
+    size_t& consumed, unsigned char* out, size_t out_length, transform_flush)
+{
+    consumed = std::min(in_length, out_length);
+    memcpy(out, in, consumed);
+    return consumed;
+}
+
+namespace
+{
+
+// Bytes and newline terminated lines, as they pass
+class CountTransform : public Transform
+{
+public:
+    bool in_place() const override { return true; }
+    void filter(unsigned char* data, size_t count) override
+    {
+        bytes += count;
+        const unsigned char* end = data + count;
+        while ((data = (unsigned char*)memchr(data, '\n', end - data)))
+        {
+            ++lines;
+            ++data;
+        }
+    }
+    std::string report() const override
+    {
+        std::ostringstream str;
+        str << "count: " << bytes << " bytes, " << lines << " lines";
+        return str.str();
+    }
+
+private:
+    size_t bytes{0};
+    size_t lines{0};
+};
+
+#ifdef HAVE_ZLIB
+
+// A zlib stream, flushed to a byte boundary whenever input goes idle, so
+// that nothing is held back from an interactive peer.
+class DeflateTransform : public Transform
+{
+public:
+    DeflateTransform(int level)
+    {
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit(&zs, level) != Z_OK)
+        {
+            throw TransformException("deflateInit failed");
+        }
+    }
+    ~DeflateTransform() { deflateEnd(&zs); }
+
+    bool in_place() const override { return false; }
+    size_t convert(const unsigned char* in, size_t in_length,
+        size_t& consumed, unsigned char* out, size_t out_length,
+        transform_flush flush) override
+    {
+        consumed = 0;
+        if (finished) return 0;
+        int mode = Z_NO_FLUSH;
+        if (flush == transform_flush::end)
+        {
+            mode = Z_FINISH;
+        }
+        else if (flush == transform_flush::sync)
+        {
+            if (!unflushed && (in_length == 0)) return 0;
+            mode = Z_SYNC_FLUSH;
+        }
+        zs.next_in = (Bytef*)in;
+        zs.avail_in = in_length;
+        zs.next_out = out;
+        zs.avail_out = out_length;
+        int ret = deflate(&zs, mode);
+        if ((ret != Z_OK) && (ret != Z_STREAM_END) && (ret != Z_BUF_ERROR))
+        {
+            throw TransformException(std::string("deflate: ") +
+                (zs.msg ? zs.msg : "failed"));
+        }
+        consumed = in_length - zs.avail_in;
+        // A flush is done when it leaves room in out.
+        if (mode == Z_NO_FLUSH)
+        {
+            unflushed = unflushed || consumed;
+        }
+        else if (zs.avail_out)
+        {
+            unflushed = false;
+        }
+        finished = (ret == Z_STREAM_END);
+        return out_length - zs.avail_out;
+    }
+    std::string report() const override
+    {
+        std::ostringstream str;
+        str << "deflate: " << zs.total_in << " bytes in, " <<
+            zs.total_out << " bytes out";
+        return str.str();
+    }
+
+private:
+    z_stream zs;
+    bool unflushed{false};  // Taken since the last completed flush
+    bool finished{false};
+};
+
+// Accepts one zlib stream after another, as from a deflate stage that
+// was restarted.
+class InflateTransform : public Transform
+{
+public:
+    InflateTransform()
+    {
+        memset(&zs, 0, sizeof(zs));
+        if (inflateInit(&zs) != Z_OK)
+        {
+            throw TransformException("inflateInit failed");
+        }
+    }
+    ~InflateTransform() { inflateEnd(&zs); }
+
+    bool in_place() const override { return false; }
+    size_t convert(const unsigned char* in, size_t in_length,
+        size_t& consumed, unsigned char* out, size_t out_length,
+        transform_flush flush) override
+    {
+        zs.next_in = (Bytef*)in;
+        zs.avail_in = in_length;
+        zs.next_out = out;
+        zs.avail_out = out_length;
+        int ret = inflate(&zs, Z_NO_FLUSH);
+        if ((ret != Z_OK) && (ret != Z_STREAM_END) && (ret != Z_BUF_ERROR))
+        {
+            throw TransformException(std::string("inflate: ") +
+                (zs.msg ? zs.msg : "failed"));
+        }
+        consumed = in_length - zs.avail_in;
+        size_t produced = out_length - zs.avail_out;
+        total_out += produced;
+        total_in += consumed;
+        if (consumed) between_streams = false;
+        if (ret == Z_STREAM_END)
+        {
+            inflateReset(&zs);
+            between_streams = true;
+        }
+        if ((flush == transform_flush::end) && !between_streams &&
+            (consumed == 0) && (produced == 0))
+        {
+            throw TransformException("inflate: input ended inside a stream");
+        }
+        return produced;
+    }
+    std::string report() const override
+    {
+        std::ostringstream str;
+        str << "inflate: " << total_in << " bytes in, " <<
+            total_out << " bytes out";
+        return str.str();
+    }
+
+private:
+    z_stream zs;
+    bool between_streams{true};
+    // zs.total_* start over with each stream
+    size_t total_in{0};
+    size_t total_out{0};
+};
+
+#endif // HAVE_ZLIB
+
+} // anonymous namespace
+
+std::unique_ptr<Transform> make_transform(const std::string& name)
+{
+    size_t equals = name.find('=');
+    std::string stage = name.substr(0, equals);
+    std::string arg =
+        (equals == std::string::npos) ? "" : name.substr(equals + 1);
+    if ((stage == "count") && arg.empty())
+    {
+        return std::make_unique<CountTransform>();
+    }
+#ifdef HAVE_ZLIB
+    if (stage == "deflate")
+    {
+        int level = default_deflate_level;
+        if (!arg.empty())
+        {
+            if ((arg.size() != 1) || (arg[0] < '0') || (arg[0] > '9'))
+            {
+                return nullptr;
+            }
+            level = arg[0] - '0';
+        }
+        return std::make_unique<DeflateTransform>(level);
+    }
+    if ((stage == "inflate") && arg.empty())
+    {
+        return std::make_unique<InflateTransform>();
+    }
+#endif // HAVE_ZLIB
+    return nullptr;
+}
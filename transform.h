@@ -0,0 +1,56 @@
+#ifndef __TRANSFORM_H_
+#define __TRANSFORM_H_
+
+// Transform stages, between the read ring of a copy engine and its writer.
+// A stage that keeps the length of the data (counting, sampling) works in
+// place on each read. Any other stage (compression) reads the ring, and
+// writes into a second ring, from which the writer takes. Either way, a
+// full ring stops reading, as without a stage.
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+// For data that a stage cannot take, such as a corrupt compressed stream
+struct TransformException
+{
+    TransformException(const std::string& str) : strng(str) { }
+    std::string strng;
+};
+
+// How much a stage must give out from convert()
+enum class transform_flush
+{
+    none,   // As it sees fit
+    sync,   // All it has taken so far: input is idle
+    end     // Everything, and end its output: input has ended
+};
+
+// One instance for each direction of each connection
+class Transform
+{
+public:
+    virtual ~Transform() = default;
+
+    // True for a stage that only calls filter()
+    virtual bool in_place() const = 0;
+    // In place: count bytes just read, at data. They may be rewritten.
+    virtual void filter(unsigned char* data, size_t count);
+    // Otherwise: takes up to in_length bytes from in, and puts up to
+    // out_length bytes into out. Returns the bytes put, and sets consumed
+    // to the bytes taken. The caller stops when neither moves.
+    virtual size_t convert(const unsigned char* in, size_t in_length,
+        size_t& consumed, unsigned char* out, size_t out_length,
+        transform_flush flush);
+    // One line, for the log
+    virtual std::string report() const = 0;
+};
+
+// name is one of
+//     count
+//     deflate[=level]   (needs a build with ZLIB=1)
+//     inflate           (same)
+// nullptr if name is not one of these.
+std::unique_ptr<Transform> make_transform(const std::string& name);
+
+#endif // __TRANSFORM_H_